@@ -0,0 +1,22 @@
+#pragma once
+
+#include "details/ClosureThunk.h"
+
+namespace AsmPatch {
+
+// Owns the closures and thunks which callLambda* creates for capturing lambdas on this thread while an
+// AsmClosureScope for it is alive. release() (or the destructor) destroys the closures and reuses the memory,
+// so the patches calling them have to be reverted or overwritten before. Without a scope they are never freed.
+//
+//   AsmPatch::AsmClosureOwner hooks;
+//   AsmPatch::AsmPatchUndoLog log;
+//   {
+//       AsmPatch::AsmClosureScope scope(hooks);
+//       log = applier.apply(AsmPatch::Patch(addr).callLambdaStdcall([state](int x) { ... }).compile());
+//   }
+//   applier.revert(log);
+//   hooks.release();
+using AsmClosureOwner = AsmBuilder::ClosureThunk::Owner;
+using AsmClosureScope = AsmBuilder::ClosureThunk::OwnerScope;
+
+}
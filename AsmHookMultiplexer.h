@@ -0,0 +1,168 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "details/EpochReclaimer.h"
+
+namespace AsmPatch {
+
+template<typename Signature>
+class AsmHookMultiplexer;
+
+// Runs any number of callbacks from a single hook. The patch site calls the multiplexer once, which
+// walks an immutable array of (function, state) pairs. Adding or removing a callback publishes a new
+// array; calls never take a lock and the old array and removed callbacks are destroyed once no thread
+// can be inside them anymore. Callbacks run in the order they were added.
+//
+// The multiplexer must outlive all patches calling it:
+//   AsmPatch::AsmHookMultiplexer<void(int)> mux;
+//   AsmPatch::Patch(addr).callLambdaStdcall(mux.caller());
+//   auto id = mux.add([](int x) { ... });
+//   mux.remove(id);
+template<typename... Args>
+class AsmHookMultiplexer<void(Args...)>
+{
+	struct Callback
+	{
+		virtual ~Callback() = default;
+	};
+
+	template<typename Func>
+	struct CallbackImpl final : Callback
+	{
+		Func mFunc;
+
+		explicit CallbackImpl(Func func) :
+			mFunc(std::move(func))
+		{}
+
+		static void invoke(Callback* callback, Args... args)
+		{
+			static_cast<CallbackImpl*>(callback)->mFunc(args...);
+		}
+	};
+
+	// Called directly through mInvoke, the virtual destructor is only used to retire the callback
+	struct Entry
+	{
+		void (*mInvoke)(Callback*, Args...);
+		Callback* mCallback;
+		std::uint64_t mId;
+	};
+
+	struct Table
+	{
+		std::vector<Entry> mEntries;
+	};
+
+	std::atomic<Table*> mTable;
+	std::mutex mWriteMutex;
+	std::uint64_t mNextId = 1;
+
+public:
+	using Id = std::uint64_t;
+
+	// Callable which forwards through a pointer to the multiplexer, to be passed to callLambda*.
+	// The multiplexer must outlive every patch calling it.
+	class Caller
+	{
+		const AsmHookMultiplexer* mMultiplexer;
+
+	public:
+		explicit Caller(const AsmHookMultiplexer* multiplexer) :
+			mMultiplexer(multiplexer)
+		{}
+
+		void operator()(Args... args) const
+		{
+			(*mMultiplexer)(args...);
+		}
+	};
+
+	AsmHookMultiplexer() :
+		mTable(new Table())
+	{}
+
+	AsmHookMultiplexer(const AsmHookMultiplexer&) = delete;
+	AsmHookMultiplexer& operator=(const AsmHookMultiplexer&) = delete;
+
+	~AsmHookMultiplexer()
+	{
+		AsmBuilder::EpochReclaimer::defaultDomain().synchronize();
+		Table* table = mTable.load(std::memory_order_relaxed);
+		for (const Entry& entry : table->mEntries) {
+			delete entry.mCallback;
+		}
+		delete table;
+	}
+
+	// Appends func, it is called by every call which starts after add returned
+	template<typename Func>
+	Id add(Func func)
+	{
+		std::unique_ptr<CallbackImpl<Func>> callback(new CallbackImpl<Func>(std::move(func)));
+		std::lock_guard<std::mutex> lock(mWriteMutex);
+		const Id id = mNextId++;
+		std::unique_ptr<Table> table(new Table(*mTable.load(std::memory_order_relaxed)));
+		table->mEntries.push_back({ &CallbackImpl<Func>::invoke, callback.release(), id });
+		publish(table.release());
+		return id;
+	}
+
+	// Returns false if id is unknown. Calls which already started may still run the callback.
+	bool remove(Id id)
+	{
+		std::lock_guard<std::mutex> lock(mWriteMutex);
+		const Table* current = mTable.load(std::memory_order_relaxed);
+		std::unique_ptr<Table> table(new Table());
+		table->mEntries.reserve(current->mEntries.size());
+		Callback* removed = nullptr;
+		for (const Entry& entry : current->mEntries) {
+			if (entry.mId == id) {
+				removed = entry.mCallback;
+			}
+			else {
+				table->mEntries.push_back(entry);
+			}
+		}
+		if (!removed) {
+			return false;
+		}
+		publish(table.release());
+		AsmBuilder::EpochReclaimer::defaultDomain().retire(removed);
+		return true;
+	}
+
+	std::size_t size() const
+	{
+		AsmBuilder::EpochReclaimer::ReadGuard guard;
+		return mTable.load(std::memory_order_seq_cst)->mEntries.size();
+	}
+
+	void operator()(Args... args) const
+	{
+		AsmBuilder::EpochReclaimer::ReadGuard guard;
+		const Table* table = mTable.load(std::memory_order_seq_cst);
+		for (const Entry& entry : table->mEntries) {
+			entry.mInvoke(entry.mCallback, args...);
+		}
+	}
+
+	Caller caller() const
+	{
+		return Caller(this);
+	}
+
+private:
+	void publish(Table* table)
+	{
+		Table* old = mTable.exchange(table, std::memory_order_seq_cst);
+		AsmBuilder::EpochReclaimer::defaultDomain().retire(old);
+	}
+};
+
+}
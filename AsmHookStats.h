@@ -0,0 +1,18 @@
+#pragma once
+
+#include <vector>
+#include "details/HookStats.h"
+
+namespace AsmPatch {
+
+// Call count, total ticks (rdtsc cycles on x86) and a log2 latency histogram of one instrumented hook
+using AsmHookStats = AsmBuilder::HookStats::Stats;
+
+// Merges the per-thread counters of all hooks built with callLambdaInstrumented/safeCallInstrumented.
+// Hooks are only instrumented while ASMPATCH_ENABLE_HOOK_STATS is enabled.
+inline std::vector<AsmHookStats> getHookStats()
+{
+	return AsmBuilder::HookStats::registry().snapshot();
+}
+
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+#include "details/EpochReclaimer.h"
+
+namespace AsmPatch {
+
+template<typename Signature>
+class AsmHotSwapHook;
+
+// Hook payload which can be replaced while other threads are executing it.
+// Calls only announce themselves in a thread local epoch and never take a lock. Replaced payloads
+// are destroyed once no thread can be inside them anymore.
+//
+// The hook itself must outlive all patches calling it:
+//   AsmPatch::AsmHotSwapHook<void(int)> hook([](int x) { ... });
+//   AsmPatch::Patch(addr).callLambdaStdcall(hook.caller());
+//   hook.replace([](int x) { ... });
+template<typename Ret, typename... Args>
+class AsmHotSwapHook<Ret(Args...)>
+{
+	struct Payload
+	{
+		virtual ~Payload() = default;
+		virtual Ret invoke(Args... args) = 0;
+	};
+
+	template<typename Func>
+	struct PayloadImpl final : Payload
+	{
+		Func mFunc;
+
+		explicit PayloadImpl(Func func) :
+			mFunc(std::move(func))
+		{}
+
+		Ret invoke(Args... args) override
+		{
+			return mFunc(args...);
+		}
+	};
+
+	std::atomic<Payload*> mPayload;
+
+public:
+	// Callable which forwards through a pointer to the hook, to be passed to callLambda*.
+	// The hook must outlive every patch calling it.
+	class Caller
+	{
+		const AsmHotSwapHook* mHook;
+
+	public:
+		explicit Caller(const AsmHotSwapHook* hook) :
+			mHook(hook)
+		{}
+
+		Ret operator()(Args... args) const
+		{
+			return (*mHook)(args...);
+		}
+	};
+
+	template<typename Func>
+	explicit AsmHotSwapHook(Func func) :
+		mPayload(new PayloadImpl<Func>(std::move(func)))
+	{}
+
+	AsmHotSwapHook(const AsmHotSwapHook&) = delete;
+	AsmHotSwapHook& operator=(const AsmHotSwapHook&) = delete;
+
+	~AsmHotSwapHook()
+	{
+		AsmBuilder::EpochReclaimer::defaultDomain().synchronize();
+		delete mPayload.load(std::memory_order_relaxed);
+	}
+
+	// Publishes the new payload, the old one is destroyed after the last running call returned
+	template<typename Func>
+	void replace(Func func)
+	{
+		Payload* old = mPayload.exchange(new PayloadImpl<Func>(std::move(func)), std::memory_order_seq_cst);
+		AsmBuilder::EpochReclaimer::defaultDomain().retire(old);
+	}
+
+	Ret operator()(Args... args) const
+	{
+		AsmBuilder::EpochReclaimer::ReadGuard guard;
+		return mPayload.load(std::memory_order_seq_cst)->invoke(args...);
+	}
+
+	Caller caller() const
+	{
+		return Caller(this);
+	}
+};
+
+}
@@ -0,0 +1,328 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <vector>
+#include "AsmPatchSet.h"
+#include "AsmPatchVerifier.h"
+#include "details/MemoryUtils.h"
+
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+namespace AsmPatch {
+
+struct AsmPatchImageIOFailed : std::exception {
+	int mError;
+
+	explicit AsmPatchImageIOFailed(int error) :
+		mError(error)
+	{}
+
+	const char* what() const noexcept override { return "Opening, mapping or syncing the image file failed"; }
+};
+
+struct AsmPatchImageInvalid : std::exception {
+	const char* what() const noexcept override { return "File is no supported ELF or PE image"; }
+};
+
+struct AsmPatchImageUnmapped : std::exception {
+	std::uint64_t mAddress;
+
+	explicit AsmPatchImageUnmapped(std::uint64_t address) :
+		mAddress(address)
+	{}
+
+	const char* what() const noexcept override { return "Patch address is not backed by the image file"; }
+};
+
+enum AsmImageFormat {
+	IMAGE_ELF32,
+	IMAGE_ELF64,
+	IMAGE_PE32,
+	IMAGE_PE64
+};
+
+// Virtual address range [mAddress, mAddress + mSize) stored at mOffset in the file
+struct AsmImageSegment
+{
+	std::uint64_t mAddress;
+	std::uint64_t mSize;
+	std::uint64_t mOffset;
+};
+
+struct AsmImageApplyStats
+{
+	std::size_t mBytesWritten = 0;
+	// File pages written back by the sync
+	std::size_t mPagesWritten = 0;
+};
+
+// Patches an executable file in place through a shared mapping. Patch addresses are the virtual
+// addresses the image is linked at. They are translated through the ELF program headers (the
+// section headers for files without any) or the PE section table. Only the pages which were
+// written are synced back to the file.
+class AsmImagePatcher
+{
+	int mFd = -1;
+	std::uint8_t* mData = nullptr;
+	std::size_t mSize = 0;
+	AsmImageFormat mFormat = IMAGE_ELF32;
+	std::vector<AsmImageSegment> mSegments;
+	AsmPatchVerifier mVerifier;
+
+public:
+	explicit AsmImagePatcher(const char* path)
+	{
+		mFd = open(path, O_RDWR | O_CLOEXEC);
+		if (mFd < 0) {
+			throw AsmPatchImageIOFailed(errno);
+		}
+		try {
+			struct stat info;
+			if (fstat(mFd, &info) != 0) {
+				throw AsmPatchImageIOFailed(errno);
+			}
+			mSize = static_cast<std::size_t>(info.st_size);
+			if (mSize == 0) {
+				throw AsmPatchImageInvalid();
+			}
+			void* data = mmap(nullptr, mSize, PROT_READ | PROT_WRITE, MAP_SHARED, mFd, 0);
+			if (data == MAP_FAILED) {
+				throw AsmPatchImageIOFailed(errno);
+			}
+			mData = static_cast<std::uint8_t*>(data);
+			parse();
+		}
+		catch (...) {
+			close();
+			throw;
+		}
+	}
+
+	AsmImagePatcher(const AsmImagePatcher&) = delete;
+	AsmImagePatcher& operator=(const AsmImagePatcher&) = delete;
+
+	~AsmImagePatcher()
+	{
+		close();
+	}
+
+	AsmImageFormat getFormat() const
+	{
+		return mFormat;
+	}
+
+	AsmConsts::Mode getMode() const
+	{
+		return mFormat == IMAGE_ELF64 || mFormat == IMAGE_PE64 ? AsmConsts::MODE_X64 : AsmConsts::MODE_X86;
+	}
+
+	const std::vector<AsmImageSegment>& getSegments() const
+	{
+		return mSegments;
+	}
+
+	const std::uint8_t* data() const
+	{
+		return mData;
+	}
+
+	std::size_t size() const
+	{
+		return mSize;
+	}
+
+	// File offset of addr, throws AsmPatchImageUnmapped unless all size bytes are stored in the file
+	std::size_t fileOffset(std::uint64_t addr, std::size_t size) const
+	{
+		for (const AsmImageSegment& segment : mSegments) {
+			if (addr >= segment.mAddress && addr - segment.mAddress < segment.mSize && segment.mSize - (addr - segment.mAddress) >= size) {
+				return static_cast<std::size_t>(segment.mOffset + (addr - segment.mAddress));
+			}
+		}
+		throw AsmPatchImageUnmapped(addr);
+	}
+
+	// Verifies the expected bytes of all patches and translates them before anything is written
+	AsmImageApplyStats apply(const AsmPatchSet& set)
+	{
+		std::vector<std::size_t> offsets;
+		offsets.reserve(set.size());
+		std::vector<AsmPatchMismatch> mismatches;
+		for (const auto& entry : set.getPatches()) {
+			const AsmPatchData& patch = entry.second;
+			const std::size_t offset = fileOffset(patch.getAddress(), patch.getData().size());
+			offsets.push_back(offset);
+			if (patch.hasExpectation()) {
+				std::vector<AsmPatchMismatch> found = mVerifier.verify(&patch, 1, mData + offset, segmentEnd(offset) - offset, patch.getAddress());
+				mismatches.insert(mismatches.end(), found.begin(), found.end());
+			}
+		}
+		if (!mismatches.empty()) {
+			throw AsmPatchExpectationFailed(std::move(mismatches));
+		}
+
+		namespace MemoryUtils = AsmBuilder::MemoryUtils;
+		const std::size_t pageSize = MemoryUtils::pageSize();
+		AsmImageApplyStats stats;
+		std::vector<std::size_t> pages;
+		std::size_t index = 0;
+		for (const auto& entry : set.getPatches()) {
+			const AsmPatchData& patch = entry.second;
+			const std::size_t offset = offsets[index++];
+			if (patch.getData().empty()) {
+				continue;
+			}
+			std::memcpy(mData + offset, patch.getData().data(), patch.getData().size());
+			stats.mBytesWritten += patch.getData().size();
+			for (std::size_t page = offset / pageSize; page <= (offset + patch.getData().size() - 1) / pageSize; page++) {
+				pages.push_back(page);
+			}
+		}
+
+		std::sort(pages.begin(), pages.end());
+		pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+		stats.mPagesWritten = pages.size();
+		for (std::size_t i = 0; i < pages.size();) {
+			std::size_t last = i;
+			while (last + 1 < pages.size() && pages[last + 1] == pages[last] + 1) {
+				last++;
+			}
+			if (msync(mData + pages[i] * pageSize, (pages[last] - pages[i] + 1) * pageSize, MS_SYNC) != 0) {
+				throw AsmPatchImageIOFailed(errno);
+			}
+			i = last + 1;
+		}
+		return stats;
+	}
+
+	AsmImageApplyStats apply(const AsmPatchData& patch)
+	{
+		AsmPatchSet set(AsmBuilder::MemoryUtils::pageSize());
+		set.add(patch);
+		return apply(set);
+	}
+
+private:
+	void close()
+	{
+		if (mData) {
+			munmap(mData, mSize);
+			mData = nullptr;
+		}
+		if (mFd >= 0) {
+			::close(mFd);
+			mFd = -1;
+		}
+	}
+
+	std::size_t segmentEnd(std::size_t offset) const
+	{
+		for (const AsmImageSegment& segment : mSegments) {
+			if (offset >= segment.mOffset && offset - segment.mOffset < segment.mSize) {
+				return static_cast<std::size_t>(segment.mOffset + segment.mSize);
+			}
+		}
+		return offset;
+	}
+
+	template<typename T>
+	T read(std::uint64_t offset) const
+	{
+		if (offset > mSize || mSize - offset < sizeof(T)) {
+			throw AsmPatchImageInvalid();
+		}
+		T value;
+		std::memcpy(&value, mData + offset, sizeof(T));
+		return value;
+	}
+
+	void addSegment(std::uint64_t address, std::uint64_t size, std::uint64_t offset)
+	{
+		if (size == 0) {
+			return;
+		}
+		if (offset > mSize || mSize - offset < size) {
+			throw AsmPatchImageInvalid();
+		}
+		mSegments.push_back({ address, size, offset });
+	}
+
+	void parse()
+	{
+		if (mSize >= SELFMAG && std::memcmp(mData, ELFMAG, SELFMAG) == 0) {
+			if (read<std::uint8_t>(EI_DATA) != ELFDATA2LSB) {
+				throw AsmPatchImageInvalid();
+			}
+			switch (read<std::uint8_t>(EI_CLASS)) {
+			case ELFCLASS32: mFormat = IMAGE_ELF32; return parseElf<Elf32_Ehdr, Elf32_Phdr, Elf32_Shdr>();
+			case ELFCLASS64: mFormat = IMAGE_ELF64; return parseElf<Elf64_Ehdr, Elf64_Phdr, Elf64_Shdr>();
+			default: throw AsmPatchImageInvalid();
+			}
+		}
+		if (mSize >= 0x40 && read<std::uint16_t>(0) == 0x5A4D) {
+			return parsePe();
+		}
+		throw AsmPatchImageInvalid();
+	}
+
+	template<typename Ehdr, typename Phdr, typename Shdr>
+	void parseElf()
+	{
+		const Ehdr header = read<Ehdr>(0);
+		for (std::uint64_t i = 0; i < header.e_phnum; i++) {
+			const Phdr segment = read<Phdr>(header.e_phoff + i * header.e_phentsize);
+			if (segment.p_type == PT_LOAD) {
+				addSegment(segment.p_vaddr, segment.p_filesz, segment.p_offset);
+			}
+		}
+		if (header.e_phnum != 0) {
+			return;
+		}
+		// Object files only have sections
+		for (std::uint64_t i = 0; i < header.e_shnum; i++) {
+			const Shdr section = read<Shdr>(header.e_shoff + i * header.e_shentsize);
+			if ((section.sh_flags & SHF_ALLOC) && section.sh_type != SHT_NOBITS) {
+				addSegment(section.sh_addr, section.sh_size, section.sh_offset);
+			}
+		}
+	}
+
+	void parsePe()
+	{
+		const std::uint32_t peOffset = read<std::uint32_t>(0x3C);
+		if (read<std::uint32_t>(peOffset) != 0x00004550) {
+			throw AsmPatchImageInvalid();
+		}
+		// COFF file header follows the signature, the optional header follows the file header
+		const std::uint16_t sectionCount = read<std::uint16_t>(peOffset + 6);
+		const std::uint16_t optionalSize = read<std::uint16_t>(peOffset + 20);
+		const std::uint64_t optional = peOffset + 24;
+		std::uint64_t imageBase;
+		switch (read<std::uint16_t>(optional)) {
+		case 0x10B: mFormat = IMAGE_PE32; imageBase = read<std::uint32_t>(optional + 28); break;
+		case 0x20B: mFormat = IMAGE_PE64; imageBase = read<std::uint64_t>(optional + 24); break;
+		default: throw AsmPatchImageInvalid();
+		}
+
+		const std::uint64_t sections = optional + optionalSize;
+		for (std::uint64_t i = 0; i < sectionCount; i++) {
+			const std::uint64_t section = sections + i * 40;
+			const std::uint32_t virtualSize = read<std::uint32_t>(section + 8);
+			const std::uint32_t virtualAddress = read<std::uint32_t>(section + 12);
+			const std::uint32_t rawSize = read<std::uint32_t>(section + 16);
+			const std::uint32_t rawOffset = read<std::uint32_t>(section + 20);
+			// Raw data is padded to the file alignment, the loader zero fills beyond the raw data
+			const std::uint32_t size = virtualSize != 0 && virtualSize < rawSize ? virtualSize : rawSize;
+			addSegment(imageBase + virtualAddress, size, rawOffset);
+		}
+	}
+};
+
+}
@@ -0,0 +1,276 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include "AsmPatchBuilder.h"
+#include "details/X86OpcodeTables.h"
+
+namespace AsmPatch {
+
+struct AsmPatchDecodeFailed : std::exception {
+	const char* what() const noexcept override { return "Unknown or truncated instruction"; }
+};
+
+enum AsmInstructionKind : std::uint8_t {
+	INSTR_OTHER,
+	// jmp rel8/rel32
+	INSTR_JMP,
+	// jcc rel8/rel32
+	INSTR_JCC,
+	// call rel32
+	INSTR_CALL,
+	// loop/loope/loopne/jcxz rel8
+	INSTR_LOOP,
+	INSTR_RET,
+	INSTR_JMP_INDIRECT,
+	INSTR_CALL_INDIRECT
+};
+
+// Length and fixup relevant fields of one decoded instruction, all offsets are relative to its first byte
+struct AsmInstruction
+{
+	std::uint8_t mLength = 0;
+	// 0: one byte opcode, 1: 0F xx, 2: 0F 38 xx, 3: 0F 3A xx (also for VEX/EVEX)
+	std::uint8_t mMap = 0;
+	std::uint8_t mOpcode = 0;
+	std::uint8_t mOpcodeOffset = 0;
+	std::uint8_t mModRM = 0;
+	bool mHasModRM = false;
+	std::uint8_t mDispOffset = 0;
+	std::uint8_t mDispSize = 0;
+	std::uint8_t mImmOffset = 0;
+	std::uint8_t mImmSize = 0;
+	// The immediate is a branch displacement relative to the next instruction
+	bool mRelative = false;
+	// The displacement is relative to the next instruction ([rip+disp32])
+	bool mRipRelative = false;
+	AsmInstructionKind mKind = INSTR_OTHER;
+
+	// Target of a relative branch located at addr
+	std::uintptr_t branchTarget(const std::uint8_t* code, std::uintptr_t addr) const
+	{
+		return addr + mLength + static_cast<std::uintptr_t>(readSigned(code + mImmOffset, mImmSize));
+	}
+
+	// Address referenced by a rip relative operand of an instruction located at addr
+	std::uintptr_t ripTarget(const std::uint8_t* code, std::uintptr_t addr) const
+	{
+		return addr + mLength + static_cast<std::uintptr_t>(readSigned(code + mDispOffset, mDispSize));
+	}
+
+	static std::intptr_t readSigned(const std::uint8_t* bytes, std::size_t size)
+	{
+		switch (size) {
+		case 1: return static_cast<std::int8_t>(bytes[0]);
+		case 2: return static_cast<std::int16_t>(bytes[0] | (bytes[1] << 8));
+		case 4: return static_cast<std::int32_t>(bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (static_cast<std::uint32_t>(bytes[3]) << 24));
+		default: return 0;
+		}
+	}
+};
+
+// Table driven length decoder for the general purpose, x87, SSE and VEX/EVEX encoded instructions.
+// Returns false for unknown opcodes or if the instruction extends beyond available bytes.
+inline bool decodeInstruction(const std::uint8_t* code, std::size_t available, AsmConsts::Mode mode, AsmInstruction& out)
+{
+	using namespace AsmBuilder::X86OpcodeTables;
+
+	const bool x64 = mode == AsmConsts::MODE_X64;
+	const std::size_t limit = available < 15 ? available : 15;
+	std::size_t pos = 0;
+	bool operandSize16 = false;
+	bool addressOverride = false;
+	bool rexW = false;
+
+	while (pos < limit && (OneByte[code[pos]] & OP_PREFIX)) {
+		operandSize16 |= code[pos] == 0x66;
+		addressOverride |= code[pos] == 0x67;
+		pos++;
+	}
+	if (x64 && pos < limit && (code[pos] & 0xF0) == 0x40) {
+		rexW = (code[pos] & 0x08) != 0;
+		pos++;
+	}
+	if (pos >= limit) {
+		return false;
+	}
+
+	out = AsmInstruction();
+	std::uint8_t opcode = code[pos];
+	std::uint16_t flags;
+
+	// VEX/EVEX are only valid as such in 32-bit mode if the following byte looks like a register ModRM
+	const bool vex = (opcode == 0xC4 || opcode == 0xC5 || opcode == 0x62)
+		&& pos + 1 < limit && (x64 || (code[pos + 1] & 0xC0) == 0xC0);
+	if (vex) {
+		std::size_t prefixSize = opcode == 0xC5 ? 2 : opcode == 0xC4 ? 3 : 4;
+		if (pos + prefixSize >= limit) {
+			return false;
+		}
+		out.mMap = opcode == 0xC5 ? 1 : opcode == 0xC4 ? (code[pos + 1] & 0x1F) : (code[pos + 1] & 0x03);
+		if (out.mMap == 0) {
+			return false;
+		}
+		pos += prefixSize;
+	}
+	else if (opcode == 0x0F) {
+		if (pos + 1 >= limit) {
+			return false;
+		}
+		out.mMap = code[pos + 1] == 0x38 ? 2 : code[pos + 1] == 0x3A ? 3 : 1;
+		pos += out.mMap == 1 ? 1 : 2;
+	}
+	if (pos >= limit) {
+		return false;
+	}
+
+	opcode = code[pos];
+	out.mOpcode = opcode;
+	out.mOpcodeOffset = static_cast<std::uint8_t>(pos++);
+	switch (out.mMap) {
+	case 0: flags = OneByte[opcode]; break;
+	case 1: flags = TwoByte[opcode]; break;
+	case 2: flags = OP_MODRM; break;
+	case 3: flags = OP_MODRM | OP_IMM8; break;
+	default: return false;
+	}
+	if ((flags & (OP_INVALID | OP_PREFIX)) || (x64 && (flags & OP_INVALID_X64))) {
+		return false;
+	}
+
+	if (flags & OP_MODRM) {
+		if (pos >= limit) {
+			return false;
+		}
+		const std::uint8_t modrm = code[pos++];
+		const std::uint8_t mod = modrm >> 6;
+		const std::uint8_t rm = modrm & 7;
+		out.mModRM = modrm;
+		out.mHasModRM = true;
+
+		std::uint8_t dispSize = 0;
+		if (!x64 && addressOverride) {
+			if ((mod == 0 && rm == 6) || mod == 2) {
+				dispSize = 2;
+			}
+			else if (mod == 1) {
+				dispSize = 1;
+			}
+		}
+		else if (mod != 3) {
+			if (rm == 4) {
+				if (pos >= limit) {
+					return false;
+				}
+				if (mod == 0 && (code[pos] & 7) == 5) {
+					dispSize = 4;
+				}
+				pos++;
+			}
+			if (mod == 0 && rm == 5) {
+				dispSize = 4;
+				out.mRipRelative = x64;
+			}
+			else if (mod == 1) {
+				dispSize = 1;
+			}
+			else if (mod == 2) {
+				dispSize = 4;
+			}
+		}
+		out.mDispOffset = static_cast<std::uint8_t>(pos);
+		out.mDispSize = dispSize;
+		pos += dispSize;
+
+		// test r/m, imm
+		if (out.mMap == 0 && (opcode == 0xF6 || opcode == 0xF7) && ((modrm >> 3) & 7) < 2) {
+			flags |= opcode == 0xF6 ? OP_IMM8 : OP_IMMZ;
+		}
+	}
+
+	std::size_t immSize = 0;
+	if (flags & OP_IMM8) {
+		immSize += 1;
+	}
+	if (flags & OP_IMM16) {
+		immSize += 2;
+	}
+	if (flags & OP_IMMZ) {
+		immSize += operandSize16 ? 2 : 4;
+	}
+	if (flags & OP_IMMV) {
+		immSize += rexW ? 8 : operandSize16 ? 2 : 4;
+	}
+	if (flags & OP_MOFFS) {
+		immSize += x64 ? (addressOverride ? 4 : 8) : (addressOverride ? 2 : 4);
+	}
+	if (flags & OP_REL8) {
+		immSize += 1;
+	}
+	if (flags & OP_RELZ) {
+		immSize += x64 || !operandSize16 ? 4 : 2;
+	}
+	out.mImmOffset = static_cast<std::uint8_t>(pos);
+	out.mImmSize = static_cast<std::uint8_t>(immSize);
+	out.mRelative = (flags & (OP_REL8 | OP_RELZ)) != 0;
+	pos += immSize;
+	if (pos > limit) {
+		return false;
+	}
+	out.mLength = static_cast<std::uint8_t>(pos);
+
+	if (out.mMap == 0) {
+		if (opcode >= 0x70 && opcode <= 0x7F) {
+			out.mKind = INSTR_JCC;
+		}
+		else if (opcode == 0xEB || opcode == 0xE9) {
+			out.mKind = INSTR_JMP;
+		}
+		else if (opcode == 0xE8) {
+			out.mKind = INSTR_CALL;
+		}
+		else if (opcode >= 0xE0 && opcode <= 0xE3) {
+			out.mKind = INSTR_LOOP;
+		}
+		else if (opcode == 0xC2 || opcode == 0xC3 || opcode == 0xCA || opcode == 0xCB || opcode == 0xCF) {
+			out.mKind = INSTR_RET;
+		}
+		else if (opcode == 0xFF && (((out.mModRM >> 3) & 7) == 2 || ((out.mModRM >> 3) & 7) == 3)) {
+			out.mKind = INSTR_CALL_INDIRECT;
+		}
+		else if (opcode == 0xFF && (((out.mModRM >> 3) & 7) == 4 || ((out.mModRM >> 3) & 7) == 5)) {
+			out.mKind = INSTR_JMP_INDIRECT;
+		}
+	}
+	else if (out.mMap == 1 && !vex && opcode >= 0x80 && opcode <= 0x8F) {
+		out.mKind = INSTR_JCC;
+	}
+	return true;
+}
+
+inline AsmInstruction decodeInstruction(const std::uint8_t* code, std::size_t available, AsmConsts::Mode mode = AsmConsts::MODE_HOST)
+{
+	AsmInstruction instruction;
+	if (!decodeInstruction(code, available, mode, instruction)) {
+		throw AsmPatchDecodeFailed();
+	}
+	return instruction;
+}
+
+// Length of the whole instructions starting at code which cover at least minSize bytes,
+// e.g. the bytes a detour jmp overwrites and which have to be nop padded or relocated
+inline std::size_t coveringLength(const std::uint8_t* code, std::size_t available, std::size_t minSize, AsmConsts::Mode mode = AsmConsts::MODE_HOST)
+{
+	std::size_t length = 0;
+	AsmInstruction instruction;
+	while (length < minSize) {
+		if (!decodeInstruction(code + length, available - length, mode, instruction)) {
+			throw AsmPatchDecodeFailed();
+		}
+		length += instruction.mLength;
+	}
+	return length;
+}
+
+}
@@ -0,0 +1,475 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <vector>
+#include "AsmPatchSet.h"
+#include "AsmPatchVerifier.h"
+#include "details/MemoryUtils.h"
+
+namespace AsmPatch {
+
+struct AsmPatchProtectFailed : std::exception {
+	int mError;
+
+	explicit AsmPatchProtectFailed(int error) :
+		mError(error)
+	{}
+
+	const char* what() const noexcept override { return "Changing the memory protection failed"; }
+};
+
+struct AsmPatchNotLivePatchable : std::exception {
+	const char* what() const noexcept override { return "Patch starts at the last byte of a cache line and cannot be installed live"; }
+};
+
+struct AsmPatchLiveUnsupported : std::exception {
+	const char* what() const noexcept override { return "The kernel cannot serialize other threads (membarrier SYNC_CORE), patches cannot be staged live"; }
+};
+
+enum class AsmPatchWriteMode {
+	// Plain copies, the patched code must not run during apply()
+	Copy,
+	// Installs every patch without a moment where other threads could execute a partially written
+	// instruction, see AsmPatchApplier
+	Live
+};
+
+struct AsmPatchApplyTimings
+{
+	std::chrono::nanoseconds mLayout{};
+	std::chrono::nanoseconds mUnprotect{};
+	std::chrono::nanoseconds mWrite{};
+	std::chrono::nanoseconds mFlush{};
+	std::chrono::nanoseconds mProtect{};
+
+	std::chrono::nanoseconds total() const
+	{
+		return mLayout + mUnprotect + mWrite + mFlush + mProtect;
+	}
+};
+
+// What AsmPatchApplier::reapply() left alone, pages count in the page size of the new set
+struct AsmPatchReapplyStats
+{
+	std::size_t mBytesWritten = 0;
+	// Bytes of the new and the reverted patches which already held the right value
+	std::size_t mBytesSkipped = 0;
+	std::size_t mPagesWritten = 0;
+	// Pages of the new and the reverted patches which were neither unprotected nor written
+	std::size_t mPagesSkipped = 0;
+};
+
+// Original bytes of an applied batch, laid out exactly like the batch itself
+class AsmPatchUndoLog
+{
+	friend class AsmPatchApplier;
+	AsmPatchLayout mOriginal;
+
+public:
+	const AsmPatchLayout& getLayout() const
+	{
+		return mOriginal;
+	}
+
+	bool empty() const
+	{
+		return mOriginal.mRuns.empty();
+	}
+};
+
+// Applies patches to the memory of the current process.
+// Every page span of a batch is made writable once, all runs are written, then the
+// original protection is restored. Executable pages stay executable while being written,
+// so other threads running code on the same pages do not fault.
+//
+// AsmPatchWriteMode::Live patches code which is running, without suspending any thread. A patch within one
+// aligned 8-byte word is written with a single atomic store. Longer patches are staged: the first two bytes
+// become a jmp to itself (EB FE) which holds arriving threads, then the rest is written and finally the
+// first two bytes of the patch replace the loop. Every thread is serialized between the steps, one step at
+// a time for the whole batch. Patches are not merged with their neighbours in this mode. Staging needs
+// membarrier SYNC_CORE (Linux 4.16), without it AsmPatchLiveUnsupported is thrown before anything is written.
+// No thread may be inside the replaced bytes other than at their start, so a live patch should replace a
+// single instruction or a nop of the same length (a hot patch point).
+//
+// reapply() replaces an applied batch with a new one and only writes the bytes which change. In Live mode
+// a patch is rewritten as a whole if any of its bytes changes, so the staged install stays intact.
+class AsmPatchApplier
+{
+	using Clock = std::chrono::steady_clock;
+
+	AsmPatchWriteMode mMode;
+	AsmPatchApplyTimings mLastTimings;
+	AsmPatchReapplyStats mLastReapplyStats;
+	AsmPatchVerifier mVerifier;
+
+public:
+	explicit AsmPatchApplier(AsmPatchWriteMode mode = AsmPatchWriteMode::Copy) :
+		mMode(mode)
+	{}
+
+	// Throws AsmPatchExpectationFailed without writing anything if any patch of the batch
+	// finds other original bytes than it expects
+	AsmPatchUndoLog apply(const AsmPatchSet& set)
+	{
+		mLastTimings = {};
+
+		std::vector<AsmPatchMismatch> mismatches = mVerifier.verify(set);
+		if (!mismatches.empty()) {
+			throw AsmPatchExpectationFailed(std::move(mismatches));
+		}
+
+		Clock::time_point start = Clock::now();
+		AsmPatchLayout layout = set.getLayout(mMode == AsmPatchWriteMode::Copy);
+		if (mMode == AsmPatchWriteMode::Live) {
+			checkLivePatchable(layout);
+		}
+		mLastTimings.mLayout = Clock::now() - start;
+
+		AsmPatchUndoLog log;
+		log.mOriginal.mPageRanges = layout.mPageRanges;
+		log.mOriginal.mRuns.reserve(layout.mRuns.size());
+		write(layout, &log.mOriginal.mRuns);
+		return log;
+	}
+
+	AsmPatchUndoLog apply(const AsmPatchData& patch)
+	{
+		AsmPatchSet set(AsmBuilder::MemoryUtils::pageSize());
+		set.add(patch);
+		return apply(set);
+	}
+
+	// Restores the original bytes of a whole batch in a single pass
+	void revert(const AsmPatchUndoLog& log)
+	{
+		mLastTimings = {};
+		if (mMode == AsmPatchWriteMode::Live) {
+			checkLivePatchable(log.mOriginal);
+		}
+		write(log.mOriginal, nullptr);
+	}
+
+	// Replaces the batch applied with previous by set: bytes only patched by the previous batch are
+	// restored, the patches of set are written, and everything which already holds these bytes is
+	// skipped. Pages without any change keep their protection and are not flushed.
+	// Expectations of set are checked against the original bytes, not the previously patched ones.
+	// Returns the undo log of set, previous must not be used anymore.
+	AsmPatchUndoLog reapply(const AsmPatchUndoLog& previous, const AsmPatchSet& set)
+	{
+		mLastTimings = {};
+		mLastReapplyStats = {};
+
+		std::vector<AsmPatchMismatch> mismatches = verifyOriginals(previous, set);
+		if (!mismatches.empty()) {
+			throw AsmPatchExpectationFailed(std::move(mismatches));
+		}
+
+		Clock::time_point start = Clock::now();
+		AsmPatchLayout layout = set.getLayout(mMode == AsmPatchWriteMode::Copy);
+
+		AsmPatchUndoLog log;
+		log.mOriginal.mPageRanges = layout.mPageRanges;
+		log.mOriginal.mRuns.reserve(layout.mRuns.size());
+		for (const AsmPatchData& run : layout.mRuns) {
+			log.mOriginal.mRuns.emplace_back(run.getAddress(), reinterpret_cast<const std::uint8_t*>(run.getAddress()), run.getData().size());
+			overlayOriginals(previous, log.mOriginal.mRuns.back());
+		}
+
+		// Bytes every address should hold afterwards, sorted by address
+		std::vector<AsmPatchData> targets = layout.mRuns;
+		subtractRuns(previous.mOriginal.mRuns, layout.mRuns, targets);
+		std::sort(targets.begin(), targets.end(), [](const AsmPatchData& lhs, const AsmPatchData& rhs) {
+			return lhs.getAddress() < rhs.getAddress();
+		});
+
+		AsmPatchSet changes(set.getPageSize());
+		AsmPatchSet touched(set.getPageSize());
+		for (const AsmPatchData& target : targets) {
+			touched.add(target);
+			addChanges(target, changes);
+		}
+		AsmPatchLayout changed = changes.getLayout(mMode == AsmPatchWriteMode::Copy);
+		if (mMode == AsmPatchWriteMode::Live) {
+			checkLivePatchable(changed);
+		}
+		mLastTimings.mLayout = Clock::now() - start;
+
+		for (const AsmPatchData& run : changed.mRuns) {
+			mLastReapplyStats.mBytesWritten += run.getData().size();
+		}
+		for (const AsmPatchData& target : targets) {
+			mLastReapplyStats.mBytesSkipped += target.getData().size();
+		}
+		mLastReapplyStats.mBytesSkipped -= mLastReapplyStats.mBytesWritten;
+		mLastReapplyStats.mPagesWritten = changed.pageCount(set.getPageSize());
+		mLastReapplyStats.mPagesSkipped = touched.getLayout().pageCount(set.getPageSize()) - mLastReapplyStats.mPagesWritten;
+
+		if (!changed.mRuns.empty()) {
+			write(changed, nullptr);
+		}
+		return log;
+	}
+
+	const AsmPatchApplyTimings& getLastTimings() const
+	{
+		return mLastTimings;
+	}
+
+	const AsmPatchReapplyStats& getLastReapplyStats() const
+	{
+		return mLastReapplyStats;
+	}
+
+private:
+	void write(const AsmPatchLayout& layout, std::vector<AsmPatchData>* originals)
+	{
+		namespace MemoryUtils = AsmBuilder::MemoryUtils;
+
+		const std::uintptr_t pageSize = MemoryUtils::pageSize();
+		std::vector<MemoryUtils::MappedRegion> regions;
+
+		Clock::time_point start = Clock::now();
+		MemoryUtils::ProtectionMap protections;
+		for (const AsmPatchPageRange& range : layout.mPageRanges) {
+			std::uintptr_t begin = MemoryUtils::alignDown(range.mBegin, pageSize);
+			std::uintptr_t end = MemoryUtils::alignUp(range.mEnd, pageSize);
+			if (!protections.split(begin, end, regions)) {
+				throw AsmPatchProtectFailed(ENOMEM);
+			}
+		}
+		for (std::size_t i = 0; i < regions.size(); i++) {
+			const MemoryUtils::MappedRegion& region = regions[i];
+			if (!MemoryUtils::protect(region.mBegin, region.mEnd, region.mProt | PROT_READ | PROT_WRITE)) {
+				int error = errno;
+				restoreProtection(regions, i);
+				throw AsmPatchProtectFailed(error);
+			}
+		}
+		Clock::time_point unprotected = Clock::now();
+		mLastTimings.mUnprotect = unprotected - start;
+
+		for (const AsmPatchData& run : layout.mRuns) {
+			std::uint8_t* target = reinterpret_cast<std::uint8_t*>(run.getAddress());
+			if (originals) {
+				originals->emplace_back(run.getAddress(), target, run.getData().size());
+			}
+			if (mMode == AsmPatchWriteMode::Copy) {
+				std::memcpy(target, run.getData().data(), run.getData().size());
+			}
+		}
+		bool serialized = true;
+		if (mMode == AsmPatchWriteMode::Live) {
+			try {
+				serialized = writeLive(layout);
+			}
+			catch (...) {
+				restoreProtection(regions, regions.size());
+				throw;
+			}
+		}
+		Clock::time_point written = Clock::now();
+		mLastTimings.mWrite = written - unprotected;
+
+		for (const AsmPatchData& run : layout.mRuns) {
+			MemoryUtils::flushInstructionCache(run.getAddress(), run.getAddress() + run.getData().size());
+		}
+		Clock::time_point flushed = Clock::now();
+		mLastTimings.mFlush = flushed - written;
+
+		restoreProtection(regions, regions.size());
+		mLastTimings.mProtect = Clock::now() - flushed;
+		if (!serialized) {
+			throw AsmPatchLiveUnsupported();
+		}
+	}
+
+	// Copies the original bytes recorded in log over the bytes of patch they overlap
+	static void overlayOriginals(const AsmPatchUndoLog& log, AsmPatchData& patch)
+	{
+		const std::vector<AsmPatchData>& runs = log.mOriginal.mRuns;
+		const std::uintptr_t begin = patch.getAddress();
+		const std::uintptr_t end = begin + patch.getData().size();
+		auto run = std::upper_bound(runs.begin(), runs.end(), begin, [](std::uintptr_t addr, const AsmPatchData& run) {
+			return addr < run.getAddress();
+		});
+		if (run != runs.begin()) {
+			--run;
+		}
+		for (; run != runs.end() && run->getAddress() < end; ++run) {
+			const std::uintptr_t from = std::max(begin, run->getAddress());
+			const std::uintptr_t to = std::min(end, run->getAddress() + run->getData().size());
+			if (from < to) {
+				std::memcpy(patch.getDataRef().data() + (from - begin), run->getData().data() + (from - run->getAddress()), to - from);
+			}
+		}
+	}
+
+	std::vector<AsmPatchMismatch> verifyOriginals(const AsmPatchUndoLog& previous, const AsmPatchSet& set) const
+	{
+		std::vector<AsmPatchMismatch> mismatches;
+		for (const auto& entry : set.getPatches()) {
+			const AsmPatchData& patch = entry.second;
+			const std::size_t size = patch.getExpected().size();
+			if (size == 0) {
+				continue;
+			}
+			AsmPatchData original(patch.getAddress(), reinterpret_cast<const std::uint8_t*>(patch.getAddress()), size);
+			overlayOriginals(previous, original);
+			std::vector<AsmPatchMismatch> found = mVerifier.verify(&patch, 1, original.getData().data(), size, patch.getAddress());
+			mismatches.insert(mismatches.end(), found.begin(), found.end());
+		}
+		return mismatches;
+	}
+
+	// Appends the parts of the sorted runs which are not covered by the sorted covering runs to out
+	static void subtractRuns(const std::vector<AsmPatchData>& runs, const std::vector<AsmPatchData>& covering, std::vector<AsmPatchData>& out)
+	{
+		std::size_t first = 0;
+		for (const AsmPatchData& run : runs) {
+			const std::uintptr_t begin = run.getAddress();
+			const std::uintptr_t end = begin + run.getData().size();
+			while (first < covering.size() && covering[first].getAddress() + covering[first].getData().size() <= begin) {
+				first++;
+			}
+			std::uintptr_t cursor = begin;
+			for (std::size_t i = first; i < covering.size() && covering[i].getAddress() < end; i++) {
+				if (covering[i].getAddress() > cursor) {
+					out.emplace_back(cursor, run.getData().data() + (cursor - begin), covering[i].getAddress() - cursor);
+				}
+				cursor = std::max(cursor, covering[i].getAddress() + covering[i].getData().size());
+			}
+			if (cursor < end) {
+				out.emplace_back(cursor, run.getData().data() + (cursor - begin), end - cursor);
+			}
+		}
+	}
+
+	// Adds the ranges of target which differ from the memory, in Live mode target as a whole
+	void addChanges(const AsmPatchData& target, AsmPatchSet& changes) const
+	{
+		const std::uint8_t* current = reinterpret_cast<const std::uint8_t*>(target.getAddress());
+		const std::uint8_t* bytes = target.getData().data();
+		const std::size_t size = target.getData().size();
+		if (mMode == AsmPatchWriteMode::Live) {
+			if (std::memcmp(current, bytes, size) != 0) {
+				changes.add(target);
+			}
+			return;
+		}
+		std::size_t offset = 0;
+		while (offset < size) {
+			while (offset < size && current[offset] == bytes[offset]) {
+				offset++;
+			}
+			const std::size_t begin = offset;
+			while (offset < size && current[offset] != bytes[offset]) {
+				offset++;
+			}
+			if (begin < offset) {
+				changes.add(AsmPatchData(target.getAddress() + begin, bytes + begin, offset - begin));
+			}
+		}
+	}
+
+	static bool fitsWord(std::uintptr_t addr, std::size_t size)
+	{
+		return addr % 8 + size <= 8;
+	}
+
+	static void checkLivePatchable(const AsmPatchLayout& layout)
+	{
+		bool staged = false;
+		for (const AsmPatchData& run : layout.mRuns) {
+			if (fitsWord(run.getAddress(), run.getData().size())) {
+				continue;
+			}
+			if (run.getAddress() % 64 == 63) {
+				throw AsmPatchNotLivePatchable();
+			}
+			staged = true;
+		}
+		if (staged && !AsmBuilder::MemoryUtils::canSerializeAllThreads()) {
+			throw AsmPatchLiveUnsupported();
+		}
+	}
+
+	// Stores size bytes at addr with a single atomic store, addr must not cross a cache line boundary
+	static void storeAtomic(std::uintptr_t addr, const std::uint8_t* bytes, std::size_t size)
+	{
+		if (fitsWord(addr, size)) {
+			std::uint64_t* word = reinterpret_cast<std::uint64_t*>(addr - addr % 8);
+			std::uint64_t value = __atomic_load_n(word, __ATOMIC_RELAXED);
+			std::memcpy(reinterpret_cast<std::uint8_t*>(&value) + addr % 8, bytes, size);
+			__atomic_store_n(word, value, __ATOMIC_SEQ_CST);
+			return;
+		}
+		// Two bytes crossing a word boundary, x86 stores them atomically within a cache line
+		std::uint16_t value;
+		std::memcpy(&value, bytes, sizeof(value));
+		__atomic_store_n(reinterpret_cast<std::uint16_t*>(addr), value, __ATOMIC_SEQ_CST);
+	}
+
+	// Returns false if a serialization failed after the tails were written, the patches are complete then
+	// but other threads may have run a mix of old and new bytes. If the first one fails the heads are
+	// restored and AsmPatchLiveUnsupported is thrown, leaving the staged patches as they were.
+	static bool writeLive(const AsmPatchLayout& layout)
+	{
+		namespace MemoryUtils = AsmBuilder::MemoryUtils;
+		static constexpr std::uint8_t SelfLoop[] = { 0xEB, 0xFE };
+
+		// Single stores are written with the tails, so nothing has changed if the first serialization fails
+		std::vector<std::uint8_t> heads;
+		for (const AsmPatchData& run : layout.mRuns) {
+			if (!fitsWord(run.getAddress(), run.getData().size())) {
+				const std::uint8_t* head = reinterpret_cast<const std::uint8_t*>(run.getAddress());
+				heads.insert(heads.end(), head, head + sizeof(SelfLoop));
+				storeAtomic(run.getAddress(), SelfLoop, sizeof(SelfLoop));
+			}
+		}
+
+		if (!heads.empty() && !MemoryUtils::serializeAllThreads()) {
+			const std::uint8_t* head = heads.data();
+			for (const AsmPatchData& run : layout.mRuns) {
+				if (!fitsWord(run.getAddress(), run.getData().size())) {
+					storeAtomic(run.getAddress(), head, sizeof(SelfLoop));
+					head += sizeof(SelfLoop);
+				}
+			}
+			throw AsmPatchLiveUnsupported();
+		}
+		for (const AsmPatchData& run : layout.mRuns) {
+			if (fitsWord(run.getAddress(), run.getData().size())) {
+				storeAtomic(run.getAddress(), run.getData().data(), run.getData().size());
+			}
+			else {
+				std::memcpy(reinterpret_cast<std::uint8_t*>(run.getAddress()) + 2, run.getData().data() + 2, run.getData().size() - 2);
+			}
+		}
+		if (heads.empty()) {
+			return true;
+		}
+
+		bool serialized = MemoryUtils::serializeAllThreads();
+		for (const AsmPatchData& run : layout.mRuns) {
+			if (!fitsWord(run.getAddress(), run.getData().size())) {
+				storeAtomic(run.getAddress(), run.getData().data(), 2);
+			}
+		}
+		serialized &= MemoryUtils::serializeAllThreads();
+		return serialized;
+	}
+
+	static void restoreProtection(const std::vector<AsmBuilder::MemoryUtils::MappedRegion>& regions, std::size_t count)
+	{
+		for (std::size_t i = 0; i < count; i++) {
+			AsmBuilder::MemoryUtils::protect(regions[i].mBegin, regions[i].mEnd, regions[i].mProt);
+		}
+	}
+};
+
+}
@@ -1,20 +1,51 @@
 #pragma once
 
+#include <array>
+#include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <exception>
 #include <type_traits>
 #include <tuple>
+#include "details/HexPattern.h"
+#include "details/HookStats.h"
 #include "details/LambdaPayloadInjector.h"
+#include "details/PerfMap.h"
+#include "details/RegisterSaves.h"
+#include "details/SmallByteVector.h"
 #include <vector>
 #include <utility>
 
 namespace AsmPatch {
 
+struct AsmPatchInvalidExpectation : std::exception {
+	const char* what() const noexcept override { return "Malformed expected bytes pattern"; }
+};
+
 class AsmPatchData
 {
+public:
+	// Patches up to this size are stored without any heap allocation
+	static constexpr std::size_t InlineCapacity = 32;
+	using Bytes = AsmBuilder::Containers::SmallByteVector<InlineCapacity>;
+
+private:
 	std::uintptr_t mAddr;
-	std::vector<std::uint8_t> mData;
+	Bytes mData;
+	// Original bytes at mAddr, already masked, and the bits of them which are compared; empty if unchecked
+	std::vector<std::uint8_t> mExpected;
+	std::vector<std::uint8_t> mExpectedMask;
 public:
+	AsmPatchData(std::uintptr_t addr, Bytes data) :
+		mAddr(addr),
+		mData(std::move(data))
+	{}
+
+	AsmPatchData(std::uintptr_t addr, const std::uint8_t* data, std::size_t size) :
+		mAddr(addr),
+		mData(data, size)
+	{}
+
 	AsmPatchData(std::uintptr_t addr, std::vector<std::uint8_t> data) :
 		mAddr(addr),
 		mData(std::move(data))
@@ -25,15 +56,101 @@ public:
 		return mAddr;
 	}
 
-	const std::vector<std::uint8_t>& getData() const
+	const Bytes& getData() const
 	{
 		return mData;
 	}
 	
-	std::vector<std::uint8_t>& getDataRef() 
+	Bytes& getDataRef() 
 	{
 		return mData;	
 	}
+
+	// Declares the original bytes at the patch address, checked by AsmPatchVerifier before applying.
+	// A null mask compares all bits. The expectation may be longer or shorter than the patch.
+	AsmPatchData& expect(const std::uint8_t* bytes, const std::uint8_t* mask, std::size_t size) &
+	{
+		mExpected.assign(bytes, bytes + size);
+		mExpectedMask.assign(size, 0xFF);
+		if (mask) {
+			std::memcpy(mExpectedMask.data(), mask, size);
+		}
+		for (std::size_t i = 0; i < size; i++) {
+			mExpected[i] &= mExpectedMask[i];
+		}
+		return *this;
+	}
+
+	// Pattern like "0F 8? ?? ?? ?? ??", see AsmBuilder::HexPattern::parse() for the syntax
+	AsmPatchData& expect(const char* pattern) &
+	{
+		if (!AsmBuilder::HexPattern::parse(pattern, mExpected, mExpectedMask)) {
+			throw AsmPatchInvalidExpectation();
+		}
+		return *this;
+	}
+
+	AsmPatchData&& expect(const std::uint8_t* bytes, const std::uint8_t* mask, std::size_t size) &&
+	{
+		return std::move(expect(bytes, mask, size));
+	}
+
+	AsmPatchData&& expect(const char* pattern) &&
+	{
+		return std::move(expect(pattern));
+	}
+
+	bool hasExpectation() const
+	{
+		return !mExpected.empty();
+	}
+
+	const std::vector<std::uint8_t>& getExpected() const
+	{
+		return mExpected;
+	}
+
+	const std::vector<std::uint8_t>& getExpectedMask() const
+	{
+		return mExpectedMask;
+	}
+
+};
+
+struct AsmPatchBufferTooSmall : std::exception {
+	const char* what() const noexcept override { return "Buffer is too small for the patch"; }
+};
+
+template <std::uintptr_t Size>
+class AsmPatchStaticData
+{
+	std::uintptr_t mAddr;
+	std::array<std::uint8_t, Size> mData;
+public:
+	constexpr AsmPatchStaticData(std::uintptr_t addr, const std::array<std::uint8_t, Size>& data) :
+		mAddr(addr),
+		mData(data)
+	{}
+
+	constexpr std::uintptr_t getAddress() const
+	{
+		return mAddr;
+	}
+
+	constexpr std::uintptr_t size() const
+	{
+		return Size;
+	}
+
+	constexpr const std::array<std::uint8_t, Size>& getData() const
+	{
+		return mData;
+	}
+
+	AsmPatchData toPatchData() const
+	{
+		return AsmPatchData(mAddr, mData.data(), Size);
+	}
 };
 
 namespace AsmConsts {
@@ -47,10 +164,199 @@ namespace AsmConsts {
 		R32_ESI = 0x6,
 		R32_EDI = 0x7
 	};
+
+	enum R64 {
+		R64_RAX = 0x0,
+		R64_RCX = 0x1,
+		R64_RDX = 0x2,
+		R64_RBX = 0x3,
+		R64_RSP = 0x4,
+		R64_RBP = 0x5,
+		R64_RSI = 0x6,
+		R64_RDI = 0x7,
+		R64_R8 = 0x8,
+		R64_R9 = 0x9,
+		R64_R10 = 0xA,
+		R64_R11 = 0xB,
+		R64_R12 = 0xC,
+		R64_R13 = 0xD,
+		R64_R14 = 0xE,
+		R64_R15 = 0xF
+	};
+
+	enum Mode {
+		MODE_X86,
+		MODE_X64
+	};
+
+	constexpr Mode MODE_HOST = sizeof(void*) == 8 ? MODE_X64 : MODE_X86;
+
+	// Low nibble of the jcc opcodes (70+cc rel8, 0F 80+cc rel32)
+	enum Condition {
+		CC_O = 0x0,
+		CC_NO = 0x1,
+		CC_B = 0x2,
+		CC_AE = 0x3,
+		CC_E = 0x4,
+		CC_NE = 0x5,
+		CC_BE = 0x6,
+		CC_A = 0x7,
+		CC_S = 0x8,
+		CC_NS = 0x9,
+		CC_P = 0xA,
+		CC_NP = 0xB,
+		CC_L = 0xC,
+		CC_GE = 0xD,
+		CC_LE = 0xE,
+		CC_G = 0xF
+	};
+
+	// Integer ALU operations sharing the 00-3F opcode block and the 80/81/83 /digit group
+	enum AluOp {
+		ALU_ADD = 0x0,
+		ALU_OR = 0x1,
+		ALU_ADC = 0x2,
+		ALU_SBB = 0x3,
+		ALU_AND = 0x4,
+		ALU_SUB = 0x5,
+		ALU_XOR = 0x6,
+		ALU_CMP = 0x7
+	};
+
+	// State live at a hook site for safeCall<Live>() and callLambda*<Live>(). Of the registers only
+	// those a call may clobber are saved, the vector state needs an fxsave or xsave area.
+	enum Live : std::uint32_t {
+		LIVE_NONE = 0,
+		LIVE_EAX = 1u << R32_EAX,
+		LIVE_ECX = 1u << R32_ECX,
+		LIVE_EDX = 1u << R32_EDX,
+		LIVE_EBX = 1u << R32_EBX,
+		LIVE_EBP = 1u << R32_EBP,
+		LIVE_ESI = 1u << R32_ESI,
+		LIVE_EDI = 1u << R32_EDI,
+		LIVE_RAX = LIVE_EAX,
+		LIVE_RCX = LIVE_ECX,
+		LIVE_RDX = LIVE_EDX,
+		LIVE_RBX = LIVE_EBX,
+		LIVE_RBP = LIVE_EBP,
+		LIVE_RSI = LIVE_ESI,
+		LIVE_RDI = LIVE_EDI,
+		LIVE_R8 = 1u << R64_R8,
+		LIVE_R9 = 1u << R64_R9,
+		LIVE_R10 = 1u << R64_R10,
+		LIVE_R11 = 1u << R64_R11,
+		LIVE_R12 = 1u << R64_R12,
+		LIVE_R13 = 1u << R64_R13,
+		LIVE_R14 = 1u << R64_R14,
+		LIVE_R15 = 1u << R64_R15,
+		LIVE_GPRS = AsmBuilder::RegisterSaves::GprMask,
+		LIVE_FLAGS = AsmBuilder::RegisterSaves::FlagsBit,
+		// x87, MMX and SSE registers, saved with fxsave
+		LIVE_SSE = AsmBuilder::RegisterSaves::SseBit,
+		// All of LIVE_SSE plus the upper halves of the AVX registers, saved with xsave
+		LIVE_AVX = AsmBuilder::RegisterSaves::AvxBit,
+		LIVE_ALL = LIVE_GPRS | LIVE_FLAGS | LIVE_SSE | LIVE_AVX
+	};
 };
 
+// Registers captured by callLambdaWithContext. All registers in Read | Write (masks of AsmConsts::Live,
+// general purpose registers except esp and LIVE_FLAGS) are spilled to the stack, and the ones in Write
+// are loaded back from it after the lambda returned. The lambda takes it by reference, a const
+// reference writes nothing back.
+template<std::uint32_t Read, std::uint32_t Write = AsmConsts::LIVE_NONE>
+class AsmContext
+{
+public:
+	static constexpr std::uint32_t Spilled = Read | Write;
+	static constexpr std::uint32_t Written = Write;
+
+private:
+	static_assert((Spilled & ~(AsmConsts::LIVE_GPRS | AsmConsts::LIVE_FLAGS)) == 0 && (Spilled & (1u << AsmConsts::R32_ESP)) == 0,
+		"Only general purpose registers except esp and the flags can be captured");
+
+	static constexpr unsigned RegisterCount = AsmBuilder::RegisterSaves::countRegisters(Spilled);
+
+	// The highest register was pushed last and lies at the lowest address, the flags were pushed first
+	std::array<std::uintptr_t, RegisterCount + ((Spilled & AsmConsts::LIVE_FLAGS) ? 1 : 0)> mSlots;
+
+	template<auto Reg>
+	static constexpr std::size_t slot() {
+		static_assert(Spilled & (1u << Reg), "Register is not part of the context");
+		return AsmBuilder::RegisterSaves::countRegisters(Spilled & ~((2u << Reg) - 1));
+	}
+
+public:
+	// Lives on the stack of the hook only
+	AsmContext() = delete;
+	AsmContext(const AsmContext&) = delete;
+	AsmContext& operator=(const AsmContext&) = delete;
+
+	template<auto Reg>
+	std::uintptr_t get() const {
+		return mSlots[slot<Reg>()];
+	}
+
+	template<auto Reg>
+	void set(std::uintptr_t value) {
+		static_assert(Write & (1u << Reg), "Register is not written back, add it to Write");
+		mSlots[slot<Reg>()] = value;
+	}
+
+	std::uintptr_t flags() const {
+		static_assert(Spilled & AsmConsts::LIVE_FLAGS, "Flags are not part of the context");
+		return mSlots[RegisterCount];
+	}
+
+	void setFlags(std::uintptr_t value) {
+		static_assert(Write & AsmConsts::LIVE_FLAGS, "Flags are not written back, add LIVE_FLAGS to Write");
+		mSlots[RegisterCount] = value;
+	}
+};
+
+// The AsmContext taken by a callLambdaWithContext lambda and what is written back of it
+template<typename LambdaFunc>
+struct AsmContextTraits
+{
+	static_assert(AsmBuilder::MetaPUtils::function_traits<LambdaFunc>::number_of_args == 1,
+		"Context lambdas take a single AsmContext reference");
+	using Argument = typename AsmBuilder::MetaPUtils::function_traits<LambdaFunc>::template arg<0>::type;
+	static_assert(std::is_lvalue_reference_v<Argument>, "Context lambdas take a single AsmContext reference");
+	using Context = std::remove_const_t<std::remove_reference_t<Argument>>;
+	static_assert(std::is_void_v<typename AsmBuilder::MetaPUtils::function_traits<LambdaFunc>::result_type>,
+		"Context lambdas return nothing, results are written to the context");
+
+	static constexpr std::uint32_t Spilled = Context::Spilled;
+	static constexpr std::uint32_t Written = std::is_const_v<std::remove_reference_t<Argument>> ? 0 : Context::Written;
+};
+
+struct AsmPatchRel32OutOfRange : std::exception {
+	const char* what() const noexcept override { return "Branch target is out of rel32 range"; }
+};
+
+struct AsmPatchInvalidForMode : std::exception {
+	const char* what() const noexcept override { return "Instruction is not encodable in this mode"; }
+};
+
+namespace AsmEncoding {
+	// Displacement from the end of a branch to its target. On 64-bit hosts it has to fit into rel32,
+	// 32-bit addresses wrap around so any target is reachable.
+	constexpr std::uint32_t rel32(std::uintptr_t target, std::uintptr_t next) {
+		if (sizeof(std::uintptr_t) > 4) {
+			const std::uintptr_t rel = target - next;
+			if (rel + 0x80000000u > 0xFFFFFFFFu) {
+				throw AsmPatchRel32OutOfRange();
+			}
+		}
+		return static_cast<std::uint32_t>(target - next);
+	}
+
+	constexpr bool fitsRel32(std::uintptr_t target, std::uintptr_t next) {
+		return sizeof(std::uintptr_t) == 4 || (target - next) + 0x80000000u <= 0xFFFFFFFFu;
+	}
+}
+
 struct AsmPatchNoCondtionalJump : std::exception {
-	const char* what() const override { return "No conditional jump at detected"; }
+	const char* what() const noexcept override { return "No conditional jump at detected"; }
 };
 
 template <std::uintptr_t Size>
@@ -60,109 +366,197 @@ struct AsmPatchBuilder final {
 	********************/
 public:
 	const std::uintptr_t mAddr;
-	std::uint8_t mPatchBytes[Size ? Size : 1];
+	std::array<std::uint8_t, Size> mPatchBytes;
 	
+	// Length of safeCall<Live, Mode>()
+	template<std::uint32_t Live, AsmConsts::Mode Mode>
+	static constexpr std::uintptr_t SavedCallSize =
+		AsmBuilder::RegisterSaves::prologueSize(Live, Mode == AsmConsts::MODE_X64) + 5 + AsmBuilder::RegisterSaves::epilogueSize(Live, Mode == AsmConsts::MODE_X64);
+
+	// Length of safeCall(func): on x86-64 hosts safeCall<LIVE_GPRS | LIVE_FLAGS, MODE_X64>
+	static constexpr std::uintptr_t DefaultSavedCallSize = AsmConsts::MODE_HOST == AsmConsts::MODE_X64 ?
+		SavedCallSize<AsmConsts::LIVE_GPRS | AsmConsts::LIVE_FLAGS, AsmConsts::MODE_X64> : 13;
+
+	// Length of callLambdaWithContext<Live>(LambdaFunc)
+	template<std::uint32_t Live, typename LambdaFunc>
+	static constexpr std::uintptr_t ContextCallSize =
+		AsmBuilder::RegisterSaves::contextPrologueSize(AsmContextTraits<LambdaFunc>::Spilled, Live, AsmConsts::MODE_HOST == AsmConsts::MODE_X64) + 5 +
+		AsmBuilder::RegisterSaves::contextEpilogueSize(AsmContextTraits<LambdaFunc>::Spilled, AsmContextTraits<LambdaFunc>::Written, Live, AsmConsts::MODE_HOST == AsmConsts::MODE_X64);
+
 	/***********************************
 	* Constructor and utility methods *
 	***********************************/
 public:
-	AsmPatchBuilder(std::uintptr_t addr) :
-		mAddr(addr)
+	constexpr AsmPatchBuilder(std::uintptr_t addr) :
+		mAddr(addr),
+		mPatchBytes{}
 	{}
 
-	std::uintptr_t size() const {
+	constexpr std::uintptr_t size() const {
 		return Size;
 	}
 
-	std::uintptr_t cursor() const {
+	constexpr std::uintptr_t cursor() const {
 		return mAddr + Size;
 	}
 
-	AsmPatchData compile()
+	AsmPatchData compile() const
 	{
-		return AsmPatchData(mAddr, { std::begin(mPatchBytes), std::end(mPatchBytes) });
+		return AsmPatchData(mAddr, mPatchBytes.data(), Size);
+	}
+
+	// Writes the bytes straight to out, which can also be the target memory itself
+	template <typename OutputIt>
+	constexpr OutputIt compileInto(OutputIt out) const
+	{
+		for (std::uintptr_t i = 0; i < Size; i++) {
+			*out++ = mPatchBytes[i];
+		}
+		return out;
+	}
+
+	std::uintptr_t compileInto(std::uint8_t* buffer, std::uintptr_t bufferSize) const
+	{
+		if (bufferSize < Size) {
+			throw AsmPatchBufferTooSmall();
+		}
+		if (Size) {
+			std::memcpy(buffer, mPatchBytes.data(), Size);
+		}
+		return Size;
+	}
+
+	// Usable in constant expressions, e.g. to place a finished patch into read-only data:
+	// static constexpr auto patch = Patch(0x0057FFA4).jmp(0x00401000).nops<3>().compileStatic();
+	constexpr AsmPatchStaticData<Size> compileStatic() const
+	{
+		return AsmPatchStaticData<Size>(mAddr, mPatchBytes);
 	}
 
 	/*******************************
 	* Appending data to the patch *
 	*******************************/
-	inline AsmPatchBuilder<Size> bytes() const {
+	constexpr AsmPatchBuilder<Size> bytes() const {
 		return *this;
 	}
 
+	// All new bytes are appended in one step, so the previous bytes are copied once per call
 	template <typename... Ts>
-	inline AsmPatchBuilder<Size + 1 + sizeof...(Ts)> bytes(std::uint8_t newByte, Ts... params) const {
-		AsmPatchBuilder<Size + 1> ret(mAddr);
+	constexpr AsmPatchBuilder<Size + 1 + sizeof...(Ts)> bytes(std::uint8_t newByte, Ts... params) const {
+		const std::uint8_t newBytes[] = { newByte, static_cast<std::uint8_t>(params)... };
+
+		AsmPatchBuilder<Size + 1 + sizeof...(Ts)> ret(mAddr);
+		for (std::uintptr_t i = 0; i < Size; i++) {
+			ret.mPatchBytes[i] = mPatchBytes[i];
+		}
+		for (std::uintptr_t i = 0; i < 1 + sizeof...(Ts); i++) {
+			ret.mPatchBytes[Size + i] = newBytes[i];
+		}
+		return ret;
+	}
+
+	template <std::size_t Count>
+	constexpr AsmPatchBuilder<Size + Count> bytes(const std::array<std::uint8_t, Count>& newBytes) const {
+		AsmPatchBuilder<Size + Count> ret(mAddr);
 		for (std::uintptr_t i = 0; i < Size; i++) {
 			ret.mPatchBytes[i] = mPatchBytes[i];
 		}
-		ret.mPatchBytes[Size] = newByte;
-		return ret.bytes(params...);
+		for (std::uintptr_t i = 0; i < Count; i++) {
+			ret.mPatchBytes[Size + i] = newBytes[i];
+		}
+		return ret;
 	}
 
-	inline AsmPatchBuilder<Size + 1> byte(std::uint8_t newByte) const {
+	constexpr AsmPatchBuilder<Size + 1> byte(std::uint8_t newByte) const {
 		return bytes(newByte);
 	}
 
-	inline AsmPatchBuilder<Size + 2> word(std::uint32_t newWord) const {
-		const std::uint8_t* data = (const std::uint8_t*)&newWord;
-		return bytes(data[0], data[1]);
+	constexpr AsmPatchBuilder<Size + 2> word(std::uint32_t newWord) const {
+		return bytes(
+			static_cast<std::uint8_t>(newWord),
+			static_cast<std::uint8_t>(newWord >> 8));
+	}
+
+	constexpr AsmPatchBuilder<Size + 4> dword(std::uint32_t newDWord) const {
+		return bytes(
+			static_cast<std::uint8_t>(newDWord),
+			static_cast<std::uint8_t>(newDWord >> 8),
+			static_cast<std::uint8_t>(newDWord >> 16),
+			static_cast<std::uint8_t>(newDWord >> 24));
 	}
 
-	inline AsmPatchBuilder<Size + 4> dword(std::uint32_t newDWord) const {
-		const std::uint8_t* data = (const std::uint8_t*)&newDWord;
-		return bytes(data[0], data[1], data[2], data[3]);
+	constexpr AsmPatchBuilder<Size + 8> qword(std::uint64_t newQWord) const {
+		return dword(static_cast<std::uint32_t>(newQWord)).dword(static_cast<std::uint32_t>(newQWord >> 32));
 	}
 
 	/*****************************
 	* Insertion of instructions *
 	*****************************/
 public:
-	inline AsmPatchBuilder<Size + 1> nop() const {
+	constexpr AsmPatchBuilder<Size + 1> nop() const {
 		return byte(0x90);
 	}
-	inline AsmPatchBuilder<Size + 1> ret() const {
+	constexpr AsmPatchBuilder<Size + 1> ret() const {
 		return byte(0xC3);
 	}
-	inline AsmPatchBuilder<Size + 3> retNear() const {
+	constexpr AsmPatchBuilder<Size + 3> retNear() const {
 		return bytes(0xC2, 0x04, 0x00);
 	}
-	inline AsmPatchBuilder<Size + 1> pushR32(AsmConsts::R32 arg) const {
+	constexpr AsmPatchBuilder<Size + 1> pushR32(AsmConsts::R32 arg) const {
 		return byte(0x50 | arg);
 	}
-	inline AsmPatchBuilder<Size + 1> popR32(AsmConsts::R32 arg) const {
+	constexpr AsmPatchBuilder<Size + 1> popR32(AsmConsts::R32 arg) const {
 		return byte(0x58 | arg);
 	}
-	inline AsmPatchBuilder<Size + 1> pushf() const {
+	// x86-64 only, r8-r15 need a REX.B prefix
+	template<AsmConsts::R64 Reg>
+	constexpr AsmPatchBuilder<Size + (Reg >= 8 ? 2 : 1)> pushR64() const {
+		if constexpr (Reg >= 8) {
+			return bytes(0x41, 0x50 | (Reg & 7));
+		}
+		else {
+			return byte(0x50 | Reg);
+		}
+	}
+	template<AsmConsts::R64 Reg>
+	constexpr AsmPatchBuilder<Size + (Reg >= 8 ? 2 : 1)> popR64() const {
+		if constexpr (Reg >= 8) {
+			return bytes(0x41, 0x58 | (Reg & 7));
+		}
+		else {
+			return byte(0x58 | Reg);
+		}
+	}
+	constexpr AsmPatchBuilder<Size + 1> pushf() const {
 		return byte(0x9C);
 	}
-	inline AsmPatchBuilder<Size + 1> popf() const {
+	constexpr AsmPatchBuilder<Size + 1> popf() const {
 		return byte(0x9D);
 	}
 
 	// Convenience shorthand
-	inline AsmPatchBuilder<Size + 1> pushEAX() const { return pushR32(AsmConsts::R32_EAX); }
-	inline AsmPatchBuilder<Size + 1> pushECX() const { return pushR32(AsmConsts::R32_ECX); }
-	inline AsmPatchBuilder<Size + 1> pushEDX() const { return pushR32(AsmConsts::R32_EDX); }
-	inline AsmPatchBuilder<Size + 1> pushEBX() const { return pushR32(AsmConsts::R32_EBX); }
-	inline AsmPatchBuilder<Size + 1> pushESP() const { return pushR32(AsmConsts::R32_ESP); }
-	inline AsmPatchBuilder<Size + 1> pushEBP() const { return pushR32(AsmConsts::R32_EBP); }
-	inline AsmPatchBuilder<Size + 1> pushESI() const { return pushR32(AsmConsts::R32_ESI); }
-	inline AsmPatchBuilder<Size + 1> pushEDI() const { return pushR32(AsmConsts::R32_EDI); }
-	inline AsmPatchBuilder<Size + 1> popEAX() const { return popR32(AsmConsts::R32_EAX); }
-	inline AsmPatchBuilder<Size + 1> popECX() const { return popR32(AsmConsts::R32_ECX); }
-	inline AsmPatchBuilder<Size + 1> popEDX() const { return popR32(AsmConsts::R32_EDX); }
-	inline AsmPatchBuilder<Size + 1> popEBX() const { return popR32(AsmConsts::R32_EBX); }
-	inline AsmPatchBuilder<Size + 1> popESP() const { return popR32(AsmConsts::R32_ESP); }
-	inline AsmPatchBuilder<Size + 1> popEBP() const { return popR32(AsmConsts::R32_EBP); }
-	inline AsmPatchBuilder<Size + 1> popESI() const { return popR32(AsmConsts::R32_ESI); }
-	inline AsmPatchBuilder<Size + 1> popEDI() const { return popR32(AsmConsts::R32_EDI); }
-
-	inline AsmPatchBuilder<Size + 2> movRestoreStackptr() {
+	constexpr AsmPatchBuilder<Size + 1> pushEAX() const { return pushR32(AsmConsts::R32_EAX); }
+	constexpr AsmPatchBuilder<Size + 1> pushECX() const { return pushR32(AsmConsts::R32_ECX); }
+	constexpr AsmPatchBuilder<Size + 1> pushEDX() const { return pushR32(AsmConsts::R32_EDX); }
+	constexpr AsmPatchBuilder<Size + 1> pushEBX() const { return pushR32(AsmConsts::R32_EBX); }
+	constexpr AsmPatchBuilder<Size + 1> pushESP() const { return pushR32(AsmConsts::R32_ESP); }
+	constexpr AsmPatchBuilder<Size + 1> pushEBP() const { return pushR32(AsmConsts::R32_EBP); }
+	constexpr AsmPatchBuilder<Size + 1> pushESI() const { return pushR32(AsmConsts::R32_ESI); }
+	constexpr AsmPatchBuilder<Size + 1> pushEDI() const { return pushR32(AsmConsts::R32_EDI); }
+	constexpr AsmPatchBuilder<Size + 1> popEAX() const { return popR32(AsmConsts::R32_EAX); }
+	constexpr AsmPatchBuilder<Size + 1> popECX() const { return popR32(AsmConsts::R32_ECX); }
+	constexpr AsmPatchBuilder<Size + 1> popEDX() const { return popR32(AsmConsts::R32_EDX); }
+	constexpr AsmPatchBuilder<Size + 1> popEBX() const { return popR32(AsmConsts::R32_EBX); }
+	constexpr AsmPatchBuilder<Size + 1> popESP() const { return popR32(AsmConsts::R32_ESP); }
+	constexpr AsmPatchBuilder<Size + 1> popEBP() const { return popR32(AsmConsts::R32_EBP); }
+	constexpr AsmPatchBuilder<Size + 1> popESI() const { return popR32(AsmConsts::R32_ESI); }
+	constexpr AsmPatchBuilder<Size + 1> popEDI() const { return popR32(AsmConsts::R32_EDI); }
+
+	constexpr AsmPatchBuilder<Size + 2> movRestoreStackptr() const {
 		return bytes(0x8B, 0xE5);
 	}
 
-	inline AsmPatchBuilder<Size + 9> retStdcallFull() {
+	constexpr AsmPatchBuilder<Size + 9> retStdcallFull() const {
 		return (
 			popEDI().
 			popESI().
@@ -175,58 +569,170 @@ public:
 
 	template<typename LambdaFunc>
 	inline AsmPatchBuilder<Size + 5> callLambdaStdcall(LambdaFunc func) const {
-		return call(AsmBuilder::LambdaPayloadInjector::CreateFuncPtrFromLambda(func));
+		return call(reinterpret_cast<std::uintptr_t>(AsmBuilder::LambdaPayloadInjector::CreateFuncPtrFromLambda(func)));
 	}
 
 	template<typename LambdaFunc>
 	inline AsmPatchBuilder<Size + 5> callLambdaCdecl(LambdaFunc func) const {
-		return call(AsmBuilder::LambdaPayloadInjector::CreateFuncPtrFromLambda<AsmBuilder::LambdaPayloadInjector::CallingConvention::CDeclCall>(func));
+		return call(reinterpret_cast<std::uintptr_t>(AsmBuilder::LambdaPayloadInjector::CreateFuncPtrFromLambda<AsmBuilder::LambdaPayloadInjector::CallingConvention::CDeclCall>(func)));
 	}
 
 	template<typename LambdaFunc>
 	inline AsmPatchBuilder<Size + 5> callLambdaThiscall(LambdaFunc func) const {
-		return call(AsmBuilder::LambdaPayloadInjector::CreateFuncPtrFromLambda<AsmBuilder::LambdaPayloadInjector::CallingConvention::ThisCall>(func));
+		return call(reinterpret_cast<std::uintptr_t>(AsmBuilder::LambdaPayloadInjector::CreateFuncPtrFromLambda<AsmBuilder::LambdaPayloadInjector::CallingConvention::ThisCall>(func)));
 	}
 
 	template<typename LambdaFunc>
 	inline AsmPatchBuilder<Size + 5> callLambdaFastcall(LambdaFunc func) const {
-		return call(AsmBuilder::LambdaPayloadInjector::CreateFuncPtrFromLambda<AsmBuilder::LambdaPayloadInjector::CallingConvention::FastCall>(func));
+		return call(reinterpret_cast<std::uintptr_t>(AsmBuilder::LambdaPayloadInjector::CreateFuncPtrFromLambda<AsmBuilder::LambdaPayloadInjector::CallingConvention::FastCall>(func)));
 	}
 
 	template<AsmBuilder::LambdaPayloadInjector::CallingConvention CallConv, typename LambdaFunc>
 	inline AsmPatchBuilder<Size + 5> callLambdaByCallConv(LambdaFunc func) const {
-		return call(AsmBuilder::LambdaPayloadInjector::CreateFuncPtrFromLambda<CallConv>(func));
+		return call(reinterpret_cast<std::uintptr_t>(AsmBuilder::LambdaPayloadInjector::CreateFuncPtrFromLambda<CallConv>(func)));
+	}
+
+	// Saves what is live at the site around the call, see safeCall<Live>(). The lambda must not take
+	// arguments from the stack as the saves are pushed on top of them.
+	template<std::uint32_t Live, typename LambdaFunc>
+	inline AsmPatchBuilder<Size + SavedCallSize<Live, AsmConsts::MODE_HOST>> callLambdaStdcall(LambdaFunc func) const {
+		return callLambdaByCallConv<AsmBuilder::LambdaPayloadInjector::CallingConvention::StdCall, Live>(func);
+	}
+
+	template<std::uint32_t Live, typename LambdaFunc>
+	inline AsmPatchBuilder<Size + SavedCallSize<Live, AsmConsts::MODE_HOST>> callLambdaCdecl(LambdaFunc func) const {
+		return callLambdaByCallConv<AsmBuilder::LambdaPayloadInjector::CallingConvention::CDeclCall, Live>(func);
+	}
+
+	template<std::uint32_t Live, typename LambdaFunc>
+	inline AsmPatchBuilder<Size + SavedCallSize<Live, AsmConsts::MODE_HOST>> callLambdaThiscall(LambdaFunc func) const {
+		return callLambdaByCallConv<AsmBuilder::LambdaPayloadInjector::CallingConvention::ThisCall, Live>(func);
+	}
+
+	template<std::uint32_t Live, typename LambdaFunc>
+	inline AsmPatchBuilder<Size + SavedCallSize<Live, AsmConsts::MODE_HOST>> callLambdaFastcall(LambdaFunc func) const {
+		return callLambdaByCallConv<AsmBuilder::LambdaPayloadInjector::CallingConvention::FastCall, Live>(func);
+	}
+
+	template<AsmBuilder::LambdaPayloadInjector::CallingConvention CallConv, std::uint32_t Live, typename LambdaFunc>
+	inline AsmPatchBuilder<Size + SavedCallSize<Live, AsmConsts::MODE_HOST>> callLambdaByCallConv(LambdaFunc func) const {
+		static_assert(!AsmBuilder::RegisterSaves::savesAnything(AsmBuilder::RegisterSaves::plan(Live, AsmConsts::MODE_HOST == AsmConsts::MODE_X64)) ||
+			!AsmBuilder::LambdaPayloadInjector::TakesStackArgs<CallConv, LambdaFunc>,
+			"Register saves would move the stack arguments of the lambda");
+		return safeCall<Live>(reinterpret_cast<std::uintptr_t>(AsmBuilder::LambdaPayloadInjector::CreateFuncPtrFromLambda<CallConv>(func)));
+	}
+
+	// Spills the registers of the lambda's AsmContext, passes their address and loads the written ones
+	// back. Other live state is saved as by safeCall<Live>().
+	template<std::uint32_t Live = AsmConsts::LIVE_NONE, typename LambdaFunc>
+	inline AsmPatchBuilder<Size + ContextCallSize<Live, LambdaFunc>> callLambdaWithContext(LambdaFunc func) const {
+		using Traits = AsmContextTraits<LambdaFunc>;
+		constexpr bool X64 = AsmConsts::MODE_HOST == AsmConsts::MODE_X64;
+		const std::uintptr_t thunk = reinterpret_cast<std::uintptr_t>(
+			AsmBuilder::LambdaPayloadInjector::CreateFuncPtrFromLambda<AsmBuilder::LambdaPayloadInjector::CallingConvention::FastCall>(func));
+		return (
+			bytes(AsmBuilder::RegisterSaves::contextPrologue<Traits::Spilled, Live, X64>()).
+			call(thunk).
+			bytes(AsmBuilder::RegisterSaves::contextEpilogue<Traits::Spilled, Traits::Written, Live, X64>())
+			);
+	}
+
+	// Records call counts and latencies under name if ASMPATCH_ENABLE_HOOK_STATS is enabled, see AsmHookStats.h.
+	// The generated thunk is also listed under name in the perf map, see AsmPerfMap.h.
+	template<AsmBuilder::LambdaPayloadInjector::CallingConvention CallConv = AsmBuilder::LambdaPayloadInjector::CallingConvention::StdCall, typename LambdaFunc>
+	inline AsmPatchBuilder<Size + 5> callLambdaInstrumented(const char* name, LambdaFunc func) const {
+		AsmBuilder::PerfMap::NameScope scope(name);
+#if ASMPATCH_ENABLE_HOOK_STATS
+		return callLambdaByCallConv<CallConv>(AsmBuilder::HookStats::Instrument(std::move(func), name));
+#else
+		(void)name;
+		return callLambdaByCallConv<CallConv>(std::move(func));
+#endif
 	}
 
 	// TODO: Compile-time error if working with nullptr_t
 	inline AsmPatchBuilder<Size + 5> call(void* func) const { return call((std::uintptr_t)func); }
-	inline AsmPatchBuilder<Size + 5> call(std::uintptr_t func) const {
-		return byte(0xE8).dword(func - cursor() - 5);
+	constexpr AsmPatchBuilder<Size + 5> call(std::uintptr_t func) const {
+		return byte(0xE8).dword(AsmEncoding::rel32(func, cursor() + 5));
 	}
 
 	// TODO: Compile-time error if working with nullptr_t
 	inline AsmPatchBuilder<Size + 5> jmp(void* addr) const { return jmp((std::uintptr_t)addr); }
-	inline AsmPatchBuilder<Size + 5> jmp(std::uintptr_t addr) const {
-		return byte(0xE9).dword(addr - cursor() - 5);
+	constexpr AsmPatchBuilder<Size + 5> jmp(std::uintptr_t addr) const {
+		return byte(0xE9).dword(AsmEncoding::rel32(addr, cursor() + 5));
 	}
 
-	inline AsmPatchBuilder<Size + 13> safeCall(void* func) const { return safeCall((std::uintptr_t)func); }
-	inline AsmPatchBuilder<Size + 13> safeCall(std::uintptr_t func) const {
-		return (
-			pushf().
-			pushEAX().
-			pushECX().
-			pushEDX().
-			call(func).
-			popEDX().
-			popECX().
-			popEAX().
-			popf()
-			);
+	// Always the rel32 form, DynamicAsmPatchBuilder picks the short form where it reaches
+	constexpr AsmPatchBuilder<Size + 6> jcc(AsmConsts::Condition condition, std::uintptr_t addr) const {
+		return byte(0x0F).byte(0x80 | condition).dword(AsmEncoding::rel32(addr, cursor() + 6));
+	}
+
+	// x86-64 only: call/jmp qword [rip+...] with the absolute target stored inline, reaches any address
+	constexpr AsmPatchBuilder<Size + 16> callAbs64(std::uint64_t func) const {
+		return bytes(0xFF, 0x15, 0x02, 0x00, 0x00, 0x00, 0xEB, 0x08).qword(func);
+	}
+	constexpr AsmPatchBuilder<Size + 14> jmpAbs64(std::uint64_t addr) const {
+		return bytes(0xFF, 0x25, 0x00, 0x00, 0x00, 0x00).qword(addr);
+	}
+
+	// Saves the flags and the caller saved registers around the call. On x86-64 hosts this is
+	// safeCall<LIVE_GPRS | LIVE_FLAGS, MODE_X64>, which also aligns the stack and skips the red zone.
+	inline AsmPatchBuilder<Size + DefaultSavedCallSize> safeCall(void* func) const { return safeCall((std::uintptr_t)func); }
+	constexpr AsmPatchBuilder<Size + DefaultSavedCallSize> safeCall(std::uintptr_t func) const {
+		if constexpr (AsmConsts::MODE_HOST == AsmConsts::MODE_X64) {
+			return safeCall<AsmConsts::LIVE_GPRS | AsmConsts::LIVE_FLAGS, AsmConsts::MODE_X64>(func);
+		}
+		else {
+			return (
+				pushf().
+				pushEAX().
+				pushECX().
+				pushEDX().
+				call(func).
+				popEDX().
+				popECX().
+				popEAX().
+				popf()
+				);
+		}
+	}
+
+	// Saves only what is live at the site (a mask of AsmConsts::Live) and clobbered by a call. Without
+	// anything live this is a plain call, all three caller saved registers use pushad/popad in x86 mode.
+	// Live vector state is stored in an fxsave (LIVE_SSE) or xsave (LIVE_AVX) area, the latter requires
+	// AVX support. In x86-64 mode the stack is always aligned to 16 bytes for the callee via rbx.
+	template<std::uint32_t Live, AsmConsts::Mode Mode = AsmConsts::MODE_HOST>
+	constexpr AsmPatchBuilder<Size + AsmBuilder::RegisterSaves::prologueSize(Live, Mode == AsmConsts::MODE_X64)> saveLive() const {
+		return bytes(AsmBuilder::RegisterSaves::prologue<Live, Mode == AsmConsts::MODE_X64>());
+	}
+
+	template<std::uint32_t Live, AsmConsts::Mode Mode = AsmConsts::MODE_HOST>
+	constexpr AsmPatchBuilder<Size + AsmBuilder::RegisterSaves::epilogueSize(Live, Mode == AsmConsts::MODE_X64)> restoreLive() const {
+		return bytes(AsmBuilder::RegisterSaves::epilogue<Live, Mode == AsmConsts::MODE_X64>());
+	}
+
+	template<std::uint32_t Live, AsmConsts::Mode Mode = AsmConsts::MODE_HOST>
+	inline AsmPatchBuilder<Size + SavedCallSize<Live, Mode>> safeCall(void* func) const { return safeCall<Live, Mode>(reinterpret_cast<std::uintptr_t>(func)); }
+	template<std::uint32_t Live, AsmConsts::Mode Mode = AsmConsts::MODE_HOST>
+	constexpr AsmPatchBuilder<Size + SavedCallSize<Live, Mode>> safeCall(std::uintptr_t func) const {
+		return saveLive<Live, Mode>().call(func).template restoreLive<Live, Mode>();
+	}
+
+	inline AsmPatchBuilder<Size + DefaultSavedCallSize> safeCallInstrumented(const char* name, void* func) const { return safeCallInstrumented(name, reinterpret_cast<std::uintptr_t>(func)); }
+	inline AsmPatchBuilder<Size + DefaultSavedCallSize> safeCallInstrumented(const char* name, std::uintptr_t func) const {
+		AsmBuilder::PerfMap::NameScope scope(name);
+#if ASMPATCH_ENABLE_HOOK_STATS
+		auto target = reinterpret_cast<void(__cdecl*)()>(func);
+		auto instrumented = AsmBuilder::HookStats::Instrument([target]() { target(); }, name);
+		return safeCall(reinterpret_cast<std::uintptr_t>(AsmBuilder::LambdaPayloadInjector::CreateFuncPtrFromLambda<AsmBuilder::LambdaPayloadInjector::CallingConvention::CDeclCall>(instrumented)));
+#else
+		(void)name;
+		return safeCall(func);
+#endif
 	}
 
 	template <std::uintptr_t PadSize>
-	inline AsmPatchBuilder<PadSize> nopPadToSize() const {
+	constexpr AsmPatchBuilder<PadSize> nopPadToSize() const {
 		static_assert(PadSize > Size, "Cannot pad smaller than old size");
 
 		AsmPatchBuilder<PadSize> ret(mAddr);
@@ -242,7 +748,7 @@ public:
 	}
 
 	template <std::uintptr_t NopCount>
-	inline AsmPatchBuilder<Size + NopCount> nops() const {
+	constexpr AsmPatchBuilder<Size + NopCount> nops() const {
 		return nopPadToSize<Size + NopCount>();
 	}
 
@@ -251,11 +757,11 @@ public:
 		if ((ptr[0] != 0x0F) || ((ptr[1] & 0xF0) != 0x80)) {
 			throw AsmPatchNoCondtionalJump();
 		}
-		return NOP().byte(0xE9);
+		return nop().byte(0xE9);
 	}
 };
 
-static inline AsmPatchBuilder<0> Patch(std::uintptr_t addr) {
+static constexpr AsmPatchBuilder<0> Patch(std::uintptr_t addr) {
 	return AsmPatchBuilder<0>(addr);
 }
 static inline AsmPatchBuilder<0> Patch(void* addr) {
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <map>
+#include <vector>
+#include <utility>
+#include "AsmPatchBuilder.h"
+
+namespace AsmPatch {
+
+struct AsmPatchOverlap : std::exception {
+	const char* what() const noexcept override { return "Patch overlaps with an already added patch"; }
+};
+
+// Span of whole pages [mBegin, mEnd) and the runs which lie in it
+struct AsmPatchPageRange
+{
+	std::uintptr_t mBegin;
+	std::uintptr_t mEnd;
+	std::size_t mFirstRun;
+	std::size_t mRunCount;
+};
+
+struct AsmPatchLayout
+{
+	// Patches merged with their direct neighbours, sorted by address
+	std::vector<AsmPatchData> mRuns;
+	// Minimal set of page spans touched by the runs, sorted by address
+	std::vector<AsmPatchPageRange> mPageRanges;
+
+	std::size_t pageCount(std::uintptr_t pageSize) const
+	{
+		std::size_t count = 0;
+		for (const AsmPatchPageRange& range : mPageRanges) {
+			count += (range.mEnd - range.mBegin) / pageSize;
+		}
+		return count;
+	}
+};
+
+// Batch of patches indexed by address. Overlapping patches are rejected when they are added,
+// and the layout merges the patches into contiguous write runs grouped by the pages they touch.
+class AsmPatchSet
+{
+	std::uintptr_t mPageSize;
+	std::map<std::uintptr_t, AsmPatchData> mPatches;
+
+public:
+	explicit AsmPatchSet(std::uintptr_t pageSize = 0x1000) :
+		mPageSize(pageSize)
+	{}
+
+	std::uintptr_t getPageSize() const
+	{
+		return mPageSize;
+	}
+
+	std::size_t size() const
+	{
+		return mPatches.size();
+	}
+
+	bool empty() const
+	{
+		return mPatches.empty();
+	}
+
+	const std::map<std::uintptr_t, AsmPatchData>& getPatches() const
+	{
+		return mPatches;
+	}
+
+	// Returns the patch which overlaps [addr, addr + size), or nullptr
+	const AsmPatchData* findOverlap(std::uintptr_t addr, std::uintptr_t size) const
+	{
+		auto next = mPatches.lower_bound(addr);
+		if (next != mPatches.end() && (next->first == addr || next->first - addr < size)) {
+			return &next->second;
+		}
+		if (next != mPatches.begin()) {
+			const AsmPatchData& prev = std::prev(next)->second;
+			if (addr - prev.getAddress() < prev.getData().size()) {
+				return &prev;
+			}
+		}
+		return nullptr;
+	}
+
+	AsmPatchSet& add(AsmPatchData patch)
+	{
+		if (findOverlap(patch.getAddress(), patch.getData().size())) {
+			throw AsmPatchOverlap();
+		}
+		std::uintptr_t addr = patch.getAddress();
+		mPatches.emplace(addr, std::move(patch));
+		return *this;
+	}
+
+	bool remove(std::uintptr_t addr)
+	{
+		return mPatches.erase(addr) != 0;
+	}
+
+	void clear()
+	{
+		mPatches.clear();
+	}
+
+	// Without mergeRuns every patch stays a run of its own
+	AsmPatchLayout getLayout(bool mergeRuns = true) const
+	{
+		AsmPatchLayout layout;
+
+		for (const auto& entry : mPatches) {
+			const AsmPatchData& patch = entry.second;
+			if (patch.getData().empty()) {
+				continue;
+			}
+			if (mergeRuns && !layout.mRuns.empty()) {
+				AsmPatchData& run = layout.mRuns.back();
+				if (run.getAddress() + run.getData().size() == patch.getAddress()) {
+					run.getDataRef().append(patch.getData().data(), patch.getData().size());
+					continue;
+				}
+			}
+			layout.mRuns.push_back(patch);
+		}
+
+		for (std::size_t i = 0; i < layout.mRuns.size(); i++) {
+			const AsmPatchData& run = layout.mRuns[i];
+			std::uintptr_t begin = alignDown(run.getAddress());
+			std::uintptr_t end = alignDown(run.getAddress() + run.getData().size() - 1) + mPageSize;
+
+			if (!layout.mPageRanges.empty() && layout.mPageRanges.back().mEnd >= begin) {
+				AsmPatchPageRange& range = layout.mPageRanges.back();
+				range.mEnd = end > range.mEnd ? end : range.mEnd;
+				range.mRunCount++;
+				continue;
+			}
+			layout.mPageRanges.push_back({ begin, end, i, 1 });
+		}
+
+		return layout;
+	}
+
+	std::vector<AsmPatchData> getRuns() const
+	{
+		return getLayout().mRuns;
+	}
+
+	std::vector<std::uintptr_t> getPages() const
+	{
+		std::vector<std::uintptr_t> pages;
+		for (const AsmPatchPageRange& range : getLayout().mPageRanges) {
+			for (std::uintptr_t page = range.mBegin; page != range.mEnd; page += mPageSize) {
+				pages.push_back(page);
+			}
+		}
+		return pages;
+	}
+
+private:
+	std::uintptr_t alignDown(std::uintptr_t addr) const
+	{
+		return addr - addr % mPageSize;
+	}
+};
+
+}
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <utility>
+#include <vector>
+#include "AsmPatchBuilder.h"
+
+namespace AsmPatch {
+
+struct AsmPatchNotRelocatable : std::exception {
+	const char* what() const noexcept override { return "Patch contains position dependent code"; }
+};
+
+// Field of a patch template which depends on the address the patch is placed at
+struct AsmRelocation
+{
+	enum Kind : std::uint8_t {
+		// Displacement to a fixed address outside of the patch, e.g. of call rel32 or a rip relative operand
+		REL32,
+		// Absolute address inside of the patch
+		ABS32,
+		ABS64
+	};
+
+	std::uint32_t mOffset;
+	Kind mKind;
+};
+
+// Compiled patch which can be placed at any address, see DynamicAsmPatchBuilder::compileTemplate().
+// Moving a patch by delta only changes its relocated fields: rel32 fields shrink by delta and absolute
+// addresses of the patch itself grow by it, so instantiating is a copy followed by one addition per field.
+//
+//   AsmPatch::DynamicAsmPatchBuilder builder(sites[0]);
+//   builder.call(hook).nops(1);
+//   AsmPatch::AsmPatchTemplate hookTemplate = builder.compileTemplate();
+//   for (std::uintptr_t site : sites) {
+//       patches.push_back(hookTemplate.instantiate(site));
+//   }
+class AsmPatchTemplate
+{
+	std::uintptr_t mAddr;
+	std::vector<std::uint8_t> mBytes;
+	// Sorted by offset
+	std::vector<AsmRelocation> mRelocations;
+	AsmConsts::Mode mMode;
+
+public:
+	// bytes as compiled for addr
+	AsmPatchTemplate(std::uintptr_t addr, std::vector<std::uint8_t> bytes, std::vector<AsmRelocation> relocations, AsmConsts::Mode mode = AsmConsts::MODE_HOST) :
+		mAddr(addr),
+		mBytes(std::move(bytes)),
+		mRelocations(std::move(relocations)),
+		mMode(mode)
+	{}
+
+	std::uintptr_t getAddress() const
+	{
+		return mAddr;
+	}
+
+	std::uintptr_t size() const
+	{
+		return mBytes.size();
+	}
+
+	const std::vector<std::uint8_t>& getData() const
+	{
+		return mBytes;
+	}
+
+	const std::vector<AsmRelocation>& getRelocations() const
+	{
+		return mRelocations;
+	}
+
+	AsmConsts::Mode mode() const
+	{
+		return mMode;
+	}
+
+	// In x86-64 mode throws AsmPatchRel32OutOfRange if a rel32 target is out of reach from addr
+	AsmPatchData instantiate(std::uintptr_t addr) const
+	{
+		checkReach(addr);
+		AsmPatchData patch(addr, mBytes.data(), mBytes.size());
+		relocate(patch.getDataRef().data(), addr);
+		return patch;
+	}
+
+	// Writes the patch for addr to buffer, which can also be the target memory itself:
+	// every rel32 target is checked before the first byte is written
+	std::uintptr_t instantiateInto(std::uintptr_t addr, std::uint8_t* buffer, std::uintptr_t bufferSize) const
+	{
+		if (bufferSize < mBytes.size()) {
+			throw AsmPatchBufferTooSmall();
+		}
+		checkReach(addr);
+		if (!mBytes.empty()) {
+			std::memcpy(buffer, mBytes.data(), mBytes.size());
+		}
+		relocate(buffer, addr);
+		return mBytes.size();
+	}
+
+private:
+	static std::uint64_t movedRel32(const std::uint8_t* field, std::uint64_t delta)
+	{
+		std::int32_t rel;
+		std::memcpy(&rel, field, sizeof(rel));
+		return static_cast<std::uint64_t>(static_cast<std::int64_t>(rel)) - delta;
+	}
+
+	// Throws AsmPatchRel32OutOfRange in x86-64 mode if a rel32 target is out of reach from addr
+	void checkReach(std::uintptr_t addr) const
+	{
+		if (mMode != AsmConsts::MODE_X64) {
+			return;
+		}
+		const std::uint64_t delta = static_cast<std::uint64_t>(addr) - mAddr;
+		for (const AsmRelocation& relocation : mRelocations) {
+			if (relocation.mKind == AsmRelocation::REL32 && movedRel32(mBytes.data() + relocation.mOffset, delta) + 0x80000000u > 0xFFFFFFFFu) {
+				throw AsmPatchRel32OutOfRange();
+			}
+		}
+	}
+
+	// Only after checkReach(), it does not throw
+	void relocate(std::uint8_t* bytes, std::uintptr_t addr) const
+	{
+		const std::uint64_t delta = static_cast<std::uint64_t>(addr) - mAddr;
+		for (const AsmRelocation& relocation : mRelocations) {
+			std::uint8_t* field = bytes + relocation.mOffset;
+			switch (relocation.mKind) {
+			case AsmRelocation::REL32: {
+				const std::uint32_t value = static_cast<std::uint32_t>(movedRel32(field, delta));
+				std::memcpy(field, &value, sizeof(value));
+				break;
+			}
+			case AsmRelocation::ABS32: {
+				std::uint32_t value;
+				std::memcpy(&value, field, sizeof(value));
+				value += static_cast<std::uint32_t>(delta);
+				std::memcpy(field, &value, sizeof(value));
+				break;
+			}
+			case AsmRelocation::ABS64: {
+				std::uint64_t value;
+				std::memcpy(&value, field, sizeof(value));
+				value += delta;
+				std::memcpy(field, &value, sizeof(value));
+				break;
+			}
+			}
+		}
+	}
+};
+
+}
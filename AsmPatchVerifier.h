@@ -0,0 +1,132 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <utility>
+#include <vector>
+#include "AsmPatchSet.h"
+#include "details/SignatureKernels.h"
+
+namespace AsmPatch {
+
+struct AsmPatchMismatch
+{
+	// Address of the patch whose expectation failed
+	std::uintptr_t mAddress;
+	// Offset of the first differing byte from mAddress
+	std::size_t mOffset;
+	// Masked expected byte and the masked byte found there
+	std::uint8_t mExpected;
+	std::uint8_t mActual;
+	// The expected bytes lie outside the verified file image, mOffset, mExpected and mActual are 0
+	bool mOutsideImage;
+};
+
+struct AsmPatchExpectationFailed : std::exception {
+	std::vector<AsmPatchMismatch> mMismatches;
+
+	explicit AsmPatchExpectationFailed(std::vector<AsmPatchMismatch> mismatches) :
+		mMismatches(std::move(mismatches))
+	{}
+
+	const char* what() const noexcept override { return "Original bytes differ from the expected bytes of a patch"; }
+};
+
+// Checks the expected original bytes of a whole batch of patches, either against the memory of the
+// current process or against a file image, and reports every failing patch. Patches without an
+// expectation are skipped.
+class AsmPatchVerifier
+{
+	// Smallest page size on x86, loads never cross into a page which holds no expected byte
+	static constexpr std::uintptr_t SafeLoadPage = 0x1000;
+
+	AsmBuilder::SignatureKernels::Level mLevel;
+
+public:
+	AsmPatchVerifier() :
+		mLevel(AsmBuilder::SignatureKernels::detectLevel())
+	{}
+
+	void setLevel(AsmBuilder::SignatureKernels::Level level) {
+		mLevel = level;
+	}
+
+	// Live memory, all expected bytes have to be readable
+	std::vector<AsmPatchMismatch> verify(const AsmPatchSet& set) const
+	{
+		std::vector<AsmPatchMismatch> mismatches;
+		for (const auto& entry : set.getPatches()) {
+			verifyLive(entry.second, mismatches);
+		}
+		return mismatches;
+	}
+
+	std::vector<AsmPatchMismatch> verify(const AsmPatchData* patches, std::size_t count) const
+	{
+		std::vector<AsmPatchMismatch> mismatches;
+		for (std::size_t i = 0; i < count; i++) {
+			verifyLive(patches[i], mismatches);
+		}
+		return mismatches;
+	}
+
+	// File image of size bytes whose first byte is located at baseAddress
+	std::vector<AsmPatchMismatch> verify(const AsmPatchSet& set, const void* image, std::size_t size, std::uintptr_t baseAddress) const
+	{
+		std::vector<AsmPatchMismatch> mismatches;
+		for (const auto& entry : set.getPatches()) {
+			verifyImage(entry.second, static_cast<const std::uint8_t*>(image), size, baseAddress, mismatches);
+		}
+		return mismatches;
+	}
+
+	std::vector<AsmPatchMismatch> verify(const AsmPatchData* patches, std::size_t count, const void* image, std::size_t size, std::uintptr_t baseAddress) const
+	{
+		std::vector<AsmPatchMismatch> mismatches;
+		for (std::size_t i = 0; i < count; i++) {
+			verifyImage(patches[i], static_cast<const std::uint8_t*>(image), size, baseAddress, mismatches);
+		}
+		return mismatches;
+	}
+
+private:
+	void verifyLive(const AsmPatchData& patch, std::vector<AsmPatchMismatch>& mismatches) const
+	{
+		const std::size_t size = patch.getExpected().size();
+		if (size == 0) {
+			return;
+		}
+		const std::uintptr_t addr = patch.getAddress();
+		const std::size_t readable = (((addr + size - 1) | (SafeLoadPage - 1)) + 1) - addr;
+		compare(patch, reinterpret_cast<const std::uint8_t*>(addr), readable, mismatches);
+	}
+
+	void verifyImage(const AsmPatchData& patch, const std::uint8_t* image, std::size_t imageSize, std::uintptr_t baseAddress,
+		std::vector<AsmPatchMismatch>& mismatches) const
+	{
+		const std::size_t size = patch.getExpected().size();
+		if (size == 0) {
+			return;
+		}
+		const std::uintptr_t addr = patch.getAddress();
+		if (addr < baseAddress || addr - baseAddress > imageSize || imageSize - (addr - baseAddress) < size) {
+			mismatches.push_back({ addr, 0, 0, 0, true });
+			return;
+		}
+		const std::size_t offset = addr - baseAddress;
+		compare(patch, image + offset, imageSize - offset, mismatches);
+	}
+
+	void compare(const AsmPatchData& patch, const std::uint8_t* data, std::size_t readable, std::vector<AsmPatchMismatch>& mismatches) const
+	{
+		const std::vector<std::uint8_t>& expected = patch.getExpected();
+		const std::vector<std::uint8_t>& mask = patch.getExpectedMask();
+		const std::size_t offset = AsmBuilder::SignatureKernels::firstMismatch(mLevel, data, readable, expected.data(), mask.data(), expected.size());
+		if (offset != expected.size()) {
+			mismatches.push_back({ patch.getAddress(), offset, expected[offset], static_cast<std::uint8_t>(data[offset] & mask[offset]), false });
+		}
+	}
+};
+
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "details/PerfMap.h"
+
+namespace AsmPatch {
+
+// Names the thunks and stubs created by this thread while the scope is alive, so perf attributes samples
+// in them to the hook instead of showing bare addresses. Only recorded if ASMPATCH_ENABLE_PERF_MAP is enabled,
+// callLambdaInstrumented/safeCallInstrumented open a scope with their name on their own.
+//
+//   AsmPatch::AsmPerfMapScope scope("onDamage");
+//   AsmPatch::Patch(addr).callLambdaStdcall([&](int amount) { ... });
+using AsmPerfMapScope = AsmBuilder::PerfMap::NameScope;
+
+// Writes the buffered records to /tmp/perf-<pid>.map (and /tmp/jit-<pid>.dump), e.g. before starting perf.
+// Otherwise they are written in batches and when the process exits.
+inline void flushPerfMap()
+{
+#if ASMPATCH_ENABLE_PERF_MAP && defined(__linux__)
+	AsmBuilder::PerfMap::writer().flush();
+#endif
+}
+
+}
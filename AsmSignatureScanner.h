@@ -0,0 +1,385 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "details/HexPattern.h"
+#include "details/SignatureKernels.h"
+
+namespace AsmPatch {
+
+struct AsmSignatureInvalid : std::exception {
+	const char* what() const noexcept override { return "Malformed signature, expected hex bytes and ?/?? wildcards with at least one fully fixed byte"; }
+};
+
+struct AsmSignatureNotFound : std::exception {
+	const char* what() const noexcept override { return "Signature not found or not unique"; }
+};
+
+// Byte pattern with wildcards. The address of a match is the start of the pattern plus offset,
+// so the pattern may begin some bytes before the instruction which is going to be patched.
+class AsmSignature final {
+	std::vector<std::uint8_t> mBytes;
+	// Bits compared, 0xFF for fixed bytes and 0x00 for wildcards
+	std::vector<std::uint8_t> mMask;
+	std::ptrdiff_t mOffset;
+
+public:
+	// Pattern like "E8 ?? ?? ?? ?? 85 C0 74 ?", see AsmBuilder::HexPattern::parse() for the syntax
+	explicit AsmSignature(const char* pattern, std::ptrdiff_t offset = 0) :
+		mOffset(offset)
+	{
+		if (!AsmBuilder::HexPattern::parse(pattern, mBytes, mMask)) {
+			throw AsmSignatureInvalid();
+		}
+		validate();
+	}
+
+	// mask is 0xFF for fixed bytes, 0x00 for wildcards and anything in between for partially fixed ones
+	AsmSignature(const std::uint8_t* bytes, const std::uint8_t* mask, std::size_t size, std::ptrdiff_t offset = 0) :
+		mBytes(bytes, bytes + size),
+		mMask(mask, mask + size),
+		mOffset(offset)
+	{
+		validate();
+	}
+
+	const std::vector<std::uint8_t>& getBytes() const {
+		return mBytes;
+	}
+
+	const std::vector<std::uint8_t>& getMask() const {
+		return mMask;
+	}
+
+	std::ptrdiff_t getOffset() const {
+		return mOffset;
+	}
+
+	std::size_t size() const {
+		return mBytes.size();
+	}
+
+	bool matches(const std::uint8_t* data) const {
+		for (std::size_t i = 0; i < mBytes.size(); i++) {
+			if ((data[i] & mMask[i]) != mBytes[i]) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+private:
+	void validate() {
+		bool hasFixedByte = false;
+		for (std::size_t i = 0; i < mBytes.size(); i++) {
+			mBytes[i] &= mMask[i];
+			// Only whole bytes can anchor the signature in the scanner
+			hasFixedByte |= mMask[i] == 0xFF;
+		}
+		if (!hasFixedByte) {
+			throw AsmSignatureInvalid();
+		}
+	}
+};
+
+class AsmSignatureResults final {
+	std::vector<std::vector<std::uintptr_t>> mMatches;
+
+	friend class AsmSignatureScanner;
+
+public:
+	// Addresses of all matches of a signature in ascending order
+	const std::vector<std::uintptr_t>& getMatches(std::size_t signature) const {
+		return mMatches.at(signature);
+	}
+
+	// The address to patch, throws AsmSignatureNotFound unless there is exactly one match
+	std::uintptr_t getUnique(std::size_t signature) const {
+		const std::vector<std::uintptr_t>& matches = getMatches(signature);
+		if (matches.size() != 1) {
+			throw AsmSignatureNotFound();
+		}
+		return matches.front();
+	}
+};
+
+// Finds all added signatures in one pass over the scanned region:
+//   AsmPatch::AsmSignatureScanner scanner;
+//   std::size_t hook = scanner.add(AsmPatch::AsmSignature("E8 ?? ?? ?? ?? 85 C0 74 ??"));
+//   AsmPatch::AsmSignatureResults results = scanner.scan(text, textSize);
+//   AsmPatch::Patch(results.getUnique(hook)).jmp(...);
+// Every signature is anchored at the run of four (or two) adjacent fixed bytes which is rarest in a sample of
+// the scanned data. An AVX2 or SSSE3 kernel (picked at runtime) filters the first two bytes of all anchors at once,
+// the anchors and the remaining bytes of a signature are only compared at positions passing that filter.
+class AsmSignatureScanner final {
+	static constexpr std::size_t BlockSize = 64 * 1024;
+	static constexpr std::size_t MinBytesPerThread = 1024 * 1024;
+	static constexpr std::size_t SampleChunks = 256;
+	static constexpr std::size_t SampleChunkSize = 4096;
+
+	struct Candidate
+	{
+		// The anchor pair itself, the hash of a four byte anchor or the single anchor byte
+		std::uint16_t mKey;
+		std::uint32_t mSignature;
+		std::uint32_t mAnchorOffset;
+
+		bool operator<(const Candidate& other) const {
+			return mKey < other.mKey;
+		}
+	};
+
+	using KeySet = std::array<std::uint64_t, 1024>;
+
+	struct Plan
+	{
+		AsmBuilder::SignatureKernels::AnchorSets mSets;
+		KeySet mPairKeys{};
+		KeySet mQuadKeys{};
+		// Sorted by key
+		std::vector<Candidate> mPairCandidates;
+		std::vector<Candidate> mQuadCandidates;
+		// Signatures without two adjacent fixed bytes
+		std::vector<Candidate> mByteCandidates;
+		// Many anchors let most positions pass the byte sets, then checking the keys directly is faster
+		bool mPrefilter = false;
+	};
+
+	std::vector<AsmSignature> mSignatures;
+	AsmBuilder::SignatureKernels::Level mLevel;
+
+public:
+	AsmSignatureScanner() :
+		mLevel(AsmBuilder::SignatureKernels::detectLevel())
+	{}
+
+	// Returns the index of the signature in the results
+	std::size_t add(AsmSignature signature) {
+		mSignatures.push_back(std::move(signature));
+		return mSignatures.size() - 1;
+	}
+
+	const std::vector<AsmSignature>& getSignatures() const {
+		return mSignatures;
+	}
+
+	// Mainly for benchmarks, a level the CPU does not support must not be forced
+	void setLevel(AsmBuilder::SignatureKernels::Level level) {
+		mLevel = level;
+	}
+
+	// Scans mapped memory, the matches are addresses inside it
+	AsmSignatureResults scan(const void* begin, std::size_t size, unsigned threads = 0) const {
+		return scan(static_cast<const std::uint8_t*>(begin), size, reinterpret_cast<std::uintptr_t>(begin), threads);
+	}
+
+	// Scans a copy of the code (e.g. a file image) whose first byte is located at baseAddress.
+	// threads = 0 uses all hardware threads, small regions are always scanned by the calling thread.
+	AsmSignatureResults scan(const std::uint8_t* data, std::size_t size, std::uintptr_t baseAddress, unsigned threads = 0) const {
+		if (threads == 0) {
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		}
+		threads = static_cast<unsigned>(std::min<std::size_t>(threads, std::max<std::size_t>(1, size / MinBytesPerThread)));
+
+		const std::unique_ptr<Plan> plan = buildPlan(data, size);
+		using Match = std::pair<std::uint32_t, std::uintptr_t>;
+		std::vector<std::vector<Match>> threadMatches(threads);
+		auto scanSlice = [&](unsigned thread) {
+			const std::size_t from = size / threads * thread;
+			const std::size_t to = thread + 1 == threads ? size : size / threads * (thread + 1);
+			scanRange(*plan, data, size, from, to, baseAddress, threadMatches[thread]);
+		};
+
+		std::vector<std::thread> workers;
+		for (unsigned thread = 1; thread < threads; thread++) {
+			workers.emplace_back(scanSlice, thread);
+		}
+		scanSlice(0);
+		for (std::thread& worker : workers) {
+			worker.join();
+		}
+
+		AsmSignatureResults results;
+		results.mMatches.resize(mSignatures.size());
+		for (const std::vector<Match>& matches : threadMatches) {
+			for (const Match& match : matches) {
+				results.mMatches[match.first].push_back(match.second);
+			}
+		}
+		for (std::vector<std::uintptr_t>& matches : results.mMatches) {
+			std::sort(matches.begin(), matches.end());
+		}
+		return results;
+	}
+
+private:
+	static std::uint16_t pairKey(const std::uint8_t* bytes) {
+		return static_cast<std::uint16_t>(bytes[0] | (bytes[1] << 8));
+	}
+
+	static std::uint16_t quadKey(const std::uint8_t* bytes) {
+		std::uint32_t value;
+		std::memcpy(&value, bytes, sizeof(value));
+		return static_cast<std::uint16_t>((value * 2654435761u) >> 16);
+	}
+
+	static bool hasKey(const KeySet& keys, std::uint16_t key) {
+		return (keys[key >> 6] >> (key & 63)) & 1;
+	}
+
+	static void addKey(KeySet& keys, std::uint16_t key) {
+		keys[key >> 6] |= std::uint64_t(1) << (key & 63);
+	}
+
+	// Anchor positions in [from, to) are handled, the signatures around them may extend beyond
+	void scanRange(const Plan& plan, const std::uint8_t* data, std::size_t size, std::size_t from, std::size_t to, std::uintptr_t baseAddress,
+		std::vector<std::pair<std::uint32_t, std::uintptr_t>>& matches) const {
+		auto verify = [&](const Candidate& candidate, std::size_t pos) {
+			const AsmSignature& signature = mSignatures[candidate.mSignature];
+			if (pos < candidate.mAnchorOffset || pos - candidate.mAnchorOffset + signature.size() > size) {
+				return;
+			}
+			const std::size_t start = pos - candidate.mAnchorOffset;
+			if (signature.matches(data + start)) {
+				matches.emplace_back(candidate.mSignature, baseAddress + start + signature.getOffset());
+			}
+		};
+		auto verifyAll = [&](const std::vector<Candidate>& candidates, std::uint16_t key, std::size_t pos) {
+			const auto range = std::equal_range(candidates.begin(), candidates.end(), Candidate{ key, 0, 0 });
+			for (auto candidate = range.first; candidate != range.second; ++candidate) {
+				verify(*candidate, pos);
+			}
+		};
+
+		auto checkAnchors = [&](std::size_t pos) {
+			if (!plan.mPairCandidates.empty()) {
+				const std::uint16_t pair = pairKey(data + pos);
+				if (hasKey(plan.mPairKeys, pair)) {
+					verifyAll(plan.mPairCandidates, pair, pos);
+				}
+			}
+			if (!plan.mQuadCandidates.empty() && pos + 4 <= size) {
+				const std::uint16_t quad = quadKey(data + pos);
+				if (hasKey(plan.mQuadKeys, quad)) {
+					verifyAll(plan.mQuadCandidates, quad, pos);
+				}
+			}
+		};
+
+		// Blocks keep the data in cache while the single byte anchors pass over it
+		const bool anyAnchors = !plan.mPairCandidates.empty() || !plan.mQuadCandidates.empty();
+		for (std::size_t block = from; block < to; block += BlockSize) {
+			const std::size_t blockEnd = std::min(to, block + BlockSize);
+			// A pair anchor can not start at the last byte and a quad anchor not in the last three,
+			// the ends never drop below block so tiny inputs do not wrap around
+			const std::size_t anchorEnd = std::max(block, std::min(blockEnd, size - std::min<std::size_t>(size, 1)));
+			const std::size_t quadEnd = std::max(block, std::min(blockEnd, size - std::min<std::size_t>(size, 3)));
+			if (anyAnchors && plan.mPrefilter) {
+				AsmBuilder::SignatureKernels::findAnchors(mLevel, data, block, anchorEnd, plan.mSets, checkAnchors);
+			}
+			else if (anyAnchors) {
+				for (std::size_t pos = block; !plan.mQuadCandidates.empty() && pos < quadEnd; pos++) {
+					const std::uint16_t quad = quadKey(data + pos);
+					if (hasKey(plan.mQuadKeys, quad)) {
+						verifyAll(plan.mQuadCandidates, quad, pos);
+					}
+				}
+				for (std::size_t pos = block; !plan.mPairCandidates.empty() && pos < anchorEnd; pos++) {
+					const std::uint16_t pair = pairKey(data + pos);
+					if (hasKey(plan.mPairKeys, pair)) {
+						verifyAll(plan.mPairCandidates, pair, pos);
+					}
+				}
+			}
+			for (const Candidate& candidate : plan.mByteCandidates) {
+				AsmBuilder::SignatureKernels::findByte(data, block, blockEnd, static_cast<std::uint8_t>(candidate.mKey), [&](std::size_t pos) {
+					verify(candidate, pos);
+				});
+			}
+		}
+	}
+
+	// Anchors every signature at its rarest run of four or two adjacent fixed bytes (or single fixed byte)
+	// according to the frequencies in chunks spread evenly over the scanned data
+	std::unique_ptr<Plan> buildPlan(const std::uint8_t* data, std::size_t size) const {
+		std::vector<std::uint32_t> pairCounts(65536);
+		std::vector<std::uint32_t> quadCounts(65536);
+		std::array<std::uint32_t, 256> byteCounts{};
+		const std::size_t stride = std::max(SampleChunkSize, size / SampleChunks);
+		for (std::size_t chunk = 0; chunk < size; chunk += stride) {
+			const std::size_t chunkEnd = std::min(size, chunk + SampleChunkSize);
+			for (std::size_t pos = chunk; pos < chunkEnd; pos++) {
+				byteCounts[data[pos]]++;
+				if (pos + 2 <= chunkEnd) {
+					pairCounts[pairKey(data + pos)]++;
+				}
+				if (pos + 4 <= chunkEnd) {
+					quadCounts[quadKey(data + pos)]++;
+				}
+			}
+		}
+
+		std::unique_ptr<Plan> plan(new Plan());
+		for (std::uint32_t index = 0; index < mSignatures.size(); index++) {
+			const std::uint8_t* bytes = mSignatures[index].getBytes().data();
+			const std::uint8_t* mask = mSignatures[index].getMask().data();
+			const std::size_t size = mSignatures[index].size();
+
+			// Returns the offset of the rarest run of length fixed bytes, or size
+			auto rarest = [&](std::size_t length, auto count) {
+				std::size_t best = size;
+				std::uint32_t bestCount = UINT32_MAX;
+				std::size_t fixed = 0;
+				for (std::size_t i = 0; i < size; i++) {
+					fixed = mask[i] == 0xFF ? fixed + 1 : 0;
+					if (fixed >= length && count(bytes + i + 1 - length) < bestCount) {
+						best = i + 1 - length;
+						bestCount = count(bytes + best);
+					}
+				}
+				return best;
+			};
+
+			std::size_t anchor = rarest(4, [&](const std::uint8_t* run) { return quadCounts[quadKey(run)]; });
+			if (anchor != size) {
+				addKey(plan->mQuadKeys, quadKey(bytes + anchor));
+				plan->mSets.add(bytes[anchor], bytes[anchor + 1]);
+				plan->mQuadCandidates.push_back({ quadKey(bytes + anchor), index, static_cast<std::uint32_t>(anchor) });
+				continue;
+			}
+			anchor = rarest(2, [&](const std::uint8_t* run) { return pairCounts[pairKey(run)]; });
+			if (anchor != size) {
+				addKey(plan->mPairKeys, pairKey(bytes + anchor));
+				plan->mSets.add(bytes[anchor], bytes[anchor + 1]);
+				plan->mPairCandidates.push_back({ pairKey(bytes + anchor), index, static_cast<std::uint32_t>(anchor) });
+				continue;
+			}
+			anchor = rarest(1, [&](const std::uint8_t* run) { return byteCounts[*run]; });
+			plan->mByteCandidates.push_back({ bytes[anchor], index, static_cast<std::uint32_t>(anchor) });
+		}
+
+		std::size_t sampled = 0;
+		std::size_t passed = 0;
+		for (std::size_t chunk = 0; chunk < size; chunk += stride) {
+			for (std::size_t pos = chunk; pos + 1 < std::min(size, chunk + SampleChunkSize); pos++) {
+				sampled++;
+				passed += plan->mSets.contains(data + pos);
+			}
+		}
+		plan->mPrefilter = mLevel != AsmBuilder::SignatureKernels::LEVEL_SCALAR && passed * 16 < sampled;
+
+		std::stable_sort(plan->mPairCandidates.begin(), plan->mPairCandidates.end());
+		std::stable_sort(plan->mQuadCandidates.begin(), plan->mQuadCandidates.end());
+		return plan;
+	}
+};
+
+}
@@ -0,0 +1,314 @@
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <vector>
+#include "AsmPatchApplier.h"
+#include "AsmPatchTemplate.h"
+#include "details/MemoryUtils.h"
+#include "details/PerfMap.h"
+
+namespace AsmPatch {
+
+struct AsmPatchStubOutOfReach : std::exception {
+	const char* what() const noexcept override { return "No free memory within rel32 reach of the hook site"; }
+};
+
+struct AsmPatchStubNotWritable : std::exception {
+	const char* what() const noexcept override { return "Stub memory was already committed or not allocated"; }
+};
+
+struct AsmStubAllocatorStats
+{
+	std::size_t mRegions = 0;
+	std::size_t mStubs = 0;
+	// place() calls which reused an identical stub
+	std::size_t mSharedStubs = 0;
+	std::size_t mBytesUsed = 0;
+	std::size_t mProtectCalls = 0;
+};
+
+// Allocates executable memory for stubs and trampolines within rel32 reach of their hook sites.
+// Regions are reserved as close as possible to the requested address and stubs are packed into them.
+// New stubs stay writable until commit() turns all of them executable, one mprotect per region, so the
+// memory is never writable and executable at the same time. Committed pages are not written again,
+// stubs allocated afterwards start on the next page. Stubs passed to write() and place() are listed in
+// the perf map under the current AsmPerfMapScope, see AsmPerfMap.h.
+//
+//   AsmPatch::AsmStubAllocator stubs;
+//   std::uintptr_t stub = stubs.allocate(32, site);
+//   stubs.write(AsmPatch::Patch(stub).safeCall(hook).jmp(site + 5).compile());
+//   std::uintptr_t shared = stubs.place(stubTemplate, site); // identical stubs in reach are shared
+//   stubs.commit();
+//   AsmPatch::Patch(site).jmp(stub) ...
+class AsmStubAllocator
+{
+	struct Region
+	{
+		std::uintptr_t mBegin;
+		std::uintptr_t mEnd;
+		std::uintptr_t mCursor;
+		// [mBegin, mSealed) is executable
+		std::uintptr_t mSealed;
+	};
+
+	struct PlacedStub
+	{
+		std::uintptr_t mAddr;
+		std::uintptr_t mSize;
+	};
+
+	std::size_t mRegionSize;
+	std::size_t mAlignment;
+	std::mutex mMutex;
+	std::vector<Region> mRegions;
+	// Stubs created by place(), by canonicalHash()
+	std::unordered_map<std::uint64_t, std::vector<PlacedStub>> mPlaced;
+	std::vector<std::uint8_t> mScratch;
+	AsmStubAllocatorStats mStats;
+
+public:
+	// regionSize is rounded up to whole pages, alignment must be a power of two
+	explicit AsmStubAllocator(std::size_t regionSize = 256 * 1024, std::size_t alignment = 16) :
+		mRegionSize(AsmBuilder::MemoryUtils::alignUp(regionSize, AsmBuilder::MemoryUtils::pageSize())),
+		mAlignment(alignment)
+	{}
+
+	AsmStubAllocator(const AsmStubAllocator&) = delete;
+	AsmStubAllocator& operator=(const AsmStubAllocator&) = delete;
+
+	// Unmaps all stubs, none of them may be in use anymore
+	~AsmStubAllocator()
+	{
+		for (const Region& region : mRegions) {
+			munmap(reinterpret_cast<void*>(region.mBegin), region.mEnd - region.mBegin);
+		}
+	}
+
+	// Reserves size bytes from which all of [near - 2 GB, near + 2 GB) can be reached with rel32 branches
+	// and the other way round. Without near the stub is placed anywhere. Writable until commit().
+	std::uintptr_t allocate(std::size_t size, std::uintptr_t near = 0, std::size_t alignment = 0)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		return allocateLocked(size, near, alignment ? alignment : mAlignment);
+	}
+
+	// Copies patch to its address, which has to lie in memory returned by allocate() and not committed yet
+	void write(const AsmPatchData& patch)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		const Region* region = findWritable(patch.getAddress(), patch.getData().size());
+		if (!region) {
+			throw AsmPatchStubNotWritable();
+		}
+		std::memcpy(reinterpret_cast<void*>(patch.getAddress()), patch.getData().data(), patch.getData().size());
+		AsmBuilder::PerfMap::record(reinterpret_cast<const void*>(patch.getAddress()), patch.getData().size(), "stub");
+	}
+
+	// Instantiates stub within reach of near. An identical stub placed before is returned instead if it is
+	// in reach, identical meaning that it has the same bytes and branches to the same targets.
+	std::uintptr_t place(const AsmPatchTemplate& stub, std::uintptr_t near = 0)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		const std::uint64_t hash = canonicalHash(stub);
+		std::vector<PlacedStub>& candidates = mPlaced[hash];
+		mScratch.resize(stub.size());
+		for (const PlacedStub& candidate : candidates) {
+			if (candidate.mSize != stub.size() || !inReach(candidate.mAddr, candidate.mSize, near)) {
+				continue;
+			}
+			try {
+				stub.instantiateInto(candidate.mAddr, mScratch.data(), mScratch.size());
+			}
+			catch (const AsmPatchRel32OutOfRange&) {
+				continue;
+			}
+			if (std::memcmp(mScratch.data(), reinterpret_cast<const void*>(candidate.mAddr), mScratch.size()) == 0) {
+				mStats.mSharedStubs++;
+				return candidate.mAddr;
+			}
+		}
+
+		const std::uintptr_t addr = allocateLocked(stub.size(), near, mAlignment);
+		try {
+			stub.instantiateInto(addr, reinterpret_cast<std::uint8_t*>(addr), stub.size());
+		}
+		catch (...) {
+			untake(addr, stub.size());
+			throw;
+		}
+		AsmBuilder::PerfMap::record(reinterpret_cast<const void*>(addr), stub.size(), "stub");
+		candidates.push_back({ addr, stub.size() });
+		return addr;
+	}
+
+	// Makes all stubs written since the last commit executable and flushes the instruction cache for them
+	void commit()
+	{
+		namespace MemoryUtils = AsmBuilder::MemoryUtils;
+
+		std::lock_guard<std::mutex> lock(mMutex);
+		const std::uintptr_t pageSize = MemoryUtils::pageSize();
+		for (Region& region : mRegions) {
+			if (region.mCursor <= region.mSealed) {
+				continue;
+			}
+			const std::uintptr_t end = MemoryUtils::alignUp(region.mCursor, pageSize);
+			MemoryUtils::flushInstructionCache(region.mSealed, region.mCursor);
+			if (!MemoryUtils::protect(region.mSealed, end, PROT_READ | PROT_EXEC)) {
+				throw AsmPatchProtectFailed(errno);
+			}
+			mStats.mProtectCalls++;
+			region.mSealed = end;
+			region.mCursor = end;
+		}
+	}
+
+	AsmStubAllocatorStats getStats()
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		return mStats;
+	}
+
+private:
+	// Margin for the length of the branch instructions and the patches jumping to the stub
+	static constexpr std::uintptr_t MaxDistance = 0x7FFFFFFFu - 0x10000u;
+
+	static bool inReach(std::uintptr_t addr, std::uintptr_t size, std::uintptr_t near)
+	{
+		if (sizeof(std::uintptr_t) == 4 || !near) {
+			return true;
+		}
+		const std::uintptr_t end = addr + size;
+		return (addr > near ? addr - near : near - addr) <= MaxDistance && (end > near ? end - near : near - end) <= MaxDistance;
+	}
+
+	const Region* findWritable(std::uintptr_t addr, std::uintptr_t size) const
+	{
+		for (const Region& region : mRegions) {
+			if (addr >= region.mSealed && addr + size <= region.mCursor && addr + size >= addr) {
+				return &region;
+			}
+		}
+		return nullptr;
+	}
+
+	std::uintptr_t allocateLocked(std::size_t size, std::uintptr_t near, std::size_t alignment)
+	{
+		namespace MemoryUtils = AsmBuilder::MemoryUtils;
+
+		for (Region& region : mRegions) {
+			const std::uintptr_t addr = MemoryUtils::alignUp(region.mCursor, alignment);
+			if (addr + size <= region.mEnd && inReach(addr, size, near)) {
+				return take(region, addr, size);
+			}
+		}
+
+		const std::size_t regionSize = MemoryUtils::alignUp(size + alignment, mRegionSize);
+		Region& region = mapRegion(regionSize, near);
+		return take(region, MemoryUtils::alignUp(region.mCursor, alignment), size);
+	}
+
+	std::uintptr_t take(Region& region, std::uintptr_t addr, std::size_t size)
+	{
+		region.mCursor = addr + size;
+		mStats.mStubs++;
+		mStats.mBytesUsed += size;
+		return addr;
+	}
+
+	// Gives back the stub allocateLocked() just returned, nothing was allocated after it
+	void untake(std::uintptr_t addr, std::size_t size)
+	{
+		for (Region& region : mRegions) {
+			if (region.mCursor == addr + size && addr >= region.mSealed) {
+				region.mCursor = addr;
+				mStats.mStubs--;
+				mStats.mBytesUsed -= size;
+				return;
+			}
+		}
+	}
+
+	Region& mapRegion(std::size_t size, std::uintptr_t near)
+	{
+		namespace MemoryUtils = AsmBuilder::MemoryUtils;
+
+		void* mem = nullptr;
+		if (sizeof(std::uintptr_t) == 4 || !near) {
+			mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			mem = mem == MAP_FAILED ? nullptr : mem;
+		}
+		else {
+			mem = MemoryUtils::mapNear(near, size, MaxDistance, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS);
+		}
+		if (!mem) {
+			throw AsmPatchStubOutOfReach();
+		}
+
+		const std::uintptr_t begin = reinterpret_cast<std::uintptr_t>(mem);
+		mRegions.push_back({ begin, begin + size, begin, begin });
+		mStats.mRegions++;
+		return mRegions.back();
+	}
+
+	// Equal for stubs which produce the same bytes when instantiated at the same address:
+	// rel32 fields are hashed as their targets and absolute fields as offsets into the stub
+	static std::uint64_t canonicalHash(const AsmPatchTemplate& stub)
+	{
+		std::uint64_t hash = 0xCBF29CE484222325ull;
+		auto mix = [&hash](std::uint64_t value, int bytes) {
+			for (int i = 0; i < bytes; i++) {
+				hash = (hash ^ static_cast<std::uint8_t>(value >> (i * 8))) * 0x100000001B3ull;
+			}
+		};
+
+		const std::vector<std::uint8_t>& bytes = stub.getData();
+		const std::uint64_t base = stub.getAddress();
+		const bool x86 = stub.mode() == AsmConsts::MODE_X86;
+		std::size_t offset = 0;
+		for (const AsmRelocation& relocation : stub.getRelocations()) {
+			for (; offset < relocation.mOffset; offset++) {
+				mix(bytes[offset], 1);
+			}
+			std::uint64_t value = 0;
+			switch (relocation.mKind) {
+			case AsmRelocation::REL32: {
+				std::int32_t rel;
+				std::memcpy(&rel, &bytes[offset], sizeof(rel));
+				value = static_cast<std::uint64_t>(static_cast<std::int64_t>(rel)) + base;
+				value = x86 ? static_cast<std::uint32_t>(value) : value;
+				offset += 4;
+				break;
+			}
+			case AsmRelocation::ABS32: {
+				std::uint32_t absolute;
+				std::memcpy(&absolute, &bytes[offset], sizeof(absolute));
+				value = static_cast<std::uint32_t>(absolute - static_cast<std::uint32_t>(base));
+				offset += 4;
+				break;
+			}
+			case AsmRelocation::ABS64:
+				std::memcpy(&value, &bytes[offset], sizeof(value));
+				value -= base;
+				offset += 8;
+				break;
+			}
+			mix(relocation.mKind, 1);
+			mix(value, 8);
+		}
+		for (; offset < bytes.size(); offset++) {
+			mix(bytes[offset], 1);
+		}
+		mix(bytes.size(), 8);
+		return hash;
+	}
+};
+
+}
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <vector>
+#include "AsmInstructionDecoder.h"
+#include "DynamicAsmPatchBuilder.h"
+
+namespace AsmPatch {
+
+struct AsmPatchRelocationFailed : std::exception {
+	const char* what() const noexcept override { return "Instruction cannot be relocated to the trampoline"; }
+};
+
+struct AsmTrampoline
+{
+	// Relocated instructions followed by the jmp back, to be written at the trampoline address
+	AsmPatchData mCode;
+	// Length of the whole instructions moved out of the source, the detour may overwrite this many bytes
+	std::uintptr_t mStolenSize;
+};
+
+namespace AsmTrampolineDetail {
+	struct Relocation
+	{
+		AsmInstruction mInstruction;
+		std::uintptr_t mOffset;
+		std::uintptr_t mTarget;
+		std::uintptr_t mNewOffset;
+		bool mInternal;
+		bool mFar;
+	};
+
+	inline std::uintptr_t relocatedSize(const Relocation& relocation)
+	{
+		const AsmInstruction& instruction = relocation.mInstruction;
+		if (!instruction.mRelative) {
+			return instruction.mLength;
+		}
+		switch (instruction.mKind) {
+		case INSTR_JMP: return relocation.mFar ? 14 : 5;
+		case INSTR_CALL: return relocation.mFar ? 16 : 5;
+		case INSTR_JCC: return relocation.mFar ? 16 : 6;
+		// [prefixes] loop +2 / jmp short +5 (or +14) / jmp target
+		case INSTR_LOOP: return instruction.mOpcodeOffset + (relocation.mFar ? 18 : 9);
+		default: throw AsmPatchRelocationFailed();
+		}
+	}
+}
+
+// Copies the whole instructions covering at least minSize bytes at source into a trampoline located at
+// trampoline and appends a jmp back to the first instruction which was not copied.
+// code holds the original bytes of source, e.g. from a file image or a copy taken before patching.
+// Short branches are widened to rel32 (or the absolute x86-64 forms if the target is out of reach),
+// branches into the copied range are redirected into the trampoline and rip relative operands are adjusted.
+inline AsmTrampoline buildTrampoline(std::uintptr_t source, const std::uint8_t* code, std::size_t available, std::size_t minSize,
+	std::uintptr_t trampoline, AsmConsts::Mode mode = AsmConsts::MODE_HOST)
+{
+	using AsmTrampolineDetail::Relocation;
+
+	std::vector<Relocation> relocations;
+	std::uintptr_t stolenSize = 0;
+	while (stolenSize < minSize) {
+		Relocation relocation{};
+		if (!decodeInstruction(code + stolenSize, available - stolenSize, mode, relocation.mInstruction)) {
+			throw AsmPatchDecodeFailed();
+		}
+		relocation.mOffset = stolenSize;
+		stolenSize += relocation.mInstruction.mLength;
+		relocations.push_back(relocation);
+	}
+
+	// Layout pass, sizes only depend on the instructions before
+	std::uintptr_t newSize = 0;
+	for (Relocation& relocation : relocations) {
+		const AsmInstruction& instruction = relocation.mInstruction;
+		const std::uint8_t* bytes = code + relocation.mOffset;
+		relocation.mNewOffset = newSize;
+
+		if (instruction.mRelative) {
+			if (instruction.mImmSize == 2) {
+				throw AsmPatchRelocationFailed();
+			}
+			relocation.mTarget = instruction.branchTarget(bytes, source + relocation.mOffset);
+			relocation.mInternal = relocation.mTarget >= source && relocation.mTarget < source + stolenSize;
+			relocation.mFar = mode == AsmConsts::MODE_X64 && !relocation.mInternal
+				&& !AsmEncoding::fitsRel32(relocation.mTarget, trampoline + newSize + 6);
+		}
+		else if (instruction.mRipRelative) {
+			relocation.mTarget = instruction.ripTarget(bytes, source + relocation.mOffset);
+			if (!AsmEncoding::fitsRel32(relocation.mTarget, trampoline + newSize + instruction.mLength)) {
+				throw AsmPatchRelocationFailed();
+			}
+		}
+		newSize += AsmTrampolineDetail::relocatedSize(relocation);
+	}
+
+	auto newTarget = [&](const Relocation& relocation) {
+		if (!relocation.mInternal) {
+			return relocation.mTarget;
+		}
+		for (const Relocation& other : relocations) {
+			if (source + other.mOffset == relocation.mTarget) {
+				return trampoline + other.mNewOffset;
+			}
+		}
+		// Branch into the middle of a copied instruction
+		throw AsmPatchRelocationFailed();
+	};
+
+	DynamicAsmPatchBuilder builder(trampoline, mode);
+	builder.reserve(newSize + 14);
+	for (const Relocation& relocation : relocations) {
+		const AsmInstruction& instruction = relocation.mInstruction;
+		const std::uint8_t* bytes = code + relocation.mOffset;
+
+		if (!instruction.mRelative) {
+			std::uint8_t copy[15];
+			std::memcpy(copy, bytes, instruction.mLength);
+			if (instruction.mRipRelative) {
+				const std::uint32_t disp = AsmEncoding::rel32(relocation.mTarget, trampoline + relocation.mNewOffset + instruction.mLength);
+				std::memcpy(copy + instruction.mDispOffset, &disp, sizeof(disp));
+			}
+			builder.bytes(copy, instruction.mLength);
+			continue;
+		}
+
+		const std::uintptr_t target = newTarget(relocation);
+		const std::uintptr_t start = builder.cursor();
+		const std::uint8_t condition = instruction.mOpcode & 0x0F;
+		switch (instruction.mKind) {
+		case INSTR_JMP:
+			if (relocation.mFar) {
+				builder.jmpAbs64(target);
+			}
+			else {
+				builder.byte(0xE9).dword(AsmEncoding::rel32(target, start + 5));
+			}
+			break;
+		case INSTR_CALL:
+			if (relocation.mFar) {
+				builder.callAbs64(target);
+			}
+			else {
+				builder.byte(0xE8).dword(AsmEncoding::rel32(target, start + 5));
+			}
+			break;
+		case INSTR_JCC:
+			if (relocation.mFar) {
+				// jncc over the absolute jmp
+				builder.byte(0x70 | (condition ^ 1)).byte(14).jmpAbs64(target);
+			}
+			else {
+				builder.byte(0x0F).byte(0x80 | condition).dword(AsmEncoding::rel32(target, start + 6));
+			}
+			break;
+		case INSTR_LOOP:
+			// Keeps the address size prefix which selects cx/ecx/rcx
+			builder.bytes(bytes, instruction.mOpcodeOffset).byte(instruction.mOpcode).byte(2);
+			if (relocation.mFar) {
+				builder.byte(0xEB).byte(14).jmpAbs64(target);
+			}
+			else {
+				builder.byte(0xEB).byte(5).byte(0xE9).dword(AsmEncoding::rel32(target, start + instruction.mOpcodeOffset + 9));
+			}
+			break;
+		default:
+			throw AsmPatchRelocationFailed();
+		}
+	}
+	builder.jmp(source + stolenSize);
+
+	return { std::move(builder).compile(), stolenSize };
+}
+
+// Reads the original instructions directly from source
+inline AsmTrampoline buildTrampoline(std::uintptr_t source, std::size_t minSize, std::uintptr_t trampoline, AsmConsts::Mode mode = AsmConsts::MODE_HOST)
+{
+	// The last covering instruction starts below minSize and is at most 15 bytes long
+	return buildTrampoline(source, reinterpret_cast<const std::uint8_t*>(source), minSize + 14, minSize, trampoline, mode);
+}
+
+}
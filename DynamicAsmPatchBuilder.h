@@ -0,0 +1,933 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <initializer_list>
+#include <type_traits>
+#include <vector>
+#include <utility>
+#include "AsmPatchBuilder.h"
+#include "AsmPatchTemplate.h"
+#include "details/X86Encoder.h"
+
+namespace AsmPatch {
+
+struct AsmPatchPadTooSmall : std::exception {
+	const char* what() const noexcept override { return "Cannot pad smaller than old size"; }
+};
+
+struct AsmPatchUnboundLabel : std::exception {
+	const char* what() const noexcept override { return "Label is referenced but was never bound"; }
+};
+
+struct AsmPatchLabelRebound : std::exception {
+	const char* what() const noexcept override { return "Label is already bound"; }
+};
+
+struct AsmPatchInvalidOperands : std::exception {
+	const char* what() const noexcept override { return "Operands cannot be encoded for this instruction"; }
+};
+
+// Memory operand [base + index * scale + disp] or [address]. The access width is only needed
+// without a register operand, e.g. for cmp(AsmMem(...).byte(), 0), and defaults to 4 bytes.
+// 32-bit base/index registers in x86-64 mode get an address size prefix.
+struct AsmMem
+{
+	AsmBuilder::X86Encoder::Operand mOperand;
+
+	constexpr AsmMem(AsmConsts::R32 base, std::int32_t disp = 0) :
+		mOperand(make(base, -1, 1, disp, 4))
+	{}
+
+	constexpr AsmMem(AsmConsts::R32 base, AsmConsts::R32 index, std::uint8_t scale = 1, std::int32_t disp = 0) :
+		mOperand(make(base, index, scale, disp, 4))
+	{}
+
+	constexpr AsmMem(AsmConsts::R64 base, std::int32_t disp = 0) :
+		mOperand(make(base, -1, 1, disp, 8))
+	{}
+
+	constexpr AsmMem(AsmConsts::R64 base, AsmConsts::R64 index, std::uint8_t scale = 1, std::int32_t disp = 0) :
+		mOperand(make(base, index, scale, disp, 8))
+	{}
+
+	// In x86-64 mode addresses beyond the sign extended disp32 range are reached rip relative
+	static constexpr AsmMem absolute(std::uintptr_t addr) {
+		AsmMem mem(make(-1, -1, 1, 0, 0));
+		mem.mOperand.mValue = static_cast<std::int64_t>(addr);
+		return mem;
+	}
+
+	// [index * scale + disp] without base
+	static constexpr AsmMem indexed(AsmConsts::R32 index, std::uint8_t scale, std::int32_t disp) {
+		return AsmMem(make(-1, index, scale, disp, 4));
+	}
+
+	static constexpr AsmMem indexed(AsmConsts::R64 index, std::uint8_t scale, std::int32_t disp) {
+		return AsmMem(make(-1, index, scale, disp, 8));
+	}
+
+	constexpr AsmMem byte() const { return sized(1); }
+	constexpr AsmMem word() const { return sized(2); }
+	constexpr AsmMem dword() const { return sized(4); }
+	constexpr AsmMem qword() const { return sized(8); }
+
+private:
+	constexpr explicit AsmMem(const AsmBuilder::X86Encoder::Operand& operand) :
+		mOperand(operand)
+	{}
+
+	constexpr AsmMem sized(std::uint8_t size) const {
+		AsmMem mem = *this;
+		mem.mOperand.mSize = size;
+		return mem;
+	}
+
+	static constexpr AsmBuilder::X86Encoder::Operand make(int base, int index, std::uint8_t scale, std::int32_t disp, std::uint8_t addressSize) {
+		AsmBuilder::X86Encoder::Operand operand;
+		operand.mKind = AsmBuilder::X86Encoder::Operand::KIND_MEM;
+		operand.mSize = 4;
+		operand.mBase = static_cast<std::int8_t>(base);
+		operand.mIndex = static_cast<std::int8_t>(index);
+		operand.mScale = scale;
+		operand.mAddressSize = addressSize;
+		operand.mValue = disp;
+		return operand;
+	}
+};
+
+// Register or memory operand of the generic instructions
+struct AsmOperand
+{
+	AsmBuilder::X86Encoder::Operand mOperand;
+
+	constexpr AsmOperand(AsmConsts::R32 reg) :
+		mOperand(makeRegister(reg, 4))
+	{}
+
+	constexpr AsmOperand(AsmConsts::R64 reg) :
+		mOperand(makeRegister(reg, 8))
+	{}
+
+	constexpr AsmOperand(const AsmMem& mem) :
+		mOperand(mem.mOperand)
+	{}
+
+private:
+	static constexpr AsmBuilder::X86Encoder::Operand makeRegister(int reg, std::uint8_t size) {
+		AsmBuilder::X86Encoder::Operand operand;
+		operand.mKind = AsmBuilder::X86Encoder::Operand::KIND_REG;
+		operand.mSize = size;
+		operand.mReg = static_cast<std::uint8_t>(reg);
+		return operand;
+	}
+};
+
+// Branch target inside a DynamicAsmPatchBuilder, or an absolute address, see newLabel() and labelAt()
+struct AsmLabel
+{
+	std::size_t mId;
+};
+
+// Runtime counterpart of AsmPatchBuilder<Size> for patches whose shape is only known at runtime.
+// The bytes are appended to a buffer which is either owned by the builder or supplied by the caller,
+// so one buffer can serve as an arena for many patches and be reused between runs.
+class DynamicAsmPatchBuilder final {
+	/********************
+	* Member variables *
+	********************/
+	std::uintptr_t mAddr;
+	std::vector<std::uint8_t> mOwnedBytes;
+	std::vector<std::uint8_t>* mBytes;
+	std::size_t mBegin;
+	AsmConsts::Mode mMode;
+
+	struct Label
+	{
+		// Offset from the patch start once bound, or the absolute address of an external label
+		std::uintptr_t mValue;
+		bool mBound;
+		bool mExternal;
+	};
+
+	// rel32 branch emitted in its long form whose displacement is only written by relax()
+	struct Branch
+	{
+		std::uintptr_t mOffset;
+		// Label id, or the absolute target of a fixed call/jmp which only has to follow the relaxed layout
+		std::uintptr_t mTarget;
+		// E8 call, E9 jmp or 80+cc for 0F 8x jcc
+		std::uint8_t mOpcode;
+		bool mToLabel;
+		bool mRelaxable;
+	};
+
+	// Rip relative memory operand emitted after the first label branch, re-encoded by relax()
+	struct RipOperand
+	{
+		std::uintptr_t mOffset;
+		std::uint8_t mDispOffset;
+		std::uint8_t mLength;
+		std::uintptr_t mTarget;
+	};
+
+	std::vector<Label> mLabels;
+	std::vector<Branch> mBranches;
+	std::vector<RipOperand> mRipOperands;
+	// Ends of nopPadToSize() paddings after the first label branch. They stay at the same offset
+	// during relaxation, the padding absorbs the bytes saved before it.
+	std::vector<std::uintptr_t> mPads;
+	// Rel32 fields before the first label branch and all absolute addresses of the patch, see compileTemplate().
+	// Later rel32 fields move during relaxation and are taken from mBranches and mRipOperands instead.
+	std::vector<AsmRelocation> mRelocations;
+	// Set once relax() shortened a branch to an external label, which then only reaches it from mAddr
+	bool mPositionDependent = false;
+
+	/***********************************
+	* Constructor and utility methods *
+	***********************************/
+public:
+	explicit DynamicAsmPatchBuilder(std::uintptr_t addr, AsmConsts::Mode mode = AsmConsts::MODE_HOST) :
+		mAddr(addr),
+		mBytes(&mOwnedBytes),
+		mBegin(0),
+		mMode(mode)
+	{}
+
+	explicit DynamicAsmPatchBuilder(void* addr, AsmConsts::Mode mode = AsmConsts::MODE_HOST) :
+		DynamicAsmPatchBuilder(reinterpret_cast<std::uintptr_t>(addr), mode)
+	{}
+
+	// The patch starts at the current end of arena, previous content is left untouched
+	DynamicAsmPatchBuilder(std::uintptr_t addr, std::vector<std::uint8_t>& arena, AsmConsts::Mode mode = AsmConsts::MODE_HOST) :
+		mAddr(addr),
+		mBytes(&arena),
+		mBegin(arena.size()),
+		mMode(mode)
+	{}
+
+	DynamicAsmPatchBuilder(const DynamicAsmPatchBuilder&) = delete;
+	DynamicAsmPatchBuilder& operator=(const DynamicAsmPatchBuilder&) = delete;
+
+	std::uintptr_t address() const {
+		return mAddr;
+	}
+
+	AsmConsts::Mode mode() const {
+		return mMode;
+	}
+
+	std::uintptr_t size() const {
+		return mBytes->size() - mBegin;
+	}
+
+	std::uintptr_t cursor() const {
+		return mAddr + size();
+	}
+
+	const std::uint8_t* data() const {
+		return mBytes->data() + mBegin;
+	}
+
+	DynamicAsmPatchBuilder& reserve(std::uintptr_t patchSize) {
+		mBytes->reserve(mBegin + patchSize);
+		return *this;
+	}
+
+	// The compile methods relax label branches first, see relax()
+	AsmPatchData compile() const &
+	{
+		if (!mBranches.empty()) {
+			return AsmPatchData(mAddr, relaxedBytes(nullptr, nullptr, false));
+		}
+		return AsmPatchData(mAddr, data(), size());
+	}
+
+	// Position independent version of the patch which can be instantiated at other addresses.
+	// Branches to external labels keep their rel32 form. Throws AsmPatchNotRelocatable if relax()
+	// already shortened one of them.
+	AsmPatchTemplate compileTemplate() const
+	{
+		if (mPositionDependent) {
+			throw AsmPatchNotRelocatable();
+		}
+		if (mBranches.empty()) {
+			return AsmPatchTemplate(mAddr, std::vector<std::uint8_t>(data(), data() + size()), mRelocations, mMode);
+		}
+		std::vector<AsmRelocation> relocations;
+		std::vector<std::uint8_t> bytes = relaxedBytes(nullptr, &relocations, true);
+		return AsmPatchTemplate(mAddr, std::move(bytes), std::move(relocations), mMode);
+	}
+
+	// Hands over the owned buffer without copying it, unless the patch fits into AsmPatchData inline
+	AsmPatchData compile() &&
+	{
+		relax();
+		if (mBytes != &mOwnedBytes) {
+			return static_cast<const DynamicAsmPatchBuilder&>(*this).compile();
+		}
+		return AsmPatchData(mAddr, std::move(mOwnedBytes));
+	}
+
+	template <typename OutputIt>
+	OutputIt compileInto(OutputIt out) const
+	{
+		if (!mBranches.empty()) {
+			const std::vector<std::uint8_t> relaxed = relaxedBytes(nullptr, nullptr, false);
+			return std::copy(relaxed.begin(), relaxed.end(), out);
+		}
+		const std::uint8_t* patchBytes = data();
+		for (std::uintptr_t i = 0; i < size(); i++) {
+			*out++ = patchBytes[i];
+		}
+		return out;
+	}
+
+	std::uintptr_t compileInto(std::uint8_t* buffer, std::uintptr_t bufferSize) const
+	{
+		if (!mBranches.empty()) {
+			const std::vector<std::uint8_t> relaxed = relaxedBytes(nullptr, nullptr, false);
+			if (bufferSize < relaxed.size()) {
+				throw AsmPatchBufferTooSmall();
+			}
+			std::memcpy(buffer, relaxed.data(), relaxed.size());
+			return relaxed.size();
+		}
+		if (bufferSize < size()) {
+			throw AsmPatchBufferTooSmall();
+		}
+		if (size()) {
+			std::memcpy(buffer, data(), size());
+		}
+		return size();
+	}
+
+	/**********************
+	* Labels and branches *
+	**********************/
+	AsmLabel newLabel() {
+		mLabels.push_back({ 0, false, false });
+		return { mLabels.size() - 1 };
+	}
+
+	// Label for a fixed address outside of the patch, so branches to it can be relaxed as well
+	AsmLabel labelAt(std::uintptr_t addr) {
+		mLabels.push_back({ addr, true, true });
+		return { mLabels.size() - 1 };
+	}
+
+	// Binds label to the cursor
+	DynamicAsmPatchBuilder& bind(AsmLabel label) {
+		Label& bound = mLabels.at(label.mId);
+		if (bound.mBound) {
+			throw AsmPatchLabelRebound();
+		}
+		bound.mValue = size();
+		bound.mBound = true;
+		return *this;
+	}
+
+	// Emitted as rel32 placeholders, relax() shortens them to EB rel8 / 70+cc rel8 where the target is in range
+	DynamicAsmPatchBuilder& jmp(AsmLabel label) {
+		return labelBranch(0xE9, label, true);
+	}
+
+	DynamicAsmPatchBuilder& jcc(AsmConsts::Condition condition, AsmLabel label) {
+		return labelBranch(static_cast<std::uint8_t>(0x80 | condition), label, true);
+	}
+
+	DynamicAsmPatchBuilder& jcc(AsmConsts::Condition condition, std::uintptr_t addr) {
+		return jcc(condition, labelAt(addr));
+	}
+
+	// Always call rel32, there is no shorter form
+	DynamicAsmPatchBuilder& call(AsmLabel label) {
+		return labelBranch(0xE8, label, false);
+	}
+
+	// Picks the shortest form of every label branch and rewrites the patch in place.
+	// Branches start short and only the ones whose target ends up out of rel8 range are widened,
+	// repeated until no size changes any more. Bytes emitted after the first label branch move,
+	// so call() and jmp() to absolute addresses and rip relative AsmMem operands are re-encoded
+	// as well, raw bytes are copied as is.
+	// Until then size() and cursor() refer to the unrelaxed layout with all label branches in rel32 form.
+	DynamicAsmPatchBuilder& relax() {
+		if (mBranches.empty()) {
+			return *this;
+		}
+		std::vector<std::uintptr_t> labelOffsets;
+		std::vector<AsmRelocation> relocations;
+		std::vector<std::uint8_t> relaxed = relaxedBytes(&labelOffsets, &relocations, false, &mPositionDependent);
+		mBytes->resize(mBegin);
+		mBytes->insert(mBytes->end(), relaxed.begin(), relaxed.end());
+		for (std::size_t i = 0; i < mLabels.size(); i++) {
+			mLabels[i].mValue = labelOffsets[i];
+		}
+		mBranches.clear();
+		mRipOperands.clear();
+		mPads.clear();
+		mRelocations = std::move(relocations);
+		return *this;
+	}
+
+	/*******************************
+	* Appending data to the patch *
+	*******************************/
+	DynamicAsmPatchBuilder& bytes(std::initializer_list<std::uint8_t> newBytes) {
+		mBytes->insert(mBytes->end(), newBytes.begin(), newBytes.end());
+		return *this;
+	}
+
+	DynamicAsmPatchBuilder& bytes(const std::uint8_t* newBytes, std::uintptr_t count) {
+		mBytes->insert(mBytes->end(), newBytes, newBytes + count);
+		return *this;
+	}
+
+	template <typename... Ts>
+	DynamicAsmPatchBuilder& bytes(std::uint8_t newByte, Ts... params) {
+		return bytes({ newByte, static_cast<std::uint8_t>(params)... });
+	}
+
+	DynamicAsmPatchBuilder& byte(std::uint8_t newByte) {
+		mBytes->push_back(newByte);
+		return *this;
+	}
+
+	DynamicAsmPatchBuilder& word(std::uint32_t newWord) {
+		return bytes(
+			static_cast<std::uint8_t>(newWord),
+			static_cast<std::uint8_t>(newWord >> 8));
+	}
+
+	DynamicAsmPatchBuilder& dword(std::uint32_t newDWord) {
+		return bytes(
+			static_cast<std::uint8_t>(newDWord),
+			static_cast<std::uint8_t>(newDWord >> 8),
+			static_cast<std::uint8_t>(newDWord >> 16),
+			static_cast<std::uint8_t>(newDWord >> 24));
+	}
+
+	DynamicAsmPatchBuilder& qword(std::uint64_t newQWord) {
+		return dword(static_cast<std::uint32_t>(newQWord)).dword(static_cast<std::uint32_t>(newQWord >> 32));
+	}
+
+	// Absolute address of the byte at offset in the patch, relocated by AsmPatchTemplate::instantiate().
+	// Like raw bytes the value is not adjusted by relax(), offset refers to the final layout.
+	DynamicAsmPatchBuilder& dwordPatchAddress(std::uintptr_t offset) {
+		mRelocations.push_back({ static_cast<std::uint32_t>(size()), AsmRelocation::ABS32 });
+		return dword(static_cast<std::uint32_t>(mAddr + offset));
+	}
+
+	DynamicAsmPatchBuilder& qwordPatchAddress(std::uintptr_t offset) {
+		mRelocations.push_back({ static_cast<std::uint32_t>(size()), AsmRelocation::ABS64 });
+		return qword(static_cast<std::uint64_t>(mAddr + offset));
+	}
+
+	/*****************************
+	* Insertion of instructions *
+	*****************************/
+public:
+	DynamicAsmPatchBuilder& nop() {
+		return byte(0x90);
+	}
+	DynamicAsmPatchBuilder& ret() {
+		return byte(0xC3);
+	}
+	DynamicAsmPatchBuilder& retNear() {
+		return bytes(0xC2, 0x04, 0x00);
+	}
+	DynamicAsmPatchBuilder& pushR32(AsmConsts::R32 arg) {
+		return byte(0x50 | arg);
+	}
+	DynamicAsmPatchBuilder& popR32(AsmConsts::R32 arg) {
+		return byte(0x58 | arg);
+	}
+	// x86-64 only, r8-r15 need a REX.B prefix
+	DynamicAsmPatchBuilder& pushR64(AsmConsts::R64 arg) {
+		return rexB(arg).byte(0x50 | (arg & 7));
+	}
+	DynamicAsmPatchBuilder& popR64(AsmConsts::R64 arg) {
+		return rexB(arg).byte(0x58 | (arg & 7));
+	}
+	// mov r64, imm64
+	DynamicAsmPatchBuilder& movR64Imm64(AsmConsts::R64 arg, std::uint64_t value) {
+		requireX64();
+		return byte(0x48 | (arg >> 3)).byte(0xB8 | (arg & 7)).qword(value);
+	}
+	DynamicAsmPatchBuilder& pushf() {
+		return byte(0x9C);
+	}
+	DynamicAsmPatchBuilder& popf() {
+		return byte(0x9D);
+	}
+
+	// Convenience shorthand
+	DynamicAsmPatchBuilder& pushEAX() { return pushR32(AsmConsts::R32_EAX); }
+	DynamicAsmPatchBuilder& pushECX() { return pushR32(AsmConsts::R32_ECX); }
+	DynamicAsmPatchBuilder& pushEDX() { return pushR32(AsmConsts::R32_EDX); }
+	DynamicAsmPatchBuilder& pushEBX() { return pushR32(AsmConsts::R32_EBX); }
+	DynamicAsmPatchBuilder& pushESP() { return pushR32(AsmConsts::R32_ESP); }
+	DynamicAsmPatchBuilder& pushEBP() { return pushR32(AsmConsts::R32_EBP); }
+	DynamicAsmPatchBuilder& pushESI() { return pushR32(AsmConsts::R32_ESI); }
+	DynamicAsmPatchBuilder& pushEDI() { return pushR32(AsmConsts::R32_EDI); }
+	DynamicAsmPatchBuilder& popEAX() { return popR32(AsmConsts::R32_EAX); }
+	DynamicAsmPatchBuilder& popECX() { return popR32(AsmConsts::R32_ECX); }
+	DynamicAsmPatchBuilder& popEDX() { return popR32(AsmConsts::R32_EDX); }
+	DynamicAsmPatchBuilder& popEBX() { return popR32(AsmConsts::R32_EBX); }
+	DynamicAsmPatchBuilder& popESP() { return popR32(AsmConsts::R32_ESP); }
+	DynamicAsmPatchBuilder& popEBP() { return popR32(AsmConsts::R32_EBP); }
+	DynamicAsmPatchBuilder& popESI() { return popR32(AsmConsts::R32_ESI); }
+	DynamicAsmPatchBuilder& popEDI() { return popR32(AsmConsts::R32_EDI); }
+
+	DynamicAsmPatchBuilder& movRestoreStackptr() {
+		return bytes(0x8B, 0xE5);
+	}
+
+	DynamicAsmPatchBuilder& retStdcallFull() {
+		return (
+			popEDI().
+			popESI().
+			popEBX().
+			movRestoreStackptr().
+			popEBP().
+			retNear()
+			);
+	}
+
+	template<typename LambdaFunc>
+	DynamicAsmPatchBuilder& callLambdaStdcall(LambdaFunc func) {
+		return call(reinterpret_cast<std::uintptr_t>(AsmBuilder::LambdaPayloadInjector::CreateFuncPtrFromLambda(func)));
+	}
+
+	template<typename LambdaFunc>
+	DynamicAsmPatchBuilder& callLambdaCdecl(LambdaFunc func) {
+		return call(reinterpret_cast<std::uintptr_t>(AsmBuilder::LambdaPayloadInjector::CreateFuncPtrFromLambda<AsmBuilder::LambdaPayloadInjector::CallingConvention::CDeclCall>(func)));
+	}
+
+	template<typename LambdaFunc>
+	DynamicAsmPatchBuilder& callLambdaThiscall(LambdaFunc func) {
+		return call(reinterpret_cast<std::uintptr_t>(AsmBuilder::LambdaPayloadInjector::CreateFuncPtrFromLambda<AsmBuilder::LambdaPayloadInjector::CallingConvention::ThisCall>(func)));
+	}
+
+	template<typename LambdaFunc>
+	DynamicAsmPatchBuilder& callLambdaFastcall(LambdaFunc func) {
+		return call(reinterpret_cast<std::uintptr_t>(AsmBuilder::LambdaPayloadInjector::CreateFuncPtrFromLambda<AsmBuilder::LambdaPayloadInjector::CallingConvention::FastCall>(func)));
+	}
+
+	template<AsmBuilder::LambdaPayloadInjector::CallingConvention CallConv, typename LambdaFunc>
+	DynamicAsmPatchBuilder& callLambdaByCallConv(LambdaFunc func) {
+		return call(reinterpret_cast<std::uintptr_t>(AsmBuilder::LambdaPayloadInjector::CreateFuncPtrFromLambda<CallConv>(func)));
+	}
+
+	// Saves what is live at the site around the call, see safeCall<Live>(). The lambda must not take
+	// arguments from the stack as the saves are pushed on top of them.
+	template<std::uint32_t Live, typename LambdaFunc>
+	DynamicAsmPatchBuilder& callLambdaStdcall(LambdaFunc func) {
+		return callLambdaByCallConv<AsmBuilder::LambdaPayloadInjector::CallingConvention::StdCall, Live>(func);
+	}
+
+	template<std::uint32_t Live, typename LambdaFunc>
+	DynamicAsmPatchBuilder& callLambdaCdecl(LambdaFunc func) {
+		return callLambdaByCallConv<AsmBuilder::LambdaPayloadInjector::CallingConvention::CDeclCall, Live>(func);
+	}
+
+	template<std::uint32_t Live, typename LambdaFunc>
+	DynamicAsmPatchBuilder& callLambdaThiscall(LambdaFunc func) {
+		return callLambdaByCallConv<AsmBuilder::LambdaPayloadInjector::CallingConvention::ThisCall, Live>(func);
+	}
+
+	template<std::uint32_t Live, typename LambdaFunc>
+	DynamicAsmPatchBuilder& callLambdaFastcall(LambdaFunc func) {
+		return callLambdaByCallConv<AsmBuilder::LambdaPayloadInjector::CallingConvention::FastCall, Live>(func);
+	}
+
+	template<AsmBuilder::LambdaPayloadInjector::CallingConvention CallConv, std::uint32_t Live, typename LambdaFunc>
+	DynamicAsmPatchBuilder& callLambdaByCallConv(LambdaFunc func) {
+		static_assert(!AsmBuilder::RegisterSaves::savesAnything(AsmBuilder::RegisterSaves::plan(Live, AsmConsts::MODE_HOST == AsmConsts::MODE_X64)) ||
+			!AsmBuilder::LambdaPayloadInjector::TakesStackArgs<CallConv, LambdaFunc>,
+			"Register saves would move the stack arguments of the lambda");
+		return safeCall<Live>(reinterpret_cast<std::uintptr_t>(AsmBuilder::LambdaPayloadInjector::CreateFuncPtrFromLambda<CallConv>(func)));
+	}
+
+	// See AsmPatchBuilder::callLambdaWithContext(), only in the host mode
+	template<std::uint32_t Live = AsmConsts::LIVE_NONE, typename LambdaFunc>
+	DynamicAsmPatchBuilder& callLambdaWithContext(LambdaFunc func) {
+		using Traits = AsmContextTraits<LambdaFunc>;
+		if (mMode != AsmConsts::MODE_HOST) {
+			throw AsmPatchInvalidForMode();
+		}
+		const std::uintptr_t thunk = reinterpret_cast<std::uintptr_t>(
+			AsmBuilder::LambdaPayloadInjector::CreateFuncPtrFromLambda<AsmBuilder::LambdaPayloadInjector::CallingConvention::FastCall>(func));
+		const bool x64 = mMode == AsmConsts::MODE_X64;
+		AsmBuilder::RegisterSaves::emitContextPrologue(*this, Traits::Spilled, Live, x64);
+		call(thunk);
+		AsmBuilder::RegisterSaves::emitContextEpilogue(*this, Traits::Spilled, Traits::Written, Live, x64);
+		return *this;
+	}
+
+	// Records call counts and latencies under name if ASMPATCH_ENABLE_HOOK_STATS is enabled, see AsmHookStats.h.
+	// The generated thunk is also listed under name in the perf map, see AsmPerfMap.h.
+	template<AsmBuilder::LambdaPayloadInjector::CallingConvention CallConv = AsmBuilder::LambdaPayloadInjector::CallingConvention::StdCall, typename LambdaFunc>
+	DynamicAsmPatchBuilder& callLambdaInstrumented(const char* name, LambdaFunc func) {
+		AsmBuilder::PerfMap::NameScope scope(name);
+#if ASMPATCH_ENABLE_HOOK_STATS
+		return callLambdaByCallConv<CallConv>(AsmBuilder::HookStats::Instrument(std::move(func), name));
+#else
+		(void)name;
+		return callLambdaByCallConv<CallConv>(std::move(func));
+#endif
+	}
+
+	// In x86-64 mode targets out of rel32 range fall back to call [rip+2] / jmp +8 / dq func (16 bytes)
+	DynamicAsmPatchBuilder& call(void* func) { return call(reinterpret_cast<std::uintptr_t>(func)); }
+	DynamicAsmPatchBuilder& call(std::uintptr_t func) {
+		if (mMode == AsmConsts::MODE_X64 && !AsmEncoding::fitsRel32(func, cursor() + 5)) {
+			return callAbs64(func);
+		}
+		recordFixed(0xE8, func);
+		return byte(0xE8).dword(static_cast<std::uint32_t>(func - cursor() - 4));
+	}
+
+	// In x86-64 mode targets out of rel32 range fall back to jmp [rip+0] / dq addr (14 bytes)
+	DynamicAsmPatchBuilder& jmp(void* addr) { return jmp(reinterpret_cast<std::uintptr_t>(addr)); }
+	DynamicAsmPatchBuilder& jmp(std::uintptr_t addr) {
+		if (mMode == AsmConsts::MODE_X64 && !AsmEncoding::fitsRel32(addr, cursor() + 5)) {
+			return jmpAbs64(addr);
+		}
+		recordFixed(0xE9, addr);
+		return byte(0xE9).dword(static_cast<std::uint32_t>(addr - cursor() - 4));
+	}
+
+	DynamicAsmPatchBuilder& callAbs64(std::uint64_t func) {
+		requireX64();
+		return bytes(0xFF, 0x15, 0x02, 0x00, 0x00, 0x00, 0xEB, 0x08).qword(func);
+	}
+
+	DynamicAsmPatchBuilder& jmpAbs64(std::uint64_t addr) {
+		requireX64();
+		return bytes(0xFF, 0x25, 0x00, 0x00, 0x00, 0x00).qword(addr);
+	}
+
+	// Saves the flags and the caller saved registers around the call. In x86-64 mode this is
+	// safeCall<LIVE_GPRS | LIVE_FLAGS>: the red zone is skipped outside of Windows and the stack is
+	// aligned to 16 bytes (plus shadow space on Windows) via rbx.
+	DynamicAsmPatchBuilder& safeCall(void* func) { return safeCall(reinterpret_cast<std::uintptr_t>(func)); }
+	DynamicAsmPatchBuilder& safeCall(std::uintptr_t func) {
+		if (mMode == AsmConsts::MODE_X64) {
+			return safeCall<AsmConsts::LIVE_GPRS | AsmConsts::LIVE_FLAGS>(func);
+		}
+		return (
+			pushf().
+			pushEAX().
+			pushECX().
+			pushEDX().
+			call(func).
+			popEDX().
+			popECX().
+			popEAX().
+			popf()
+			);
+	}
+
+	// Saves only what is live at the site (a mask of AsmConsts::Live) and clobbered by a call,
+	// see AsmPatchBuilder::safeCall<Live>()
+	template<std::uint32_t Live>
+	DynamicAsmPatchBuilder& saveLive() {
+		AsmBuilder::RegisterSaves::emitPrologue(*this, AsmBuilder::RegisterSaves::plan(Live, mMode == AsmConsts::MODE_X64));
+		return *this;
+	}
+
+	template<std::uint32_t Live>
+	DynamicAsmPatchBuilder& restoreLive() {
+		AsmBuilder::RegisterSaves::emitEpilogue(*this, AsmBuilder::RegisterSaves::plan(Live, mMode == AsmConsts::MODE_X64));
+		return *this;
+	}
+
+	template<std::uint32_t Live>
+	DynamicAsmPatchBuilder& safeCall(void* func) { return safeCall<Live>(reinterpret_cast<std::uintptr_t>(func)); }
+	template<std::uint32_t Live>
+	DynamicAsmPatchBuilder& safeCall(std::uintptr_t func) {
+		return saveLive<Live>().call(func).template restoreLive<Live>();
+	}
+
+	DynamicAsmPatchBuilder& safeCallInstrumented(const char* name, void* func) { return safeCallInstrumented(name, reinterpret_cast<std::uintptr_t>(func)); }
+	DynamicAsmPatchBuilder& safeCallInstrumented(const char* name, std::uintptr_t func) {
+		AsmBuilder::PerfMap::NameScope scope(name);
+#if ASMPATCH_ENABLE_HOOK_STATS
+		auto target = reinterpret_cast<void(__cdecl*)()>(func);
+		auto instrumented = AsmBuilder::HookStats::Instrument([target]() { target(); }, name);
+		return safeCall(reinterpret_cast<std::uintptr_t>(AsmBuilder::LambdaPayloadInjector::CreateFuncPtrFromLambda<AsmBuilder::LambdaPayloadInjector::CallingConvention::CDeclCall>(instrumented)));
+#else
+		(void)name;
+		return safeCall(func);
+#endif
+	}
+
+	/**************************************************
+	* Generic instructions, see details/X86Encoder.h *
+	**************************************************/
+	// Each takes a register or AsmMem destination and a register, AsmMem or integer source
+	// and is encoded in its shortest form (imm8, accumulator and zero extending mov forms)
+	template<typename Source>
+	DynamicAsmPatchBuilder& mov(AsmOperand dst, Source src) {
+		return encode(AsmBuilder::X86Encoder::OP_MOV, dst, src);
+	}
+
+	template<typename Source>
+	DynamicAsmPatchBuilder& add(AsmOperand dst, Source src) {
+		return encode(AsmBuilder::X86Encoder::OP_ADD, dst, src);
+	}
+
+	template<typename Source>
+	DynamicAsmPatchBuilder& sub(AsmOperand dst, Source src) {
+		return encode(AsmBuilder::X86Encoder::OP_SUB, dst, src);
+	}
+
+	template<typename Source>
+	DynamicAsmPatchBuilder& cmp(AsmOperand dst, Source src) {
+		return encode(AsmBuilder::X86Encoder::OP_CMP, dst, src);
+	}
+
+	template<typename Source>
+	DynamicAsmPatchBuilder& test(AsmOperand dst, Source src) {
+		return encode(AsmBuilder::X86Encoder::OP_TEST, dst, src);
+	}
+
+	// and/or/xor/adc/sbb and the above
+	template<typename Source>
+	DynamicAsmPatchBuilder& alu(AsmConsts::AluOp op, AsmOperand dst, Source src) {
+		return encode(static_cast<AsmBuilder::X86Encoder::Op>(op), dst, src);
+	}
+
+	DynamicAsmPatchBuilder& lea(AsmOperand dst, const AsmMem& src) {
+		return encode(AsmBuilder::X86Encoder::OP_LEA, dst, src);
+	}
+
+	// The padded patch is padSize bytes long after relaxation as well, the nops absorb what the
+	// label branches before them save
+	DynamicAsmPatchBuilder& nopPadToSize(std::uintptr_t padSize) {
+		if (padSize < size()) {
+			throw AsmPatchPadTooSmall();
+		}
+		mBytes->resize(mBegin + padSize, 0x90);
+		if (!mBranches.empty()) {
+			mPads.push_back(padSize);
+		}
+		return *this;
+	}
+
+	// Exactly nopCount nops, they move with relaxation like any other bytes
+	DynamicAsmPatchBuilder& nops(std::uintptr_t nopCount) {
+		mBytes->resize(mBytes->size() + nopCount, 0x90);
+		return *this;
+	}
+
+	DynamicAsmPatchBuilder& condjmpToNopjmp() {
+		const uint8_t* ptr = (const uint8_t*)cursor();
+		if ((ptr[0] != 0x0F) || ((ptr[1] & 0xF0) != 0x80)) {
+			throw AsmPatchNoCondtionalJump();
+		}
+		return nop().byte(0xE9);
+	}
+
+private:
+	void requireX64() const {
+		if (mMode != AsmConsts::MODE_X64) {
+			throw AsmPatchInvalidForMode();
+		}
+	}
+
+	DynamicAsmPatchBuilder& rexB(AsmConsts::R64 arg) {
+		requireX64();
+		return arg >= 8 ? byte(0x41) : *this;
+	}
+
+	template<typename Source>
+	DynamicAsmPatchBuilder& encode(AsmBuilder::X86Encoder::Op op, const AsmOperand& dst, const Source& src) {
+		namespace X86Encoder = AsmBuilder::X86Encoder;
+
+		X86Encoder::Operand source;
+		if constexpr (std::is_integral_v<Source>) {
+			source.mKind = X86Encoder::Operand::KIND_IMM;
+			source.mValue = static_cast<std::int64_t>(src);
+		}
+		else {
+			source = AsmOperand(src).mOperand;
+		}
+
+		X86Encoder::Instruction instruction;
+		switch (X86Encoder::encode(op, dst.mOperand, source, mMode == AsmConsts::MODE_X64, cursor(), instruction)) {
+		case X86Encoder::ENCODE_OK: break;
+		case X86Encoder::ENCODE_INVALID_FOR_MODE: throw AsmPatchInvalidForMode();
+		case X86Encoder::ENCODE_OUT_OF_RANGE: throw AsmPatchRel32OutOfRange();
+		default: throw AsmPatchInvalidOperands();
+		}
+		if (instruction.mRipDispOffset && !mBranches.empty()) {
+			mRipOperands.push_back({ size(), instruction.mRipDispOffset, instruction.mLength, static_cast<std::uintptr_t>(instruction.mRipTarget) });
+		}
+		else if (instruction.mRipDispOffset) {
+			mRelocations.push_back({ static_cast<std::uint32_t>(size() + instruction.mRipDispOffset), AsmRelocation::REL32 });
+		}
+		return bytes(instruction.mBytes.data(), instruction.mLength);
+	}
+
+	DynamicAsmPatchBuilder& labelBranch(std::uint8_t opcode, AsmLabel label, bool relaxable) {
+		(void)mLabels.at(label.mId);
+		mBranches.push_back({ size(), label.mId, opcode, true, relaxable });
+		if (isJcc(opcode)) {
+			byte(0x0F);
+		}
+		return byte(opcode).dword(0);
+	}
+
+	// Code before the first label branch never moves, so only later branches need re-encoding
+	void recordFixed(std::uint8_t opcode, std::uintptr_t target) {
+		if (!mBranches.empty()) {
+			mBranches.push_back({ size(), target, opcode, false, false });
+		}
+		else {
+			mRelocations.push_back({ static_cast<std::uint32_t>(size() + 1), AsmRelocation::REL32 });
+		}
+	}
+
+	static bool isJcc(std::uint8_t opcode) {
+		return (opcode & 0xF0) == 0x80;
+	}
+
+	static std::uintptr_t longSize(const Branch& branch) {
+		return isJcc(branch.mOpcode) ? 6 : 5;
+	}
+
+	bool isExternal(const Branch& branch) const {
+		return branch.mToLabel && mLabels[branch.mTarget].mExternal;
+	}
+
+	// relocations receives all fields depending on the patch address. A short branch to an external label
+	// is one of them, but cannot be relocated: keepExternalLong leaves these in rel32 form, otherwise
+	// shortenedExternal is set when one was shortened.
+	std::vector<std::uint8_t> relaxedBytes(std::vector<std::uintptr_t>* labelOffsets, std::vector<AsmRelocation>* relocations,
+		bool keepExternalLong, bool* shortenedExternal = nullptr) const {
+		const std::size_t count = mBranches.size();
+		std::vector<bool> isShort(count);
+		for (std::size_t i = 0; i < count; i++) {
+			isShort[i] = mBranches[i].mRelaxable && !(keepExternalLong && isExternal(mBranches[i]));
+		}
+		// shrink[i]: bytes saved by the branches before branch i
+		std::vector<std::uintptr_t> shrink(count + 1);
+
+		auto branchesBefore = [&](std::uintptr_t offset) {
+			std::size_t before = 0;
+			while (before < count && mBranches[before].mOffset < offset) {
+				before++;
+			}
+			return before;
+		};
+		// Paddings do not move, only the branches after the last one before offset count
+		auto newOffset = [&](std::uintptr_t offset) {
+			std::uintptr_t pad = 0;
+			for (std::size_t i = 0; i < mPads.size() && mPads[i] <= offset; i++) {
+				pad = mPads[i];
+			}
+			return offset - (shrink[branchesBefore(offset)] - shrink[branchesBefore(pad)]);
+		};
+		auto target = [&](const Branch& branch) {
+			if (!branch.mToLabel) {
+				return branch.mTarget;
+			}
+			const Label& label = mLabels[branch.mTarget];
+			if (!label.mBound) {
+				throw AsmPatchUnboundLabel();
+			}
+			return label.mExternal ? label.mValue : mAddr + newOffset(label.mValue);
+		};
+
+		for (bool changed = true; changed;) {
+			changed = false;
+			for (std::size_t i = 0; i < count; i++) {
+				shrink[i + 1] = shrink[i] + (isShort[i] ? longSize(mBranches[i]) - 2 : 0);
+			}
+			for (std::size_t i = 0; i < count; i++) {
+				if (!isShort[i]) {
+					continue;
+				}
+				const std::uintptr_t rel = target(mBranches[i]) - (mAddr + newOffset(mBranches[i].mOffset) + 2);
+				if (rel + 0x80 > 0xFF) {
+					isShort[i] = false;
+					changed = true;
+				}
+			}
+		}
+
+		std::vector<std::uint8_t> relaxed;
+		relaxed.reserve(size());
+		const std::uint8_t* original = data();
+		std::uintptr_t copied = 0;
+		std::size_t nextPad = 0;
+		auto copyUntil = [&](std::uintptr_t offset) {
+			for (; nextPad < mPads.size() && mPads[nextPad] <= offset; nextPad++) {
+				relaxed.insert(relaxed.end(), original + copied, original + mPads[nextPad]);
+				relaxed.resize(mPads[nextPad], 0x90);
+				copied = mPads[nextPad];
+			}
+			relaxed.insert(relaxed.end(), original + copied, original + offset);
+		};
+		for (std::size_t i = 0; i < count; i++) {
+			const Branch& branch = mBranches[i];
+			copyUntil(branch.mOffset);
+			copied = branch.mOffset + longSize(branch);
+
+			const std::uintptr_t destination = target(branch);
+			if (isShort[i]) {
+				if (shortenedExternal && isExternal(branch)) {
+					*shortenedExternal = true;
+				}
+				relaxed.push_back(branch.mOpcode == 0xE9 ? 0xEB : static_cast<std::uint8_t>(0x70 | (branch.mOpcode & 0x0F)));
+				relaxed.push_back(static_cast<std::uint8_t>(destination - (mAddr + relaxed.size() + 1)));
+				continue;
+			}
+			if (isJcc(branch.mOpcode)) {
+				relaxed.push_back(0x0F);
+			}
+			relaxed.push_back(branch.mOpcode);
+			if (relocations && (!branch.mToLabel || isExternal(branch))) {
+				relocations->push_back({ static_cast<std::uint32_t>(relaxed.size()), AsmRelocation::REL32 });
+			}
+			const std::uint32_t rel = AsmEncoding::rel32(destination, mAddr + relaxed.size() + 4);
+			for (int shift = 0; shift < 32; shift += 8) {
+				relaxed.push_back(static_cast<std::uint8_t>(rel >> shift));
+			}
+		}
+		copyUntil(size());
+
+		for (const RipOperand& operand : mRipOperands) {
+			const std::uintptr_t offset = newOffset(operand.mOffset);
+			const std::uint32_t disp = AsmEncoding::rel32(operand.mTarget, mAddr + offset + operand.mLength);
+			std::memcpy(relaxed.data() + offset + operand.mDispOffset, &disp, sizeof(disp));
+			if (relocations) {
+				relocations->push_back({ static_cast<std::uint32_t>(offset + operand.mDispOffset), AsmRelocation::REL32 });
+			}
+		}
+
+		if (relocations) {
+			for (const AsmRelocation& relocation : mRelocations) {
+				relocations->push_back({ static_cast<std::uint32_t>(newOffset(relocation.mOffset)), relocation.mKind });
+			}
+			std::sort(relocations->begin(), relocations->end(), [](const AsmRelocation& lhs, const AsmRelocation& rhs) {
+				return lhs.mOffset < rhs.mOffset;
+			});
+		}
+
+		if (labelOffsets) {
+			labelOffsets->resize(mLabels.size());
+			for (std::size_t i = 0; i < mLabels.size(); i++) {
+				const Label& label = mLabels[i];
+				(*labelOffsets)[i] = label.mBound && !label.mExternal ? newOffset(label.mValue) : label.mValue;
+			}
+		}
+		return relaxed;
+	}
+};
+
+}
@@ -0,0 +1,129 @@
+#include <benchmark/benchmark.h>
+#include <cstdint>
+#include <vector>
+#include "AsmPatchBuilder.h"
+#include "DynamicAsmPatchBuilder.h"
+
+using namespace AsmPatch;
+
+namespace {
+	// Appends Links times call + jmp + nop, every link is a new AsmPatchBuilder<Size> type
+	template<std::size_t Links, std::uintptr_t Size>
+	auto chain(const AsmPatchBuilder<Size>& builder)
+	{
+		if constexpr (Links == 0) {
+			return builder;
+		}
+		else {
+			return chain<Links - 1>(builder.call(0x00402000).jmp(0x00403000).nop());
+		}
+	}
+
+	template<std::size_t Links>
+	void BM_BuilderChain(benchmark::State& state)
+	{
+		std::uintptr_t addr = 0x00401000;
+		for (auto _ : state) {
+			benchmark::DoNotOptimize(addr);
+			AsmPatchData patch = chain<Links>(Patch(addr)).compile();
+			benchmark::DoNotOptimize(patch);
+		}
+		state.SetBytesProcessed(state.iterations() * Links * 11);
+	}
+
+	template<std::size_t Links>
+	void BM_BuilderChainCompileInto(benchmark::State& state)
+	{
+		std::uintptr_t addr = 0x00401000;
+		std::uint8_t buffer[Links * 11];
+		for (auto _ : state) {
+			benchmark::DoNotOptimize(addr);
+			chain<Links>(Patch(addr)).compileInto(buffer, sizeof(buffer));
+			benchmark::DoNotOptimize(buffer);
+		}
+		state.SetBytesProcessed(state.iterations() * Links * 11);
+	}
+
+	void BM_DynamicBuilderChain(benchmark::State& state)
+	{
+		const std::int64_t links = state.range(0);
+		std::vector<std::uint8_t> arena;
+		arena.reserve(links * 11);
+		for (auto _ : state) {
+			arena.clear();
+			DynamicAsmPatchBuilder builder(0x00401000, arena, AsmConsts::MODE_X86);
+			for (std::int64_t i = 0; i < links; i++) {
+				builder.call(0x00402000).jmp(0x00403000).nop();
+			}
+			benchmark::DoNotOptimize(arena.data());
+		}
+		state.SetBytesProcessed(state.iterations() * links * 11);
+	}
+
+	// compile() of many small patches, one per call site, as done when a patch set is built
+	void BM_BatchCompile(benchmark::State& state)
+	{
+		const std::int64_t count = state.range(0);
+		std::vector<AsmPatchData> patches;
+		patches.reserve(count);
+		for (auto _ : state) {
+			patches.clear();
+			for (std::int64_t i = 0; i < count; i++) {
+				const std::uintptr_t addr = 0x00401000 + static_cast<std::uintptr_t>(i) * 0x10;
+				patches.push_back(Patch(addr).call(0x00800000).nops<3>().compile());
+			}
+			benchmark::DoNotOptimize(patches.data());
+		}
+		state.SetItemsProcessed(state.iterations() * count);
+	}
+
+	void BM_BatchCompileArena(benchmark::State& state)
+	{
+		const std::int64_t count = state.range(0);
+		std::vector<std::uint8_t> arena;
+		arena.reserve(count * 8);
+		std::vector<AsmPatchData> patches;
+		patches.reserve(count);
+		for (auto _ : state) {
+			arena.clear();
+			patches.clear();
+			for (std::int64_t i = 0; i < count; i++) {
+				DynamicAsmPatchBuilder builder(0x00401000 + static_cast<std::uintptr_t>(i) * 0x10, arena, AsmConsts::MODE_X86);
+				builder.call(0x00800000).nopPadToSize(8);
+				patches.push_back(builder.compile());
+			}
+			benchmark::DoNotOptimize(patches.data());
+		}
+		state.SetItemsProcessed(state.iterations() * count);
+	}
+
+	// The same hook at many call sites, instantiated from one template into a shared buffer
+	void BM_BatchInstantiate(benchmark::State& state)
+	{
+		const std::int64_t count = state.range(0);
+		DynamicAsmPatchBuilder builder(0x00401000, AsmConsts::MODE_X86);
+		const AsmPatchTemplate patchTemplate = builder.call(0x00800000).nopPadToSize(8).compileTemplate();
+		std::vector<std::uint8_t> buffer(count * patchTemplate.size());
+		for (auto _ : state) {
+			std::uint8_t* out = buffer.data();
+			for (std::int64_t i = 0; i < count; i++) {
+				out += patchTemplate.instantiateInto(0x00401000 + static_cast<std::uintptr_t>(i) * 0x10, out, patchTemplate.size());
+			}
+			benchmark::DoNotOptimize(buffer.data());
+		}
+		state.SetItemsProcessed(state.iterations() * count);
+	}
+}
+
+BENCHMARK_TEMPLATE(BM_BuilderChain, 1);
+BENCHMARK_TEMPLATE(BM_BuilderChain, 4);
+BENCHMARK_TEMPLATE(BM_BuilderChain, 16);
+BENCHMARK_TEMPLATE(BM_BuilderChain, 64);
+BENCHMARK_TEMPLATE(BM_BuilderChainCompileInto, 1);
+BENCHMARK_TEMPLATE(BM_BuilderChainCompileInto, 4);
+BENCHMARK_TEMPLATE(BM_BuilderChainCompileInto, 16);
+BENCHMARK_TEMPLATE(BM_BuilderChainCompileInto, 64);
+BENCHMARK(BM_DynamicBuilderChain)->RangeMultiplier(4)->Range(1, 64);
+BENCHMARK(BM_BatchCompile)->RangeMultiplier(8)->Range(64, 4096);
+BENCHMARK(BM_BatchCompileArena)->RangeMultiplier(8)->Range(64, 4096);
+BENCHMARK(BM_BatchInstantiate)->RangeMultiplier(8)->Range(64, 4096);
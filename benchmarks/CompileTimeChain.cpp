@@ -0,0 +1,27 @@
+// Compiled by MeasureCompileTime.cmake with CHAIN_LINKS set to the chain length to time
+#include "AsmPatchBuilder.h"
+
+#ifndef CHAIN_LINKS
+#define CHAIN_LINKS 1
+#endif
+
+namespace {
+	template<std::size_t Links, std::uintptr_t Size>
+	constexpr auto chain(const AsmPatch::AsmPatchBuilder<Size>& builder)
+	{
+		if constexpr (Links == 0) {
+			return builder;
+		}
+		else {
+			return chain<Links - 1>(builder.call(0x00402000).jmp(0x00403000).nop());
+		}
+	}
+}
+
+static constexpr auto patch = chain<CHAIN_LINKS>(AsmPatch::Patch(0x00401000)).compileStatic();
+static_assert(patch.size() == CHAIN_LINKS * 11, "call + jmp + nop per link");
+
+const std::uint8_t* chainBytes()
+{
+	return patch.getData().data();
+}
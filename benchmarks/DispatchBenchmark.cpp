@@ -0,0 +1,211 @@
+#include <benchmark/benchmark.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include "AsmPatchBuilder.h"
+#include "DynamicAsmPatchBuilder.h"
+#include "details/ExecutableMemory.h"
+#include "details/LambdaPayloadInjector.h"
+
+using namespace AsmPatch;
+using AsmBuilder::LambdaPayloadInjector::CallingConvention;
+
+namespace {
+	// Baseline for the dispatchers: callLambda* used to store every lambda in a fixed_size_function,
+	// which the closure thunk's dispatcher called through its vtable after a null check
+	template<typename Signature, std::size_t Capacity>
+	class FixedSizeFunction;
+
+	template<typename Ret, typename... Args, std::size_t Capacity>
+	class FixedSizeFunction<Ret(Args...), Capacity>
+	{
+		struct VTable
+		{
+			Ret (*mCall)(void* storage, Args... args);
+		};
+
+		mutable std::aligned_storage_t<Capacity> mStorage;
+		const VTable* mVTable = nullptr;
+
+	public:
+		template<typename Func>
+		explicit FixedSizeFunction(Func func)
+		{
+			static_assert(sizeof(Func) <= Capacity, "Function does not fit into the storage");
+			static const VTable table = { [](void* storage, Args... args) -> Ret {
+				return (*std::launder(static_cast<Func*>(storage)))(args...);
+			} };
+			new (&mStorage) Func(std::move(func));
+			mVTable = &table;
+		}
+
+		Ret operator()(Args... args) const
+		{
+			if (!mVTable) {
+				throw std::bad_function_call();
+			}
+			return mVTable->mCall(&mStorage, args...);
+		}
+	};
+
+	// The previous dispatch path: closure thunk, Dispatch, the type erased call and finally the lambda
+	template<CallingConvention Convention, typename LambdaFunc>
+	auto createErasedFuncPtr(LambdaFunc func)
+	{
+		using Erased = FixedSizeFunction<void(int, int), sizeof(LambdaFunc) + sizeof(void*) * 3>;
+		return AsmBuilder::LambdaPayloadInjector::CreateFuncPtrFromLambda<Convention>([erased = Erased(std::move(func))](int a, int b) {
+			erased(a, b);
+		});
+	}
+
+	int statelessSink = 0;
+	int capturedSum = 0;
+
+	// Created once per convention, the benchmark functions run several times while calibrating
+	template<CallingConvention Convention>
+	auto statelessFunc()
+	{
+		static const auto func = AsmBuilder::LambdaPayloadInjector::CreateFuncPtrFromLambda<Convention>([](int a, int b) { statelessSink += a + b; });
+		return func;
+	}
+
+	template<CallingConvention Convention>
+	auto capturingFunc()
+	{
+		static const auto func = AsmBuilder::LambdaPayloadInjector::CreateFuncPtrFromLambda<Convention>([sum = &capturedSum](int a, int b) { *sum += a + b; });
+		return func;
+	}
+
+	template<CallingConvention Convention>
+	auto erasedFunc()
+	{
+		static const auto func = createErasedFuncPtr<Convention>([sum = &capturedSum](int a, int b) { *sum += a + b; });
+		return func;
+	}
+
+	// Cost of one call through the function pointer callLambda* places into the patch, i.e. the
+	// CallConventionDispatchHelper<...>::DispatchStateless or the closure thunk plus Dispatch.
+	template<CallingConvention Convention>
+	void BM_DispatchStateless(benchmark::State& state)
+	{
+		auto func = statelessFunc<Convention>();
+		int a = 1;
+		for (auto _ : state) {
+			benchmark::DoNotOptimize(func);
+			func(a, 2);
+		}
+		benchmark::DoNotOptimize(statelessSink);
+	}
+
+	template<CallingConvention Convention>
+	void BM_DispatchCapturing(benchmark::State& state)
+	{
+		auto func = capturingFunc<Convention>();
+		int a = 1;
+		for (auto _ : state) {
+			benchmark::DoNotOptimize(func);
+			func(a, 2);
+		}
+		benchmark::DoNotOptimize(capturedSum);
+	}
+
+	// The same lambda as BM_DispatchCapturing behind the fixed_size_function baseline
+	template<CallingConvention Convention>
+	void BM_DispatchErasedBaseline(benchmark::State& state)
+	{
+		auto func = erasedFunc<Convention>();
+		int a = 1;
+		for (auto _ : state) {
+			benchmark::DoNotOptimize(func);
+			func(a, 2);
+		}
+		benchmark::DoNotOptimize(capturedSum);
+	}
+
+	int hookedSum = 0;
+
+	// Builds the patch with build at fresh executable memory, kept for the whole run like a real hook
+	template<typename Build>
+	void* installHook(AsmConsts::Mode mode, Build build)
+	{
+		void* memory = AsmBuilder::ExecutableMemory::allocate(AsmBuilder::ExecutableMemory::pageSize());
+		DynamicAsmPatchBuilder code(reinterpret_cast<std::uintptr_t>(memory), mode);
+		build(code);
+		AsmPatchData patch = code.compile();
+		std::memcpy(memory, patch.getData().data(), patch.getData().size());
+		AsmBuilder::ExecutableMemory::flushInstructionCache(memory, patch.getData().size());
+		return memory;
+	}
+
+#if defined(__x86_64__)
+	// Full hooked call: patch code saving the live state, the thunk and the dispatcher
+	template<std::uint32_t Live>
+	void BM_HookedCallX64(benchmark::State& state)
+	{
+		static void* const memory = installHook(AsmConsts::MODE_X64, [](DynamicAsmPatchBuilder& code) {
+			code.callLambdaCdecl<Live>([sum = &hookedSum](int a) { *sum += a; }).ret();
+		});
+
+		auto hook = reinterpret_cast<void (*)(int)>(memory);
+		for (auto _ : state) {
+			hook(1);
+		}
+		benchmark::DoNotOptimize(hookedSum);
+	}
+#endif
+
+#if defined(__i386__)
+	// Only built by the experimental ASMPATCH_M32 configuration, which has not been compiled yet.
+	// Full hooked call in x86 mode: the patch plays the hooked call site, passing one argument the way
+	// the convention expects it, then the thunk and the dispatcher run
+	template<CallingConvention Convention>
+	void BM_HookedCallX86(benchmark::State& state)
+	{
+		static void* const memory = installHook(AsmConsts::MODE_X86, [](DynamicAsmPatchBuilder& code) {
+			if constexpr (Convention == CallingConvention::ThisCall || Convention == CallingConvention::FastCall) {
+				code.mov(AsmConsts::R32_ECX, 1);
+			}
+			else {
+				code.bytes(0x6A, 0x01);          // push 1
+			}
+			code.callLambdaByCallConv<Convention>([sum = &hookedSum](int a) { *sum += a; });
+			if constexpr (Convention == CallingConvention::CDeclCall) {
+				code.add(AsmConsts::R32_ESP, 4);
+			}
+			code.ret();
+		});
+
+		auto hook = reinterpret_cast<void (*)()>(memory);
+		for (auto _ : state) {
+			hook();
+		}
+		benchmark::DoNotOptimize(hookedSum);
+	}
+#endif
+}
+
+BENCHMARK_TEMPLATE(BM_DispatchStateless, CallingConvention::StdCall);
+BENCHMARK_TEMPLATE(BM_DispatchStateless, CallingConvention::CDeclCall);
+BENCHMARK_TEMPLATE(BM_DispatchStateless, CallingConvention::ThisCall);
+BENCHMARK_TEMPLATE(BM_DispatchStateless, CallingConvention::FastCall);
+BENCHMARK_TEMPLATE(BM_DispatchCapturing, CallingConvention::StdCall);
+BENCHMARK_TEMPLATE(BM_DispatchCapturing, CallingConvention::CDeclCall);
+BENCHMARK_TEMPLATE(BM_DispatchCapturing, CallingConvention::ThisCall);
+BENCHMARK_TEMPLATE(BM_DispatchCapturing, CallingConvention::FastCall);
+BENCHMARK_TEMPLATE(BM_DispatchErasedBaseline, CallingConvention::StdCall);
+BENCHMARK_TEMPLATE(BM_DispatchErasedBaseline, CallingConvention::CDeclCall);
+BENCHMARK_TEMPLATE(BM_DispatchErasedBaseline, CallingConvention::ThisCall);
+BENCHMARK_TEMPLATE(BM_DispatchErasedBaseline, CallingConvention::FastCall);
+#if defined(__x86_64__)
+BENCHMARK_TEMPLATE(BM_HookedCallX64, AsmConsts::LIVE_NONE);
+BENCHMARK_TEMPLATE(BM_HookedCallX64, AsmConsts::LIVE_GPRS | AsmConsts::LIVE_FLAGS);
+#endif
+#if defined(__i386__)
+BENCHMARK_TEMPLATE(BM_HookedCallX86, CallingConvention::StdCall);
+BENCHMARK_TEMPLATE(BM_HookedCallX86, CallingConvention::CDeclCall);
+BENCHMARK_TEMPLATE(BM_HookedCallX86, CallingConvention::ThisCall);
+BENCHMARK_TEMPLATE(BM_HookedCallX86, CallingConvention::FastCall);
+#endif
@@ -0,0 +1,37 @@
+# Times the compilation of CompileTimeChain.cpp for growing chain lengths and writes the results as JSON.
+# Invoked by the run_compile_time_benchmarks target with COMPILER, SOURCE, INCLUDE_DIR, FLAGS, WORK_DIR and OUTPUT.
+cmake_minimum_required(VERSION 3.23) # %f in string(TIMESTAMP)
+
+# Every link copies the whole array, around 128 links exceed the default constexpr operation limit of GCC
+set(CHAIN_LENGTHS 1 4 16 32 64)
+set(REPETITIONS 3)
+
+separate_arguments(EXTRA_FLAGS UNIX_COMMAND "${FLAGS}")
+set(RESULTS "")
+foreach(LINKS IN LISTS CHAIN_LENGTHS)
+	set(BEST "")
+	foreach(REPETITION RANGE 1 ${REPETITIONS})
+		string(TIMESTAMP START "%s%f")
+		execute_process(
+			COMMAND ${COMPILER} -std=c++17 -O2 ${EXTRA_FLAGS} -I${INCLUDE_DIR} -DCHAIN_LINKS=${LINKS}
+				-c ${SOURCE} -o ${WORK_DIR}/CompileTimeChain_${LINKS}.o
+			RESULT_VARIABLE EXIT_CODE)
+		string(TIMESTAMP END "%s%f")
+		if(NOT EXIT_CODE EQUAL 0)
+			message(FATAL_ERROR "Compiling a chain of ${LINKS} links failed")
+		endif()
+		# Seconds followed by six digits of microseconds
+		math(EXPR ELAPSED_US "${END} - ${START}")
+		if(BEST STREQUAL "" OR ELAPSED_US LESS BEST)
+			set(BEST ${ELAPSED_US})
+		endif()
+	endforeach()
+	math(EXPR BEST_MS "${BEST} / 1000")
+	math(EXPR INSTRUCTIONS "${LINKS} * 3")
+	message(STATUS "${LINKS} links: ${BEST_MS} ms")
+	list(APPEND RESULTS "    { \"name\": \"CompileTimeChain/${LINKS}\", \"links\": ${LINKS}, \"instructions\": ${INSTRUCTIONS}, \"real_time_us\": ${BEST} }")
+endforeach()
+
+list(JOIN RESULTS ",\n" RESULTS)
+string(TIMESTAMP DATE "%Y-%m-%dT%H:%M:%SZ" UTC)
+file(WRITE ${OUTPUT} "{\n  \"context\": { \"date\": \"${DATE}\", \"compiler\": \"${COMPILER}\", \"flags\": \"${FLAGS}\", \"repetitions\": ${REPETITIONS} },\n  \"benchmarks\": [\n${RESULTS}\n  ]\n}\n")
@@ -0,0 +1,398 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+#include "ExecutableMemory.h"
+#include "PerfMap.h"
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "MemoryUtils.h"
+#endif
+
+namespace AsmBuilder::ClosureThunk
+{
+	// A thunk is written through mWrite and executed at mCode, both point to the same memory
+	struct Slot
+	{
+		std::uint8_t* mWrite;
+		std::uint8_t* mCode;
+	};
+
+	// Bump allocator for the thunks of all hooks, which are packed into shared executable pages.
+	// On Linux every chunk is mapped twice from a memfd: writable somewhere and executable within rel32 reach
+	// of the loaded code, so no mapping is ever writable and executable. Flipping a page between the two
+	// would fault the threads running the other thunks on it. Elsewhere chunks are mapped once for both.
+	// Freed slots are reused for thunks of the same size.
+	class CodeArena
+	{
+		static constexpr std::size_t ChunkSize = 64 * 1024;
+		static constexpr std::size_t Alignment = 16;
+		// Margin for the length of the branch instructions, as for AsmStubAllocator
+		static constexpr std::uintptr_t MaxDistance = 0x7FFFFFFFu - 0x10000u;
+
+		std::mutex mMutex;
+		Slot mCursor = {};
+		std::uint8_t* mEnd = nullptr;
+		std::map<std::size_t, std::vector<Slot>> mFree;
+
+	public:
+		Slot allocate(std::size_t size)
+		{
+			size = roundUp(size);
+
+			std::lock_guard<std::mutex> lock(mMutex);
+			std::vector<Slot>& free = mFree[size];
+			if (!free.empty()) {
+				const Slot slot = free.back();
+				free.pop_back();
+				return slot;
+			}
+			if (static_cast<std::size_t>(mEnd - mCursor.mCode) < size) {
+				const std::size_t chunkSize = size > ChunkSize ? size : ChunkSize;
+				mCursor = mapChunk(chunkSize);
+				mEnd = mCursor.mCode + chunkSize;
+			}
+
+			const Slot slot = mCursor;
+			mCursor.mWrite += size;
+			mCursor.mCode += size;
+			return slot;
+		}
+
+		// No thread may still execute the thunk
+		void free(Slot slot, std::size_t size)
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mFree[roundUp(size)].push_back(slot);
+		}
+
+	private:
+		static std::size_t roundUp(std::size_t size)
+		{
+			return (size + Alignment - 1) & ~(Alignment - 1);
+		}
+
+		// The patches reach the thunks with rel32 calls, so the chunks are placed close to the loaded code
+		static std::uintptr_t placementAnchor()
+		{
+			return reinterpret_cast<std::uintptr_t>(&ExecutableMemory::flushInstructionCache);
+		}
+
+#if defined(__linux__)
+		static Slot mapChunk(std::size_t size)
+		{
+			const int fd = static_cast<int>(syscall(SYS_memfd_create, "asmpatch-thunks", 1u /* MFD_CLOEXEC */));
+			if (fd < 0) {
+				throw std::bad_alloc();
+			}
+			void* write = MAP_FAILED;
+			void* code = nullptr;
+			if (ftruncate(fd, static_cast<off_t>(size)) == 0) {
+				write = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			}
+			if (write != MAP_FAILED && sizeof(void*) > 4) {
+				code = MemoryUtils::mapNear(placementAnchor(), size, MaxDistance, PROT_READ | PROT_EXEC, MAP_SHARED, fd);
+			}
+			// Out of reach the dynamic builders fall back to absolute calls, static ones throw AsmPatchRel32OutOfRange
+			if (write != MAP_FAILED && !code) {
+				code = mmap(nullptr, size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+				code = code == MAP_FAILED ? nullptr : code;
+			}
+			close(fd);
+			if (!code) {
+				if (write != MAP_FAILED) {
+					munmap(write, size);
+				}
+				throw std::bad_alloc();
+			}
+			return { static_cast<std::uint8_t*>(write), static_cast<std::uint8_t*>(code) };
+		}
+#else
+		static Slot mapChunk(std::size_t size)
+		{
+#if defined(__x86_64__) || defined(_M_X64)
+			const void* hint = reinterpret_cast<const void*>((placementAnchor() & ~std::uintptr_t(0xFFFF)) - 0x10000000);
+#else
+			const void* hint = nullptr;
+#endif
+			std::uint8_t* chunk = static_cast<std::uint8_t*>(ExecutableMemory::allocate(size, hint));
+			if (!chunk) {
+				throw std::bad_alloc();
+			}
+			return { chunk, chunk };
+		}
+#endif
+	};
+
+	// Bump allocator for the closure state of all hooks, keeping it densely packed.
+	// Freed blocks are reused for closures of the same size and alignment.
+	class DataArena
+	{
+		static constexpr std::size_t ChunkSize = 16 * 1024;
+
+		std::mutex mMutex;
+		std::uint8_t* mCursor = nullptr;
+		std::uint8_t* mEnd = nullptr;
+		std::map<std::pair<std::size_t, std::size_t>, std::vector<void*>> mFree;
+
+	public:
+		void* allocate(std::size_t size, std::size_t alignment)
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			std::vector<void*>& free = mFree[{ size, alignment }];
+			if (!free.empty()) {
+				void* block = free.back();
+				free.pop_back();
+				return block;
+			}
+
+			std::uintptr_t aligned = (reinterpret_cast<std::uintptr_t>(mCursor) + alignment - 1) & ~(alignment - 1);
+			if (!mCursor || aligned + size > reinterpret_cast<std::uintptr_t>(mEnd)) {
+				std::size_t chunkSize = size + alignment > ChunkSize ? size + alignment : ChunkSize;
+				mCursor = static_cast<std::uint8_t*>(::operator new(chunkSize));
+				mEnd = mCursor + chunkSize;
+				aligned = (reinterpret_cast<std::uintptr_t>(mCursor) + alignment - 1) & ~(alignment - 1);
+			}
+
+			mCursor = reinterpret_cast<std::uint8_t*>(aligned + size);
+			return reinterpret_cast<void*>(aligned);
+		}
+
+		void free(void* block, std::size_t size, std::size_t alignment)
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mFree[{ size, alignment }].push_back(block);
+		}
+	};
+
+	inline CodeArena& codeArena()
+	{
+		static CodeArena arena;
+		return arena;
+	}
+
+	inline DataArena& closureArena()
+	{
+		static DataArena arena;
+		return arena;
+	}
+
+	// Owns the thunks and closures created on a thread while an OwnerScope for it is alive. Without an owner
+	// they live until the process exits.
+	class Owner
+	{
+		struct Thunk
+		{
+			Slot mSlot;
+			std::size_t mSize;
+		};
+
+		struct Closure
+		{
+			void* mObject;
+			std::size_t mSize;
+			std::size_t mAlignment;
+			void (*mDestroy)(void*);
+		};
+
+		std::mutex mMutex;
+		std::vector<Thunk> mThunks;
+		std::vector<Closure> mClosures;
+
+	public:
+		Owner() = default;
+		Owner(const Owner&) = delete;
+		Owner& operator=(const Owner&) = delete;
+
+		~Owner()
+		{
+			release();
+		}
+
+		// Destroys the closures and returns their memory and the thunks to the arenas.
+		// No patch may call into them anymore, i.e. they have to be reverted or overwritten first.
+		void release()
+		{
+			std::vector<Thunk> thunks;
+			std::vector<Closure> closures;
+			{
+				std::lock_guard<std::mutex> lock(mMutex);
+				thunks.swap(mThunks);
+				closures.swap(mClosures);
+			}
+			for (const Closure& closure : closures) {
+				closure.mDestroy(closure.mObject);
+				closureArena().free(closure.mObject, closure.mSize, closure.mAlignment);
+			}
+			for (const Thunk& thunk : thunks) {
+				codeArena().free(thunk.mSlot, thunk.mSize);
+			}
+		}
+
+		void addThunk(Slot slot, std::size_t size)
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mThunks.push_back({ slot, size });
+		}
+
+		void addClosure(void* object, std::size_t size, std::size_t alignment, void (*destroy)(void*))
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mClosures.push_back({ object, size, alignment, destroy });
+		}
+	};
+
+	// Owner of what the current thread creates, set by OwnerScope
+	inline Owner*& currentOwner()
+	{
+		thread_local Owner* owner = nullptr;
+		return owner;
+	}
+
+	class OwnerScope
+	{
+		Owner* mPrevious;
+
+	public:
+		explicit OwnerScope(Owner& owner) :
+			mPrevious(currentOwner())
+		{
+			currentOwner() = &owner;
+		}
+
+		OwnerScope(const OwnerScope&) = delete;
+		OwnerScope& operator=(const OwnerScope&) = delete;
+
+		~OwnerScope()
+		{
+			currentOwner() = mPrevious;
+		}
+	};
+
+	template<typename T, typename... CtorArgs>
+	T* constructClosure(CtorArgs&&... args)
+	{
+		T* closure = new (closureArena().allocate(sizeof(T), alignof(T))) T(std::forward<CtorArgs>(args)...);
+		if (Owner* owner = currentOwner()) {
+			owner->addClosure(closure, sizeof(T), alignof(T), [](void* object) { static_cast<T*>(object)->~T(); });
+		}
+		return closure;
+	}
+
+	class ThunkWriter
+	{
+		Slot mBegin;
+		std::size_t mMaxSize;
+		std::size_t mSize = 0;
+
+	public:
+		explicit ThunkWriter(std::size_t maxSize) :
+			mBegin(codeArena().allocate(maxSize)),
+			mMaxSize(maxSize)
+		{}
+
+		ThunkWriter& byte(std::uint8_t value)
+		{
+			mBegin.mWrite[mSize++] = value;
+			return *this;
+		}
+
+		ThunkWriter& dword(std::uint32_t value)
+		{
+			std::memcpy(mBegin.mWrite + mSize, &value, sizeof(value));
+			mSize += sizeof(value);
+			return *this;
+		}
+
+		ThunkWriter& qword(std::uint64_t value)
+		{
+			std::memcpy(mBegin.mWrite + mSize, &value, sizeof(value));
+			mSize += sizeof(value);
+			return *this;
+		}
+
+		// E8/E9 rel32 if the target is reachable, otherwise call/jmp [rip+0] with the absolute target
+		ThunkWriter& branch(std::uint8_t opcode, const void* target)
+		{
+			std::intptr_t rel = reinterpret_cast<std::intptr_t>(target) - reinterpret_cast<std::intptr_t>(mBegin.mCode + mSize + 5);
+			if (sizeof(void*) == 4 || (rel >= INT32_MIN && rel <= INT32_MAX)) {
+				return byte(opcode).dword(static_cast<std::uint32_t>(rel));
+			}
+			return byte(0xFF).byte(opcode == 0xE8 ? 0x15 : 0x25).dword(0).qword(reinterpret_cast<std::uintptr_t>(target));
+		}
+
+		void* finish()
+		{
+			ExecutableMemory::flushInstructionCache(mBegin.mCode, mSize);
+			PerfMap::record(mBegin.mCode, mSize, "thunk");
+			if (Owner* owner = currentOwner()) {
+				owner->addThunk(mBegin, mMaxSize);
+			}
+			return mBegin.mCode;
+		}
+	};
+
+	// x86: Inserts closure as first stack argument and jumps to a callee cleaned (__stdcall) target.
+	// The first registerArgs arguments are moved from ecx/edx to the stack before (thiscall/fastcall).
+	//   pop eax / [push edx] / [push ecx] / push closure / push eax / jmp target
+	inline void* createStdcallThunk(void* closure, const void* target, int registerArgs)
+	{
+		ThunkWriter writer(16);
+		writer.byte(0x58);
+		if (registerArgs > 1) {
+			writer.byte(0x52);
+		}
+		if (registerArgs > 0) {
+			writer.byte(0x51);
+		}
+		writer.byte(0x68).dword(static_cast<std::uint32_t>(reinterpret_cast<std::uintptr_t>(closure)));
+		writer.byte(0x50);
+		writer.branch(0xE9, target);
+		return writer.finish();
+	}
+
+	// x86: Calls a caller cleaned (__cdecl) target with closure and the return address slot as
+	// additional leading arguments, so the original arguments stay where the caller put them.
+	//   push closure / call target / add esp, 4 / ret
+	inline void* createCdeclThunk(void* closure, const void* target)
+	{
+		ThunkWriter writer(16);
+		writer.byte(0x68).dword(static_cast<std::uint32_t>(reinterpret_cast<std::uintptr_t>(closure)));
+		writer.branch(0xE8, target);
+		writer.byte(0x83).byte(0xC4).byte(0x04);
+		writer.byte(0xC3);
+		return writer.finish();
+	}
+
+	// x86-64: Shifts the integer argument registers by one and passes closure in the first one.
+	//   mov argN, argN-1 / ... / mov arg0, closure / jmp target
+	inline void* createShiftThunk(void* closure, const void* target, int integerArgs)
+	{
+#if defined(_WIN32)
+		static constexpr std::uint8_t ArgRegs[] = { 1, 2, 8, 9 };
+#else
+		static constexpr std::uint8_t ArgRegs[] = { 7, 6, 2, 1, 8, 9 };
+#endif
+		ThunkWriter writer(64);
+		for (int i = integerArgs; i > 0; i--) {
+			std::uint8_t dst = ArgRegs[i];
+			std::uint8_t src = ArgRegs[i - 1];
+			writer.byte(0x48 | ((src >> 3) << 2) | (dst >> 3));
+			writer.byte(0x89);
+			writer.byte(0xC0 | ((src & 7) << 3) | (dst & 7));
+		}
+		writer.byte(0x48 | (ArgRegs[0] >> 3)).byte(0xB8 | (ArgRegs[0] & 7));
+		writer.qword(reinterpret_cast<std::uintptr_t>(closure));
+		writer.branch(0xE9, target);
+		return writer.finish();
+	}
+}
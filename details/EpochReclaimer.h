@@ -0,0 +1,173 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace AsmBuilder::EpochReclaimer
+{
+	// Epoch based reclamation: readers announce the epoch they entered in, writers retire
+	// replaced objects with the current epoch and free them once every reader has left that epoch.
+	// Readers only touch their own cache line, writers serialise on a mutex.
+	class Domain
+	{
+		struct alignas(64) ThreadRecord
+		{
+			// 0 while the thread is outside of a read-side section
+			std::atomic<std::uint64_t> mEpoch{ 0 };
+			std::uint32_t mNesting = 0;
+			std::atomic<bool> mInUse{ true };
+			ThreadRecord* mNext = nullptr;
+		};
+
+		struct Retired
+		{
+			void* mObject;
+			void (*mDestroy)(void*);
+			std::uint64_t mEpoch;
+		};
+
+		std::atomic<std::uint64_t> mGlobalEpoch{ 1 };
+		std::atomic<ThreadRecord*> mThreads{ nullptr };
+		std::mutex mRetiredMutex;
+		std::vector<Retired> mRetired;
+
+	public:
+		void enter()
+		{
+			ThreadRecord& record = localRecord();
+			if (record.mNesting++ == 0) {
+				// acquire: seeing the epoch a writer advanced to also shows the payload it replaced before
+				record.mEpoch.store(mGlobalEpoch.load(std::memory_order_acquire), std::memory_order_seq_cst);
+			}
+		}
+
+		void leave()
+		{
+			ThreadRecord& record = localRecord();
+			if (--record.mNesting == 0) {
+				record.mEpoch.store(0, std::memory_order_release);
+			}
+		}
+
+		// object must already be unreachable for new readers
+		template<typename T>
+		void retire(T* object)
+		{
+			std::uint64_t epoch = mGlobalEpoch.fetch_add(1, std::memory_order_seq_cst);
+			{
+				std::lock_guard<std::mutex> lock(mRetiredMutex);
+				mRetired.push_back({ object, [](void* ptr) { delete static_cast<T*>(ptr); }, epoch });
+			}
+			reclaim();
+		}
+
+		// Frees every retired object which no reader can still see, returns the number of objects left
+		std::size_t reclaim()
+		{
+			std::uint64_t oldestActive = UINT64_MAX;
+			for (ThreadRecord* record = mThreads.load(std::memory_order_acquire); record; record = record->mNext) {
+				std::uint64_t epoch = record->mEpoch.load(std::memory_order_seq_cst);
+				if (epoch != 0 && epoch < oldestActive) {
+					oldestActive = epoch;
+				}
+			}
+
+			std::vector<Retired> freed;
+			std::size_t left;
+			{
+				std::lock_guard<std::mutex> lock(mRetiredMutex);
+				auto kept = mRetired.begin();
+				for (const Retired& retired : mRetired) {
+					if (retired.mEpoch < oldestActive) {
+						freed.push_back(retired);
+					}
+					else {
+						*kept++ = retired;
+					}
+				}
+				mRetired.erase(kept, mRetired.end());
+				left = mRetired.size();
+			}
+
+			for (const Retired& retired : freed) {
+				retired.mDestroy(retired.mObject);
+			}
+			return left;
+		}
+
+		// Blocks until every object retired so far has been freed.
+		// Must not be called from inside a read-side section.
+		void synchronize()
+		{
+			while (reclaim() != 0) {
+				std::this_thread::yield();
+			}
+		}
+
+	private:
+		ThreadRecord& localRecord()
+		{
+			struct LocalRecord
+			{
+				ThreadRecord* mRecord = nullptr;
+				~LocalRecord()
+				{
+					if (mRecord) {
+						mRecord->mInUse.store(false, std::memory_order_release);
+					}
+				}
+			};
+			thread_local LocalRecord local;
+
+			if (!local.mRecord) {
+				local.mRecord = acquireRecord();
+			}
+			return *local.mRecord;
+		}
+
+		// Records of exited threads are reused, so the list only grows with the peak thread count
+		ThreadRecord* acquireRecord()
+		{
+			for (ThreadRecord* record = mThreads.load(std::memory_order_acquire); record; record = record->mNext) {
+				bool inUse = false;
+				if (!record->mInUse.load(std::memory_order_relaxed) && record->mInUse.compare_exchange_strong(inUse, true)) {
+					return record;
+				}
+			}
+
+			ThreadRecord* record = new ThreadRecord();
+			record->mNext = mThreads.load(std::memory_order_relaxed);
+			while (!mThreads.compare_exchange_weak(record->mNext, record, std::memory_order_release, std::memory_order_relaxed)) {}
+			return record;
+		}
+	};
+
+	inline Domain& defaultDomain()
+	{
+		static Domain domain;
+		return domain;
+	}
+
+	class ReadGuard
+	{
+		Domain& mDomain;
+
+	public:
+		explicit ReadGuard(Domain& domain = defaultDomain()) :
+			mDomain(domain)
+		{
+			mDomain.enter();
+		}
+
+		~ReadGuard()
+		{
+			mDomain.leave();
+		}
+
+		ReadGuard(const ReadGuard&) = delete;
+		ReadGuard& operator=(const ReadGuard&) = delete;
+	};
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace AsmBuilder::ExecutableMemory
+{
+	inline std::size_t pageSize()
+	{
+#if defined(_WIN32)
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		return info.dwPageSize;
+#else
+		return static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+#endif
+	}
+
+	// Maps readable, writable and executable memory. hint is only a preference for the placement.
+	// On Linux the closure thunks use separate writable and executable views instead, see ClosureThunk.h.
+	inline void* allocate(std::size_t size, const void* hint = nullptr)
+	{
+#if defined(_WIN32)
+		void* mem = VirtualAlloc(const_cast<void*>(hint), size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+		if (!mem && hint) {
+			mem = VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+		}
+		return mem;
+#else
+		void* mem = mmap(const_cast<void*>(hint), size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		return mem == MAP_FAILED ? nullptr : mem;
+#endif
+	}
+
+	inline void flushInstructionCache(void* addr, std::size_t size)
+	{
+#if defined(_WIN32)
+		FlushInstructionCache(GetCurrentProcess(), addr, size);
+#else
+		char* begin = static_cast<char*>(addr);
+		__builtin___clear_cache(begin, begin + size);
+#endif
+	}
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace AsmBuilder::HexPattern
+{
+	inline int parseNibble(char c)
+	{
+		if (c >= '0' && c <= '9') {
+			return c - '0';
+		}
+		if (c >= 'a' && c <= 'f') {
+			return c - 'a' + 10;
+		}
+		if (c >= 'A' && c <= 'F') {
+			return c - 'A' + 10;
+		}
+		return -1;
+	}
+
+	// The one pattern syntax of the library: space separated bytes of two hex digits, where ?? or a lone ?
+	// ignores the whole byte and a ? in place of one digit ignores that nibble, e.g. "E8 ?? ?? ?? ?? 0F 8? ?".
+	// mask gets 0xFF for fixed bytes, 0x00 for ignored ones and 0xF0/0x0F for nibbles, bytes are masked.
+	// Returns false if the pattern is malformed.
+	inline bool parse(const char* pattern, std::vector<std::uint8_t>& bytes, std::vector<std::uint8_t>& mask)
+	{
+		bytes.clear();
+		mask.clear();
+		while (*pattern) {
+			if (*pattern == ' ') {
+				pattern++;
+				continue;
+			}
+			std::uint8_t byte = 0;
+			std::uint8_t byteMask = 0;
+			if (pattern[0] == '?' && (pattern[1] == ' ' || pattern[1] == 0)) {
+				pattern++;
+			}
+			else {
+				for (int i = 0; i < 2; i++, pattern++) {
+					const int nibble = parseNibble(*pattern);
+					byte <<= 4;
+					byteMask <<= 4;
+					if (nibble >= 0) {
+						byte |= static_cast<std::uint8_t>(nibble);
+						byteMask |= 0x0F;
+					}
+					else if (*pattern != '?') {
+						return false;
+					}
+				}
+				if (*pattern != ' ' && *pattern != 0) {
+					return false;
+				}
+			}
+			bytes.push_back(byte);
+			mask.push_back(byteMask);
+		}
+		return true;
+	}
+}
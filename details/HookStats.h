@@ -0,0 +1,222 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "MetaPUtils.h"
+
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <intrin.h>
+#elif defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+// Define ASMPATCH_ENABLE_HOOK_STATS to 1 to record call counts and latencies of instrumented hooks.
+// Otherwise the instrumented callLambda/safeCall variants compile to the plain ones.
+#ifndef ASMPATCH_ENABLE_HOOK_STATS
+#define ASMPATCH_ENABLE_HOOK_STATS 0
+#endif
+
+namespace AsmBuilder::HookStats
+{
+	// Bucket i counts calls which took [2^(i-1), 2^i) ticks
+	constexpr std::size_t BucketCount = 32;
+
+	struct Stats
+	{
+		std::string mName;
+		std::uint64_t mCalls = 0;
+		std::uint64_t mTicks = 0;
+		std::array<std::uint64_t, BucketCount> mHistogram{};
+	};
+
+	inline std::uint64_t readTicks()
+	{
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64)) || defined(__i386__) || defined(__x86_64__)
+		return __rdtsc();
+#else
+		return static_cast<std::uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+	}
+
+	inline std::size_t bucketOf(std::uint64_t ticks)
+	{
+		std::size_t bucket = 0;
+		while (ticks && bucket < BucketCount - 1) {
+			ticks >>= 1;
+			bucket++;
+		}
+		return bucket;
+	}
+
+	// Only ever written by the owning thread, so updates need no atomic read-modify-write
+	struct alignas(64) Counters
+	{
+		std::atomic<std::uint64_t> mCalls{ 0 };
+		std::atomic<std::uint64_t> mTicks{ 0 };
+		std::array<std::atomic<std::uint64_t>, BucketCount> mHistogram{};
+
+		static void increment(std::atomic<std::uint64_t>& counter, std::uint64_t value)
+		{
+			counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+		}
+
+		void record(std::uint64_t ticks)
+		{
+			increment(mCalls, 1);
+			increment(mTicks, ticks);
+			increment(mHistogram[bucketOf(ticks)], 1);
+		}
+	};
+
+	class Registry
+	{
+		static constexpr std::size_t SegmentSize = 64;
+		static constexpr std::size_t SegmentCount = 64;
+
+		struct ThreadCounters
+		{
+			std::array<std::atomic<Counters*>, SegmentCount> mSegments{};
+			std::atomic<bool> mInUse{ true };
+			ThreadCounters* mNext = nullptr;
+
+			Counters& get(std::uint32_t hook)
+			{
+				std::atomic<Counters*>& segment = mSegments[hook / SegmentSize];
+				Counters* counters = segment.load(std::memory_order_relaxed);
+				if (!counters) {
+					counters = new Counters[SegmentSize];
+					segment.store(counters, std::memory_order_release);
+				}
+				return counters[hook % SegmentSize];
+			}
+		};
+
+		std::mutex mMutex;
+		std::vector<std::string> mNames;
+		std::atomic<ThreadCounters*> mThreads{ nullptr };
+
+	public:
+		std::uint32_t registerHook(const char* name)
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			if (mNames.size() == SegmentSize * SegmentCount) {
+				throw std::length_error("Too many instrumented hooks");
+			}
+			mNames.emplace_back(name ? name : "");
+			return static_cast<std::uint32_t>(mNames.size() - 1);
+		}
+
+		Counters& local(std::uint32_t hook)
+		{
+			struct LocalCounters
+			{
+				ThreadCounters* mCounters = nullptr;
+				~LocalCounters()
+				{
+					if (mCounters) {
+						mCounters->mInUse.store(false, std::memory_order_release);
+					}
+				}
+			};
+			thread_local LocalCounters local;
+
+			if (!local.mCounters) {
+				local.mCounters = acquireThreadCounters();
+			}
+			return local.mCounters->get(hook);
+		}
+
+		// Merges the counters of all threads into one entry per hook
+		std::vector<Stats> snapshot()
+		{
+			std::vector<Stats> stats;
+			{
+				std::lock_guard<std::mutex> lock(mMutex);
+				stats.resize(mNames.size());
+				for (std::size_t i = 0; i < mNames.size(); i++) {
+					stats[i].mName = mNames[i];
+				}
+			}
+
+			for (ThreadCounters* thread = mThreads.load(std::memory_order_acquire); thread; thread = thread->mNext) {
+				for (std::size_t segment = 0; segment < SegmentCount; segment++) {
+					const Counters* counters = thread->mSegments[segment].load(std::memory_order_acquire);
+					for (std::size_t i = 0; counters && i < SegmentSize && segment * SegmentSize + i < stats.size(); i++) {
+						Stats& hook = stats[segment * SegmentSize + i];
+						hook.mCalls += counters[i].mCalls.load(std::memory_order_relaxed);
+						hook.mTicks += counters[i].mTicks.load(std::memory_order_relaxed);
+						for (std::size_t bucket = 0; bucket < BucketCount; bucket++) {
+							hook.mHistogram[bucket] += counters[i].mHistogram[bucket].load(std::memory_order_relaxed);
+						}
+					}
+				}
+			}
+			return stats;
+		}
+
+	private:
+		// Counters of exited threads keep their values and are continued by the next new thread
+		ThreadCounters* acquireThreadCounters()
+		{
+			for (ThreadCounters* thread = mThreads.load(std::memory_order_acquire); thread; thread = thread->mNext) {
+				bool inUse = false;
+				if (!thread->mInUse.load(std::memory_order_relaxed) && thread->mInUse.compare_exchange_strong(inUse, true)) {
+					return thread;
+				}
+			}
+
+			ThreadCounters* thread = new ThreadCounters();
+			thread->mNext = mThreads.load(std::memory_order_relaxed);
+			while (!mThreads.compare_exchange_weak(thread->mNext, thread, std::memory_order_release, std::memory_order_relaxed)) {}
+			return thread;
+		}
+	};
+
+	inline Registry& registry()
+	{
+		static Registry instance;
+		return instance;
+	}
+
+	template<typename LambdaFunc, typename Ret, typename... Args>
+	struct InstrumentedLambda
+	{
+		LambdaFunc mFunc;
+		std::uint32_t mHook;
+
+		Ret operator()(Args... args) const
+		{
+			struct ScopedTimer
+			{
+				std::uint32_t mHook;
+				std::uint64_t mStart = readTicks();
+				~ScopedTimer()
+				{
+					registry().local(mHook).record(readTicks() - mStart);
+				}
+			} timer{ mHook };
+
+			return mFunc(args...);
+		}
+	};
+
+	template<typename Ret, typename... Args, typename LambdaFunc>
+	InstrumentedLambda<LambdaFunc, Ret, Args...> InstrumentHelper(LambdaFunc func, const char* name, AsmBuilder::MetaPUtils::pack<Args...>)
+	{
+		return { std::move(func), registry().registerHook(name) };
+	}
+
+	template<typename LambdaFunc>
+	auto Instrument(LambdaFunc func, const char* name)
+	{
+		using lambda_traits_t = AsmBuilder::MetaPUtils::function_traits<LambdaFunc>;
+		return InstrumentHelper<typename lambda_traits_t::result_type>(std::move(func), name, lambda_traits_t::args);
+	}
+}
@@ -1,9 +1,26 @@
 #pragma once
 
-#include <functional>
+#include <new>
+#include <type_traits>
 #include "MetaPUtils.h"
 
-#include "fixed_size_function.h"
+#include "ClosureThunk.h"
+
+// MSVC keywords for the calling conventions; GCC and Clang only know them as attributes,
+// which are meaningless (and therefore left out) outside of 32-bit x86.
+#if !defined(_MSC_VER) && !defined(__stdcall)
+#if defined(__i386__)
+#define __stdcall __attribute__((stdcall))
+#define __cdecl __attribute__((cdecl))
+#define __thiscall __attribute__((thiscall))
+#define __fastcall __attribute__((fastcall))
+#else
+#define __stdcall
+#define __cdecl
+#define __thiscall
+#define __fastcall
+#endif
+#endif
 
 // Source: http://videocortex.io/2016/lambdas-callbacks/
 // TODO: Create LambdaWrapper class so operator= can be used.
@@ -43,79 +60,230 @@ namespace AsmBuilder::LambdaPayloadInjector
 
 	namespace detail
 	{
-		template <typename LambdaTag, typename StdFuncTag>
-		struct payload_injector
+		// Arguments which __fastcall passes in ecx/edx
+		template<typename T>
+		constexpr bool IsRegisterArg =
+			std::is_reference_v<T> ||
+			((std::is_integral_v<T> || std::is_enum_v<T> || std::is_pointer_v<T> || std::is_null_pointer_v<T>) && sizeof(T) <= 4);
+
+		template<typename... Args>
+		constexpr int CountRegisterArgs()
+		{
+			constexpr bool isRegisterArg[] = { IsRegisterArg<Args>..., false };
+			int count = 0;
+			for (bool registerArg : isRegisterArg) {
+				count += registerArg ? 1 : 0;
+			}
+			return count < 2 ? count : 2;
+		}
+
+		template<typename... Args>
+		constexpr int CountLeadingRegisterArgs()
 		{
-			static StdFuncTag val;
+			constexpr bool isRegisterArg[] = { IsRegisterArg<Args>..., false };
+			int count = 0;
+			while (count < 2 && isRegisterArg[count]) {
+				count++;
+			}
+			return count;
+		}
+
+		// Arguments which x86-64 passes in general purpose registers
+		template<typename T>
+		constexpr bool IsIntegerClassArg =
+			std::is_reference_v<T> || std::is_integral_v<T> || std::is_enum_v<T> ||
+			std::is_pointer_v<T> || std::is_null_pointer_v<T> || std::is_member_pointer_v<T>;
+
+		template<typename... Args>
+		constexpr int CountIntegerClassArgs()
+		{
+			return (0 + ... + (IsIntegerClassArg<Args> ? 1 : 0));
+		}
+
+		// Storage for a lambda without captures, all instances of its type are interchangeable
+		template<typename LambdaType>
+		struct StatelessClosure
+		{
+			static inline std::aligned_storage_t<sizeof(LambdaType), alignof(LambdaType)> storage;
+
+			static void store(const LambdaType& func) {
+				new (&storage) LambdaType(func);
+			}
+
+			static LambdaType& get() {
+				return *std::launder(reinterpret_cast<LambdaType*>(&storage));
+			}
 		};
-		
-		template <typename LambdaTag, typename StdFuncTag>
-		StdFuncTag payload_injector<LambdaTag, StdFuncTag>::val; // static variable definition for linker
-	
 
-		// CallingConvention Helper
-		template<CallingConvention Convention>
-		struct CallConventionDispatchHelper;
+		template<typename LambdaType>
+		constexpr bool IsStatelessLambda = std::is_empty_v<LambdaType> && std::is_trivially_copyable_v<LambdaType>;
 
-		template<>
-		struct CallConventionDispatchHelper<CallingConvention::ThisCall> 
+		// Stateless lambdas are called directly through DispatchStateless, which has the calling convention of the hook.
+		// For all other lambdas the closure is passed to Dispatch as an additional leading argument by a per-closure thunk.
+		template<CallingConvention Convention>
+		struct CallConventionDispatchHelper
 		{
-			template<typename PayloadInjectorType, typename Ret, typename... Args>
-			static Ret __thiscall Dispatch(Args... args) {
-				return PayloadInjectorType::val(args...);
+			template<typename LambdaType, typename Ret, typename... Args>
+			static Ret DispatchStateless(Args... args) {
+				return StatelessClosure<LambdaType>::get()(args...);
+			}
+
+			template<typename ClosureType, typename Ret, typename... Args>
+			static Ret Dispatch(void* closure, Args... args) {
+				return (*static_cast<ClosureType*>(closure))(args...);
+			}
+
+			template<typename ClosureType, typename Ret, typename... Args>
+			static void* CreateThunk(void* closure) {
+#if defined(_WIN32)
+				static_assert((IsIntegerClassArg<Args> && ...) && sizeof...(Args) < 4,
+					"Only up to 3 integer or pointer arguments are supported on x64");
+#else
+				static_assert(((IsIntegerClassArg<Args> || std::is_floating_point_v<Args>) && ...) && CountIntegerClassArgs<Args...>() < 6,
+					"Only scalar arguments and up to 5 integer or pointer arguments are supported on x86-64");
+#endif
+				return AsmBuilder::ClosureThunk::createShiftThunk(closure, reinterpret_cast<const void*>(&Dispatch<ClosureType, Ret, Args...>), CountIntegerClassArgs<Args...>());
 			}
 		};
 
+#if defined(__i386__) || defined(_M_IX86)
 		template<>
-		struct CallConventionDispatchHelper<CallingConvention::CDeclCall>
+		struct CallConventionDispatchHelper<CallingConvention::StdCall>
 		{
-			template<typename PayloadInjectorType, typename Ret, typename... Args>
-			static Ret __cdecl Dispatch(Args... args) {
-				return PayloadInjectorType::val(args...);
+			template<typename LambdaType, typename Ret, typename... Args>
+			static Ret __stdcall DispatchStateless(Args... args) {
+				return StatelessClosure<LambdaType>::get()(args...);
+			}
+
+			template<typename ClosureType, typename Ret, typename... Args>
+			static Ret __stdcall Dispatch(void* closure, Args... args) {
+				return (*static_cast<ClosureType*>(closure))(args...);
+			}
+
+			template<typename ClosureType, typename Ret, typename... Args>
+			static void* CreateThunk(void* closure, int registerArgs = 0) {
+				return AsmBuilder::ClosureThunk::createStdcallThunk(closure, reinterpret_cast<const void*>(&Dispatch<ClosureType, Ret, Args...>), registerArgs);
 			}
 		};
 
 		template<>
-		struct CallConventionDispatchHelper<CallingConvention::StdCall>
+		struct CallConventionDispatchHelper<CallingConvention::ThisCall>
 		{
-			template<typename PayloadInjectorType, typename Ret, typename... Args>
-			static Ret __stdcall Dispatch(Args... args) {
-				return PayloadInjectorType::val(args...);
+			template<typename LambdaType, typename Ret, typename... Args>
+			static Ret __thiscall DispatchStateless(Args... args) {
+				return StatelessClosure<LambdaType>::get()(args...);
+			}
+
+			// this is moved from ecx to the stack, which turns the call into a __stdcall one
+			template<typename ClosureType, typename Ret, typename... Args>
+			static void* CreateThunk(void* closure) {
+				return CallConventionDispatchHelper<CallingConvention::StdCall>::template CreateThunk<ClosureType, Ret, Args...>(closure, sizeof...(Args) ? 1 : 0);
 			}
 		};
 
 		template<>
 		struct CallConventionDispatchHelper<CallingConvention::FastCall>
 		{
-			template<typename PayloadInjectorType, typename Ret, typename... Args>
-			static Ret __fastcall Dispatch(Args... args) {
-				return PayloadInjectorType::val(args...);
+			template<typename LambdaType, typename Ret, typename... Args>
+			static Ret __fastcall DispatchStateless(Args... args) {
+				return StatelessClosure<LambdaType>::get()(args...);
+			}
+
+			// ecx and edx are moved to the stack, which turns the call into a __stdcall one
+			template<typename ClosureType, typename Ret, typename... Args>
+			static void* CreateThunk(void* closure) {
+				static_assert(CountRegisterArgs<Args...>() == CountLeadingRegisterArgs<Args...>(),
+					"fastcall signatures with register arguments after stack arguments are not supported");
+				return CallConventionDispatchHelper<CallingConvention::StdCall>::template CreateThunk<ClosureType, Ret, Args...>(closure, CountRegisterArgs<Args...>());
 			}
 		};
 
+		template<>
+		struct CallConventionDispatchHelper<CallingConvention::CDeclCall>
+		{
+			template<typename LambdaType, typename Ret, typename... Args>
+			static Ret __cdecl DispatchStateless(Args... args) {
+				return StatelessClosure<LambdaType>::get()(args...);
+			}
+
+			template<typename ClosureType, typename Ret, typename... Args>
+			static Ret __cdecl Dispatch(void* closure, void* /* returnAddress */, Args... args) {
+				return (*static_cast<ClosureType*>(closure))(args...);
+			}
+
+			template<typename ClosureType, typename Ret, typename... Args>
+			static void* CreateThunk(void* closure) {
+				return AsmBuilder::ClosureThunk::createCdeclThunk(closure, reinterpret_cast<const void*>(&Dispatch<ClosureType, Ret, Args...>));
+			}
+		};
+#endif
 
 		template<CallingConvention Convention, typename Ret,  typename... Args, typename LambdaFunc>
 		auto CreateFuncPtrFromLambdaHelper(LambdaFunc func, AsmBuilder::MetaPUtils::pack<Args...>)
 		{
-			// we add sizeof(void*) * 3 because of the vtable used in fixed_size_function
-			using StdFunctionType = fixed_size_function<Ret(Args...), sizeof(LambdaFunc) + sizeof(void*) * 3, construct_type::move>;
+			static_assert(std::is_void_v<Ret> || std::is_scalar_v<Ret> || std::is_reference_v<Ret>,
+				"Lambdas returning class types are not supported");
+
 			using LambdaType = std::decay_t<LambdaFunc>;
-			using PayloadInjectorType = payload_injector<LambdaType, StdFunctionType>;
-			PayloadInjectorType::val = StdFunctionType(func);
+			using FuncPtrType = typename CallingConvType<Convention, Ret, Args...>::Type;
+			using DispatchHelper = CallConventionDispatchHelper<Convention>;
 
-			return &CallConventionDispatchHelper<Convention>::template Dispatch<PayloadInjectorType, Ret, Args...>;
+			if constexpr (IsStatelessLambda<LambdaType>) {
+				StatelessClosure<LambdaType>::store(func);
+				return static_cast<FuncPtrType>(&DispatchHelper::template DispatchStateless<LambdaType, Ret, Args...>);
+			}
+			else {
+				// Every call gets its own closure and thunk, so the same lambda type can be used for several hooks
+				LambdaType* closure = AsmBuilder::ClosureThunk::constructClosure<LambdaType>(std::move(func));
+				void* thunk = DispatchHelper::template CreateThunk<LambdaType, Ret, Args...>(closure);
+				return reinterpret_cast<FuncPtrType>(thunk);
+			}
 		}
 	}
 	
 	
 	
 
+	namespace detail
+	{
+		template<CallingConvention Convention, typename... Args>
+		constexpr bool TakesStackArgsHelper(AsmBuilder::MetaPUtils::pack<Args...>)
+		{
+#if defined(__i386__) || defined(_M_IX86)
+			switch (Convention) {
+			case CallingConvention::ThisCall: return sizeof...(Args) > 1;
+			case CallingConvention::FastCall: return sizeof...(Args) > static_cast<std::size_t>(CountRegisterArgs<Args...>());
+			default: return sizeof...(Args) > 0;
+			}
+#elif defined(_WIN32)
+			return sizeof...(Args) > 4;
+#else
+			// Capturing lambdas are limited to register arguments by their thunks, stateless ones are not.
+			// Beyond six integer and eight SSE arguments, and for long double or class arguments, the stack is used.
+			constexpr bool isSseArg[] = { (std::is_same_v<Args, float> || std::is_same_v<Args, double>)..., false };
+			constexpr bool isStackArg[] = { (!IsIntegerClassArg<Args> && !(std::is_same_v<Args, float> || std::is_same_v<Args, double>))..., false };
+			int sseArgs = 0;
+			for (std::size_t i = 0; i < sizeof...(Args); i++) {
+				if (isStackArg[i]) {
+					return true;
+				}
+				sseArgs += isSseArg[i] ? 1 : 0;
+			}
+			return CountIntegerClassArgs<Args...>() > 6 || sseArgs > 8;
+#endif
+		}
+	}
+
+	// Whether the hooked code passes some of the lambda arguments on the stack
+	template<CallingConvention Convention, typename LambdaFunc>
+	constexpr bool TakesStackArgs = detail::TakesStackArgsHelper<Convention>(AsmBuilder::MetaPUtils::function_traits<LambdaFunc>::args);
+
 	template<CallingConvention Convention = CallingConvention::StdCall, typename LambdaFunc>
 	auto CreateFuncPtrFromLambda(LambdaFunc func)
 	{
 		using lambda_traits_t = AsmBuilder::MetaPUtils::function_traits<LambdaFunc>;
 		
-		return detail::CreateFuncPtrFromLambdaHelper<Convention, lambda_traits_t::result_type>(func, lambda_traits_t::args);
+		return detail::CreateFuncPtrFromLambdaHelper<Convention, typename lambda_traits_t::result_type>(func, lambda_traits_t::args);
 	}
 }
 
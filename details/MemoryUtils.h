@@ -0,0 +1,175 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#if !defined(__linux__)
+#error "MemoryUtils.h currently only supports Linux"
+#endif
+
+#include <linux/membarrier.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Older headers lack it, kernels before 4.17 ignore it and treat the address as a hint
+#if !defined(MAP_FIXED_NOREPLACE)
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+namespace AsmBuilder::MemoryUtils
+{
+	inline std::uintptr_t pageSize()
+	{
+		static const std::uintptr_t size = static_cast<std::uintptr_t>(sysconf(_SC_PAGESIZE));
+		return size;
+	}
+
+	inline std::uintptr_t alignDown(std::uintptr_t addr, std::uintptr_t alignment)
+	{
+		return addr - addr % alignment;
+	}
+
+	inline std::uintptr_t alignUp(std::uintptr_t addr, std::uintptr_t alignment)
+	{
+		return alignDown(addr + alignment - 1, alignment);
+	}
+
+	inline bool protect(std::uintptr_t begin, std::uintptr_t end, int prot)
+	{
+		return mprotect(reinterpret_cast<void*>(begin), end - begin, prot) == 0;
+	}
+
+	inline void flushInstructionCache(std::uintptr_t begin, std::uintptr_t end)
+	{
+		__builtin___clear_cache(reinterpret_cast<char*>(begin), reinterpret_cast<char*>(end));
+	}
+
+	// True if serializeAllThreads() works, checked anew on every call
+	inline bool canSerializeAllThreads()
+	{
+		return syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE, 0, 0) == 0;
+	}
+
+	// Makes every running thread of the process execute a serializing instruction, so none of them keeps
+	// executing code prefetched before a modification. Returns false if the kernel does not support it (before 4.16).
+	inline bool serializeAllThreads()
+	{
+		static const bool registered = syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE, 0, 0) == 0;
+		return registered && syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE, 0, 0) == 0;
+	}
+
+	struct MappedRegion
+	{
+		std::uintptr_t mBegin;
+		std::uintptr_t mEnd;
+		int mProt;
+	};
+
+	// Snapshot of the mappings of the current process, read from /proc/self/maps
+	class ProtectionMap
+	{
+		std::vector<MappedRegion> mRegions;
+
+	public:
+		ProtectionMap()
+		{
+			FILE* maps = std::fopen("/proc/self/maps", "r");
+			if (!maps) {
+				return;
+			}
+
+			char line[512];
+			while (std::fgets(line, sizeof(line), maps)) {
+				unsigned long long begin = 0;
+				unsigned long long end = 0;
+				char perms[5] = {};
+				if (std::sscanf(line, "%llx-%llx %4s", &begin, &end, perms) != 3) {
+					continue;
+				}
+
+				int prot = PROT_NONE;
+				prot |= perms[0] == 'r' ? PROT_READ : 0;
+				prot |= perms[1] == 'w' ? PROT_WRITE : 0;
+				prot |= perms[2] == 'x' ? PROT_EXEC : 0;
+				mRegions.push_back({ static_cast<std::uintptr_t>(begin), static_cast<std::uintptr_t>(end), prot });
+			}
+			std::fclose(maps);
+		}
+
+		// Splits [begin, end) at the mapping boundaries. Returns false if part of the range is unmapped.
+		bool split(std::uintptr_t begin, std::uintptr_t end, std::vector<MappedRegion>& out) const
+		{
+			auto first = std::partition_point(mRegions.begin(), mRegions.end(),
+				[begin](const MappedRegion& region) { return region.mEnd <= begin; });
+			for (auto it = first; it != mRegions.end() && begin < end; ++it) {
+				const MappedRegion& region = *it;
+				if (region.mBegin > begin) {
+					return false;
+				}
+				std::uintptr_t partEnd = region.mEnd < end ? region.mEnd : end;
+				out.push_back({ begin, partEnd, region.mProt });
+				begin = partEnd;
+			}
+			return begin >= end;
+		}
+
+		// Start of the unmapped, alignment aligned block of size bytes closest to near which lies completely
+		// within maxDistance of near, or 0 if there is none. Only looks at addresses in [minAddr, maxAddr).
+		std::uintptr_t findFree(std::uintptr_t near, std::uintptr_t size, std::uintptr_t alignment, std::uintptr_t maxDistance,
+			std::uintptr_t minAddr, std::uintptr_t maxAddr) const
+		{
+			const std::uintptr_t lowest = near > maxDistance ? near - maxDistance : 0;
+			const std::uintptr_t highest = maxAddr - near > maxDistance ? near + maxDistance : maxAddr;
+
+			std::uintptr_t best = 0;
+			std::uintptr_t bestDistance = ~std::uintptr_t(0);
+			std::uintptr_t gapBegin = minAddr;
+			for (std::size_t i = 0; i <= mRegions.size(); i++) {
+				std::uintptr_t gapEnd = i < mRegions.size() ? mRegions[i].mBegin : maxAddr;
+				gapEnd = gapEnd < highest ? gapEnd : highest;
+				const std::uintptr_t first = alignUp(gapBegin > lowest ? gapBegin : lowest, alignment);
+				if (gapEnd >= size && first <= gapEnd - size) {
+					const std::uintptr_t last = alignDown(gapEnd - size, alignment);
+					const std::uintptr_t wanted = alignDown(near, alignment);
+					const std::uintptr_t start = wanted < first ? first : (wanted > last ? last : wanted);
+					const std::uintptr_t distance = start > near ? start - near : near - start;
+					if (distance < bestDistance) {
+						best = start;
+						bestDistance = distance;
+					}
+				}
+				if (i < mRegions.size()) {
+					gapBegin = mRegions[i].mEnd > gapBegin ? mRegions[i].mEnd : gapBegin;
+				}
+			}
+			return best;
+		}
+	};
+
+	// Maps size bytes (a multiple of the page size) in the free gap closest to near, so that the whole mapping
+	// lies within maxDistance of it. Returns nullptr if there is no such gap. flags and fd are passed to mmap.
+	inline void* mapNear(std::uintptr_t near, std::size_t size, std::uintptr_t maxDistance, int prot, int flags, int fd = -1)
+	{
+		// Other threads may map memory between reading the mappings and mapping the region
+		for (int attempt = 0; attempt < 4; attempt++) {
+			const std::uintptr_t addr = ProtectionMap().findFree(near, size, pageSize(), maxDistance,
+				0x10000, std::uintptr_t(0x00007FFFFFFFF000ull));
+			if (!addr) {
+				break;
+			}
+			void* mem = mmap(reinterpret_cast<void*>(addr), size, prot, flags | MAP_FIXED_NOREPLACE, fd, 0);
+			if (mem == MAP_FAILED) {
+				continue;
+			}
+			if (reinterpret_cast<std::uintptr_t>(mem) == addr) {
+				return mem;
+			}
+			munmap(mem, size);
+		}
+		return nullptr;
+	}
+}
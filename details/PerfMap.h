@@ -0,0 +1,272 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Define ASMPATCH_ENABLE_PERF_MAP to 1 to describe generated code to Linux perf in /tmp/perf-<pid>.map,
+// and ASMPATCH_ENABLE_JITDUMP to 1 to additionally write /tmp/jit-<pid>.dump with the code bytes
+// (perf record -k 1, then perf inject --jit). Otherwise nothing is recorded.
+#ifndef ASMPATCH_ENABLE_PERF_MAP
+#define ASMPATCH_ENABLE_PERF_MAP 0
+#endif
+
+#ifndef ASMPATCH_ENABLE_JITDUMP
+#define ASMPATCH_ENABLE_JITDUMP 0
+#endif
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+namespace AsmBuilder::PerfMap
+{
+	// Name of the code generated by the current thread, set by NameScope
+	inline const char*& currentName()
+	{
+		thread_local const char* name = nullptr;
+		return name;
+	}
+
+	class NameScope
+	{
+		std::string mName;
+		const char* mPrevious;
+
+	public:
+		explicit NameScope(const char* name) :
+			mName(name ? name : ""),
+			mPrevious(currentName())
+		{
+			currentName() = mName.c_str();
+		}
+
+		NameScope(const NameScope&) = delete;
+		NameScope& operator=(const NameScope&) = delete;
+
+		~NameScope()
+		{
+			currentName() = mPrevious;
+		}
+	};
+
+#if defined(__linux__)
+	// Collects the records in memory and appends them to the files once FlushSize bytes are pending,
+	// on flush() and on destruction
+	class Writer
+	{
+		static constexpr std::size_t FlushSize = 64 * 1024;
+
+		// jitdump format, see tools/perf/Documentation/jitdump-specification.txt in the kernel sources
+		struct DumpHeader
+		{
+			std::uint32_t mMagic;
+			std::uint32_t mVersion;
+			std::uint32_t mTotalSize;
+			std::uint32_t mElfMach;
+			std::uint32_t mPad;
+			std::uint32_t mPid;
+			std::uint64_t mTimestamp;
+			std::uint64_t mFlags;
+		};
+
+		struct CodeLoadRecord
+		{
+			std::uint32_t mId;
+			std::uint32_t mTotalSize;
+			std::uint64_t mTimestamp;
+			std::uint32_t mPid;
+			std::uint32_t mTid;
+			std::uint64_t mVma;
+			std::uint64_t mCodeAddr;
+			std::uint64_t mCodeSize;
+			std::uint64_t mCodeIndex;
+		};
+
+		std::string mDirectory;
+		bool mJitdump;
+		std::mutex mMutex;
+		std::string mMapBuffer;
+		std::vector<std::uint8_t> mDumpBuffer;
+		int mMapFd = -1;
+		int mDumpFd = -1;
+		void* mDumpMarker = nullptr;
+		std::uint64_t mCodeIndex = 0;
+
+	public:
+		explicit Writer(std::string directory = "/tmp", bool jitdump = ASMPATCH_ENABLE_JITDUMP) :
+			mDirectory(std::move(directory)),
+			mJitdump(jitdump)
+		{}
+
+		Writer(const Writer&) = delete;
+		Writer& operator=(const Writer&) = delete;
+
+		~Writer()
+		{
+			flush();
+			if (mDumpMarker) {
+				munmap(mDumpMarker, static_cast<std::size_t>(sysconf(_SC_PAGESIZE)));
+			}
+			if (mDumpFd >= 0) {
+				close(mDumpFd);
+			}
+			if (mMapFd >= 0) {
+				close(mMapFd);
+			}
+		}
+
+		std::string mapPath() const
+		{
+			return mDirectory + "/perf-" + std::to_string(getpid()) + ".map";
+		}
+
+		std::string dumpPath() const
+		{
+			return mDirectory + "/jit-" + std::to_string(getpid()) + ".dump";
+		}
+
+		// code is read right away for the jitdump, so it has to be written already
+		void record(std::uintptr_t code, std::size_t size, const char* kind, const char* name)
+		{
+			if (!size) {
+				return;
+			}
+			std::string symbol = name && *name ? name : "asmpatch";
+			symbol += " [";
+			symbol += kind;
+			symbol += "]";
+
+			std::lock_guard<std::mutex> lock(mMutex);
+			char line[64];
+			std::snprintf(line, sizeof(line), "%llx %zx ", static_cast<unsigned long long>(code), size);
+			mMapBuffer += line;
+			mMapBuffer += symbol;
+			mMapBuffer += '\n';
+
+			if (mJitdump) {
+				CodeLoadRecord record = {};
+				record.mId = 0;
+				record.mTotalSize = static_cast<std::uint32_t>(sizeof(record) + symbol.size() + 1 + size);
+				record.mTimestamp = timestamp();
+				record.mPid = static_cast<std::uint32_t>(getpid());
+				record.mTid = static_cast<std::uint32_t>(syscall(SYS_gettid));
+				record.mVma = code;
+				record.mCodeAddr = code;
+				record.mCodeSize = size;
+				record.mCodeIndex = mCodeIndex++;
+				append(&record, sizeof(record));
+				append(symbol.c_str(), symbol.size() + 1);
+				append(reinterpret_cast<const void*>(code), size);
+			}
+
+			if (mMapBuffer.size() + mDumpBuffer.size() >= FlushSize) {
+				flushLocked();
+			}
+		}
+
+		void flush()
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			flushLocked();
+		}
+
+	private:
+		// CLOCK_MONOTONIC, which perf uses with -k 1
+		static std::uint64_t timestamp()
+		{
+			timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			return static_cast<std::uint64_t>(now.tv_sec) * 1000000000u + static_cast<std::uint64_t>(now.tv_nsec);
+		}
+
+		void append(const void* data, std::size_t size)
+		{
+			const std::uint8_t* bytes = static_cast<const std::uint8_t*>(data);
+			mDumpBuffer.insert(mDumpBuffer.end(), bytes, bytes + size);
+		}
+
+		static void writeAll(int fd, const void* data, std::size_t size)
+		{
+			const char* bytes = static_cast<const char*>(data);
+			while (fd >= 0 && size) {
+				const ssize_t written = ::write(fd, bytes, size);
+				if (written <= 0) {
+					return;
+				}
+				bytes += written;
+				size -= static_cast<std::size_t>(written);
+			}
+		}
+
+		void openDump()
+		{
+			mDumpFd = open(dumpPath().c_str(), O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0666);
+			if (mDumpFd < 0) {
+				return;
+			}
+			DumpHeader header = {};
+			header.mMagic = 0x4A695444;
+			header.mVersion = 1;
+			header.mTotalSize = sizeof(header);
+#if defined(__x86_64__)
+			header.mElfMach = 62;
+#else
+			header.mElfMach = 3;
+#endif
+			header.mPid = static_cast<std::uint32_t>(getpid());
+			header.mTimestamp = timestamp();
+			writeAll(mDumpFd, &header, sizeof(header));
+			// perf finds the dump through this executable mapping of it
+			mDumpMarker = mmap(nullptr, static_cast<std::size_t>(sysconf(_SC_PAGESIZE)), PROT_READ | PROT_EXEC, MAP_PRIVATE, mDumpFd, 0);
+			if (mDumpMarker == MAP_FAILED) {
+				mDumpMarker = nullptr;
+			}
+		}
+
+		void flushLocked()
+		{
+			if (!mMapBuffer.empty()) {
+				if (mMapFd < 0) {
+					mMapFd = open(mapPath().c_str(), O_CREAT | O_APPEND | O_WRONLY | O_CLOEXEC, 0666);
+				}
+				writeAll(mMapFd, mMapBuffer.data(), mMapBuffer.size());
+				mMapBuffer.clear();
+			}
+			if (!mDumpBuffer.empty()) {
+				if (mDumpFd < 0) {
+					openDump();
+				}
+				writeAll(mDumpFd, mDumpBuffer.data(), mDumpBuffer.size());
+				mDumpBuffer.clear();
+			}
+		}
+	};
+
+	inline Writer& writer()
+	{
+		static Writer instance;
+		return instance;
+	}
+#endif
+
+	// Describes code generated at runtime, named after the current NameScope
+	inline void record(const void* code, std::size_t size, const char* kind)
+	{
+#if ASMPATCH_ENABLE_PERF_MAP && defined(__linux__)
+		writer().record(reinterpret_cast<std::uintptr_t>(code), size, kind, currentName());
+#else
+		(void)code;
+		(void)size;
+		(void)kind;
+#endif
+	}
+}
@@ -0,0 +1,385 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+
+namespace AsmBuilder::RegisterSaves
+{
+	// Bits of a live mask, mirrored by AsmConsts::Live: one per general purpose register
+	// (by register number), then the flags, the x87/SSE state and the AVX state
+	constexpr std::uint32_t GprMask = 0xFFFF;
+	constexpr std::uint32_t FlagsBit = 1u << 16;
+	constexpr std::uint32_t SseBit = 1u << 17;
+	constexpr std::uint32_t AvxBit = 1u << 18;
+
+	// Registers a called function may clobber: eax, ecx, edx on x86; on x86-64 additionally
+	// r8-r11 and, outside of Windows, rsi and rdi
+	constexpr std::uint32_t ClobberedX86 = 0x0007;
+#if defined(_WIN32)
+	constexpr std::uint32_t ClobberedX64 = 0x0F07;
+#else
+	constexpr std::uint32_t ClobberedX64 = 0x0FC7;
+#endif
+
+	enum Extended : std::uint8_t {
+		EXTENDED_NONE,
+		EXTENDED_FXSAVE,
+		EXTENDED_XSAVE
+	};
+
+	struct Plan
+	{
+		// General purpose registers to push, by register number
+		std::uint32_t mRegisters = 0;
+		bool mFlags = false;
+		bool mPushad = false;
+		Extended mExtended = EXTENDED_NONE;
+		bool mX64 = false;
+		// Shadow space for the callee on Windows x86-64
+		bool mShadowSpace = false;
+		// Skips the 128 byte red zone below rsp on SysV x86-64 before pushing anything
+		bool mRedZone = false;
+	};
+
+	constexpr Plan plan(std::uint32_t live, bool x64)
+	{
+		Plan result;
+		result.mX64 = x64;
+#if defined(_WIN32)
+		result.mShadowSpace = x64;
+#else
+		result.mRedZone = x64;
+#endif
+		result.mRegisters = live & (x64 ? ClobberedX64 : ClobberedX86);
+		result.mFlags = (live & FlagsBit) != 0;
+		result.mExtended = (live & AvxBit) ? EXTENDED_XSAVE : (live & SseBit) ? EXTENDED_FXSAVE : EXTENDED_NONE;
+		// pushad and popad replace three pushes and pops each, also storing ebx, esp, ebp, esi and edi is harmless
+		result.mPushad = !x64 && result.mRegisters == ClobberedX86;
+		return result;
+	}
+
+	// True if the plan emits anything around the call
+	constexpr bool savesAnything(const Plan& plan)
+	{
+		return plan.mX64 || plan.mRegisters || plan.mFlags || plan.mExtended != EXTENDED_NONE;
+	}
+
+	struct CountingSink
+	{
+		std::size_t mSize = 0;
+
+		constexpr void byte(std::uint8_t)
+		{
+			mSize++;
+		}
+	};
+
+	template<std::size_t N>
+	struct ArraySink
+	{
+		std::array<std::uint8_t, N> mBytes{};
+		std::size_t mSize = 0;
+
+		constexpr void byte(std::uint8_t value)
+		{
+			mBytes[mSize++] = value;
+		}
+	};
+
+	template<typename Sink>
+	constexpr void emit(Sink& sink, std::initializer_list<std::uint8_t> bytes)
+	{
+		for (std::uint8_t value : bytes) {
+			sink.byte(value);
+		}
+	}
+
+	// REX.W in x86-64 mode, the same instruction operates on esp/ebp in x86 mode
+	template<typename Sink>
+	constexpr void emitWide(Sink& sink, const Plan& plan, std::initializer_list<std::uint8_t> bytes)
+	{
+		if (plan.mX64) {
+			sink.byte(0x48);
+		}
+		emit(sink, bytes);
+	}
+
+	template<typename Sink>
+	constexpr void emitPushRegister(Sink& sink, unsigned reg, std::uint8_t opcode)
+	{
+		if (reg >= 8) {
+			sink.byte(0x41);
+		}
+		sink.byte(static_cast<std::uint8_t>(opcode | (reg & 7)));
+	}
+
+	// The flags are pushed first as the frame setup modifies them. The frame is built in
+	// ebp (x86) or rbx (x86-64), which are callee saved and therefore survive the call:
+	//   fxsave: 512 bytes aligned to 16
+	//   xsave:  x87, SSE and AVX components (requested in edx:eax = 7), 576 + 256 bytes aligned
+	//           to 64 with a zeroed 64 byte header. eax and edx are set again before the xrstor,
+	//           so a return value does not reach the hooked code.
+	// x86-64 always aligns the stack to 16 bytes for the callee. Outside of Windows the hooked code may
+	// keep data in the red zone below rsp, lea steps over it without touching the flags.
+	template<typename Sink>
+	constexpr void emitRedZoneSkip(Sink& sink)
+	{
+		emit(sink, { 0x48, 0x8D, 0x64, 0x24, 0x80 });                      // lea rsp, [rsp - 128]
+	}
+
+	template<typename Sink>
+	constexpr void emitRedZoneRestore(Sink& sink)
+	{
+		emit(sink, { 0x48, 0x8D, 0xA4, 0x24, 0x80, 0x00, 0x00, 0x00 });    // lea rsp, [rsp + 128]
+	}
+
+	template<typename Sink>
+	constexpr void emitPrologue(Sink& sink, const Plan& plan)
+	{
+		if (plan.mRedZone) {
+			emitRedZoneSkip(sink);
+		}
+		if (plan.mFlags) {
+			sink.byte(0x9C);                                  // pushf
+		}
+		if (plan.mPushad) {
+			sink.byte(0x60);                                  // pushad
+		}
+		else {
+			for (unsigned reg = 0; reg < 16; reg++) {
+				if (plan.mRegisters & (1u << reg)) {
+					emitPushRegister(sink, reg, 0x50);
+				}
+			}
+		}
+
+		const bool frame = plan.mX64 || plan.mExtended != EXTENDED_NONE;
+		if (!frame) {
+			return;
+		}
+		if (plan.mX64) {
+			emit(sink, { 0x53, 0x48, 0x89, 0xE3 });          // push rbx; mov rbx, rsp
+		}
+		else {
+			emit(sink, { 0x55, 0x89, 0xE5 });                // push ebp; mov ebp, esp
+		}
+
+		switch (plan.mExtended) {
+		case EXTENDED_NONE:
+			emitWide(sink, plan, { 0x83, 0xE4, 0xF0 });      // and esp, -16
+			break;
+		case EXTENDED_FXSAVE:
+			emitWide(sink, plan, { 0x83, 0xE4, 0xF0 });      // and esp, -16
+			emitWide(sink, plan, { 0x81, 0xEC, 0x00, 0x02, 0x00, 0x00 });   // sub esp, 512
+			emitWide(sink, plan, { 0x0F, 0xAE, 0x04, 0x24 });               // fxsave [esp]
+			break;
+		case EXTENDED_XSAVE:
+			emitWide(sink, plan, { 0x83, 0xE4, 0xC0 });      // and esp, -64
+			emitWide(sink, plan, { 0x81, 0xEC, 0x00, 0x01, 0x00, 0x00 });   // sub esp, 256
+			for (int i = 0; i < (plan.mX64 ? 8 : 16); i++) {
+				emit(sink, { 0x6A, 0x00 });                  // push 0
+			}
+			emitWide(sink, plan, { 0x81, 0xEC, 0x00, 0x02, 0x00, 0x00 });   // sub esp, 512
+			emit(sink, { 0xB8, 0x07, 0x00, 0x00, 0x00, 0x31, 0xD2 });       // mov eax, 7; xor edx, edx
+			emitWide(sink, plan, { 0x0F, 0xAE, 0x24, 0x24 });               // xsave [esp]
+			break;
+		}
+		if (plan.mShadowSpace) {
+			emit(sink, { 0x48, 0x83, 0xEC, 0x20 });          // sub rsp, 32
+		}
+	}
+
+	template<typename Sink>
+	constexpr void emitEpilogue(Sink& sink, const Plan& plan)
+	{
+		const bool frame = plan.mX64 || plan.mExtended != EXTENDED_NONE;
+		if (frame) {
+			if (plan.mShadowSpace && plan.mExtended != EXTENDED_NONE) {
+				emit(sink, { 0x48, 0x83, 0xC4, 0x20 });      // add rsp, 32
+			}
+			if (plan.mExtended == EXTENDED_FXSAVE) {
+				emitWide(sink, plan, { 0x0F, 0xAE, 0x0C, 0x24 });           // fxrstor [esp]
+			}
+			else if (plan.mExtended == EXTENDED_XSAVE) {
+				emit(sink, { 0xB8, 0x07, 0x00, 0x00, 0x00, 0x31, 0xD2 });   // mov eax, 7; xor edx, edx
+				emitWide(sink, plan, { 0x0F, 0xAE, 0x2C, 0x24 });           // xrstor [esp]
+			}
+			if (plan.mX64) {
+				emit(sink, { 0x48, 0x89, 0xDC, 0x5B });      // mov rsp, rbx; pop rbx
+			}
+			else {
+				emit(sink, { 0x89, 0xEC, 0x5D });            // mov esp, ebp; pop ebp
+			}
+		}
+
+		if (plan.mPushad) {
+			sink.byte(0x61);                                  // popad
+		}
+		else {
+			for (unsigned reg = 16; reg > 0; reg--) {
+				if (plan.mRegisters & (1u << (reg - 1))) {
+					emitPushRegister(sink, reg - 1, 0x58);
+				}
+			}
+		}
+		if (plan.mFlags) {
+			sink.byte(0x9D);                                  // popf
+		}
+		if (plan.mRedZone) {
+			emitRedZoneRestore(sink);
+		}
+	}
+
+	constexpr unsigned countRegisters(std::uint32_t mask)
+	{
+		unsigned count = 0;
+		for (unsigned reg = 0; reg < 16; reg++) {
+			count += (mask >> reg) & 1;
+		}
+		return count;
+	}
+
+	// Context capture for callLambdaWithContext: the flags and the spilled registers are pushed in
+	// ascending order, outside of the saves for the remaining live state. The first argument register
+	// (ecx for the fastcall thunk, rdi or rcx on x86-64) then receives the address of the last push.
+	template<typename Sink>
+	constexpr void emitContextPrologue(Sink& sink, std::uint32_t spilled, std::uint32_t live, bool x64)
+	{
+		Plan inner = plan(live & ~spilled, x64);
+		// The red zone is skipped before the context is pushed
+		if (inner.mRedZone) {
+			emitRedZoneSkip(sink);
+			inner.mRedZone = false;
+		}
+		if (spilled & FlagsBit) {
+			sink.byte(0x9C);                                  // pushf
+		}
+		for (unsigned reg = 0; reg < 16; reg++) {
+			if (spilled & (1u << reg)) {
+				emitPushRegister(sink, reg, 0x50);
+			}
+		}
+
+		emitPrologue(sink, inner);
+
+		const unsigned slot = x64 ? 8 : 4;
+		unsigned pushed = (inner.mFlags ? 1 : 0) + (inner.mPushad ? 8 : countRegisters(inner.mRegisters));
+#if defined(_WIN32)
+		const std::uint8_t argument = 1;
+#else
+		const std::uint8_t argument = x64 ? 7 : 1;
+#endif
+		const bool frame = inner.mX64 || inner.mExtended != EXTENDED_NONE;
+		if (frame) {
+			// Above the saved ebp/rbx the frame register points to
+			pushed++;
+			emitWide(sink, inner, { 0x8D, static_cast<std::uint8_t>(0x40 | (argument << 3) | (x64 ? 3 : 5)), static_cast<std::uint8_t>(pushed * slot) });   // lea ecx, [ebp + disp8]
+		}
+		else if (pushed) {
+			emitWide(sink, inner, { 0x8D, static_cast<std::uint8_t>(0x44 | (argument << 3)), 0x24, static_cast<std::uint8_t>(pushed * slot) });          // lea ecx, [esp + disp8]
+		}
+		else {
+			emitWide(sink, inner, { 0x89, static_cast<std::uint8_t>(0xE0 | argument) });   // mov ecx, esp
+		}
+	}
+
+	// Loads back the written registers and those the call may clobber, the other slots are skipped
+	template<typename Sink>
+	constexpr void emitContextEpilogue(Sink& sink, std::uint32_t spilled, std::uint32_t written, std::uint32_t live, bool x64)
+	{
+		Plan inner = plan(live & ~spilled, x64);
+		const bool redZone = inner.mRedZone;
+		inner.mRedZone = false;
+		emitEpilogue(sink, inner);
+
+		const unsigned slot = x64 ? 8 : 4;
+		const std::uint32_t loaded = written | (x64 ? ClobberedX64 : ClobberedX86);
+		unsigned skipped = 0;
+		for (unsigned reg = 16; reg > 0; reg--) {
+			const std::uint32_t bit = 1u << (reg - 1);
+			if (!(spilled & bit)) {
+				continue;
+			}
+			if (!(loaded & bit)) {
+				skipped++;
+				continue;
+			}
+			if (skipped) {
+				emitWide(sink, inner, { 0x8D, 0x64, 0x24, static_cast<std::uint8_t>(skipped * slot) });   // lea esp, [esp + disp8]
+				skipped = 0;
+			}
+			emitPushRegister(sink, reg - 1, 0x58);
+		}
+		if (skipped) {
+			emitWide(sink, inner, { 0x8D, 0x64, 0x24, static_cast<std::uint8_t>(skipped * slot) });
+		}
+		if (spilled & FlagsBit) {
+			sink.byte(0x9D);                                  // popf
+		}
+		if (redZone) {
+			emitRedZoneRestore(sink);
+		}
+	}
+
+	constexpr std::size_t prologueSize(std::uint32_t live, bool x64)
+	{
+		CountingSink sink;
+		emitPrologue(sink, plan(live, x64));
+		return sink.mSize;
+	}
+
+	constexpr std::size_t epilogueSize(std::uint32_t live, bool x64)
+	{
+		CountingSink sink;
+		emitEpilogue(sink, plan(live, x64));
+		return sink.mSize;
+	}
+
+	template<std::uint32_t Live, bool X64>
+	constexpr std::array<std::uint8_t, prologueSize(Live, X64)> prologue()
+	{
+		ArraySink<prologueSize(Live, X64)> sink;
+		emitPrologue(sink, plan(Live, X64));
+		return sink.mBytes;
+	}
+
+	template<std::uint32_t Live, bool X64>
+	constexpr std::array<std::uint8_t, epilogueSize(Live, X64)> epilogue()
+	{
+		ArraySink<epilogueSize(Live, X64)> sink;
+		emitEpilogue(sink, plan(Live, X64));
+		return sink.mBytes;
+	}
+
+	constexpr std::size_t contextPrologueSize(std::uint32_t spilled, std::uint32_t live, bool x64)
+	{
+		CountingSink sink;
+		emitContextPrologue(sink, spilled, live, x64);
+		return sink.mSize;
+	}
+
+	constexpr std::size_t contextEpilogueSize(std::uint32_t spilled, std::uint32_t written, std::uint32_t live, bool x64)
+	{
+		CountingSink sink;
+		emitContextEpilogue(sink, spilled, written, live, x64);
+		return sink.mSize;
+	}
+
+	template<std::uint32_t Spilled, std::uint32_t Live, bool X64>
+	constexpr std::array<std::uint8_t, contextPrologueSize(Spilled, Live, X64)> contextPrologue()
+	{
+		ArraySink<contextPrologueSize(Spilled, Live, X64)> sink;
+		emitContextPrologue(sink, Spilled, Live, X64);
+		return sink.mBytes;
+	}
+
+	template<std::uint32_t Spilled, std::uint32_t Written, std::uint32_t Live, bool X64>
+	constexpr std::array<std::uint8_t, contextEpilogueSize(Spilled, Written, Live, X64)> contextEpilogue()
+	{
+		ArraySink<contextEpilogueSize(Spilled, Written, Live, X64)> sink;
+		emitContextEpilogue(sink, Spilled, Written, Live, X64);
+		return sink.mBytes;
+	}
+}
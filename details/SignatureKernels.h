@@ -0,0 +1,269 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64)
+#define ASMPATCH_SIGNATURE_SIMD 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define ASMPATCH_TARGET_SSE2
+#define ASMPATCH_TARGET_SSSE3
+#define ASMPATCH_TARGET_AVX2
+#else
+#define ASMPATCH_TARGET_SSE2 __attribute__((target("sse2")))
+#define ASMPATCH_TARGET_SSSE3 __attribute__((target("ssse3")))
+#define ASMPATCH_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#else
+#define ASMPATCH_SIGNATURE_SIMD 0
+#endif
+
+#if defined(__clang__) || defined(__GNUC__)
+#define ASMPATCH_NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
+#else
+#define ASMPATCH_NO_SANITIZE_ADDRESS
+#endif
+
+namespace AsmBuilder::SignatureKernels
+{
+	enum Level {
+		LEVEL_SCALAR,
+		LEVEL_SSSE3,
+		LEVEL_AVX2
+	};
+
+	inline Level detectLevel()
+	{
+#if ASMPATCH_SIGNATURE_SIMD && defined(_MSC_VER) && !defined(__clang__)
+		int info[4];
+		__cpuid(info, 0);
+		const int maxLeaf = info[0];
+		__cpuid(info, 1);
+		const bool ssse3 = (info[2] & (1 << 9)) != 0;
+		const bool osxsave = (info[2] & (1 << 27)) != 0;
+		if (maxLeaf >= 7 && osxsave && (_xgetbv(0) & 6) == 6) {
+			__cpuidex(info, 7, 0);
+			if (info[1] & (1 << 5)) {
+				return LEVEL_AVX2;
+			}
+		}
+		return ssse3 ? LEVEL_SSSE3 : LEVEL_SCALAR;
+#elif ASMPATCH_SIGNATURE_SIMD
+		if (__builtin_cpu_supports("avx2")) {
+			return LEVEL_AVX2;
+		}
+		return __builtin_cpu_supports("ssse3") ? LEVEL_SSSE3 : LEVEL_SCALAR;
+#else
+		return LEVEL_SCALAR;
+#endif
+	}
+
+	inline unsigned countTrailingZeros(std::uint32_t mask)
+	{
+#if defined(_MSC_VER) && !defined(__clang__)
+		unsigned long index;
+		_BitScanForward(&index, mask);
+		return index;
+#else
+		return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+	}
+
+	// Sets of the first and second bytes of all anchors, as shuffle tables:
+	// entry lo has bit hi set if byte (hi << 4 | lo) is in the set, one table for hi 0-7 and one for 8-15
+	struct AnchorSets
+	{
+		std::array<std::uint8_t, 16> mFirstLow{};
+		std::array<std::uint8_t, 16> mFirstHigh{};
+		std::array<std::uint8_t, 16> mSecondLow{};
+		std::array<std::uint8_t, 16> mSecondHigh{};
+
+		void add(std::uint8_t first, std::uint8_t second)
+		{
+			addToSet(mFirstLow, mFirstHigh, first);
+			addToSet(mSecondLow, mSecondHigh, second);
+		}
+
+		bool contains(const std::uint8_t* bytes) const
+		{
+			return inSet(mFirstLow, mFirstHigh, bytes[0]) && inSet(mSecondLow, mSecondHigh, bytes[1]);
+		}
+
+	private:
+		static bool inSet(const std::array<std::uint8_t, 16>& low, const std::array<std::uint8_t, 16>& high, std::uint8_t byte)
+		{
+			const unsigned hi = byte >> 4;
+			return ((hi < 8 ? low : high)[byte & 15] >> (hi & 7)) & 1;
+		}
+
+		static void addToSet(std::array<std::uint8_t, 16>& low, std::array<std::uint8_t, 16>& high, std::uint8_t byte)
+		{
+			const unsigned hi = byte >> 4;
+			(hi < 8 ? low : high)[byte & 15] |= static_cast<std::uint8_t>(1 << (hi & 7));
+		}
+	};
+
+	// The kernels report every position in [from, to) whose byte is in the first set and whose next byte
+	// is in the second set. They read [from, to + 1), so to has to be below the end of the data.
+
+	template<typename OnHit>
+	void findAnchorsScalar(const std::uint8_t* data, std::size_t from, std::size_t to, const AnchorSets& sets, OnHit&& onHit)
+	{
+		for (std::size_t pos = from; pos < to; pos++) {
+			if (sets.contains(data + pos)) {
+				onHit(pos);
+			}
+		}
+	}
+
+#if ASMPATCH_SIGNATURE_SIMD
+	ASMPATCH_TARGET_SSSE3 inline __m128i memberSsse3(__m128i bytes, __m128i lowTable, __m128i highTable)
+	{
+		const __m128i nibble = _mm_set1_epi8(0x0F);
+		const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+		const __m128i lo = _mm_and_si128(bytes, nibble);
+		const __m128i hi = _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble);
+		const __m128i upper = _mm_cmpgt_epi8(hi, _mm_set1_epi8(7));
+		const __m128i row = _mm_or_si128(_mm_andnot_si128(upper, _mm_shuffle_epi8(lowTable, lo)), _mm_and_si128(upper, _mm_shuffle_epi8(highTable, lo)));
+		const __m128i bit = _mm_shuffle_epi8(bits, hi);
+		return _mm_cmpeq_epi8(_mm_and_si128(row, bit), bit);
+	}
+
+	template<typename OnHit>
+	ASMPATCH_TARGET_SSSE3 void findAnchorsSsse3(const std::uint8_t* data, std::size_t from, std::size_t to, const AnchorSets& sets, OnHit&& onHit)
+	{
+		const __m128i firstLow = _mm_loadu_si128(reinterpret_cast<const __m128i*>(sets.mFirstLow.data()));
+		const __m128i firstHigh = _mm_loadu_si128(reinterpret_cast<const __m128i*>(sets.mFirstHigh.data()));
+		const __m128i secondLow = _mm_loadu_si128(reinterpret_cast<const __m128i*>(sets.mSecondLow.data()));
+		const __m128i secondHigh = _mm_loadu_si128(reinterpret_cast<const __m128i*>(sets.mSecondHigh.data()));
+
+		std::size_t pos = from;
+		for (; pos + 16 <= to; pos += 16) {
+			const __m128i first = memberSsse3(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos)), firstLow, firstHigh);
+			const __m128i second = memberSsse3(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos + 1)), secondLow, secondHigh);
+			std::uint32_t mask = static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_and_si128(first, second)));
+			while (mask) {
+				onHit(pos + countTrailingZeros(mask));
+				mask &= mask - 1;
+			}
+		}
+		findAnchorsScalar(data, pos, to, sets, onHit);
+	}
+
+	ASMPATCH_TARGET_AVX2 inline __m256i memberAvx2(__m256i bytes, __m256i lowTable, __m256i highTable)
+	{
+		const __m256i nibble = _mm256_set1_epi8(0x0F);
+		const __m256i bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+			1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+		const __m256i lo = _mm256_and_si256(bytes, nibble);
+		const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble);
+		const __m256i upper = _mm256_cmpgt_epi8(hi, _mm256_set1_epi8(7));
+		const __m256i row = _mm256_blendv_epi8(_mm256_shuffle_epi8(lowTable, lo), _mm256_shuffle_epi8(highTable, lo), upper);
+		const __m256i bit = _mm256_shuffle_epi8(bits, hi);
+		return _mm256_cmpeq_epi8(_mm256_and_si256(row, bit), bit);
+	}
+
+	// vpshufb looks up within each 128-bit lane, so both lanes get the same table
+	ASMPATCH_TARGET_AVX2 inline __m256i tableAvx2(const std::array<std::uint8_t, 16>& entries)
+	{
+		return _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(entries.data())));
+	}
+
+	template<typename OnHit>
+	ASMPATCH_TARGET_AVX2 void findAnchorsAvx2(const std::uint8_t* data, std::size_t from, std::size_t to, const AnchorSets& sets, OnHit&& onHit)
+	{
+		const __m256i firstLow = tableAvx2(sets.mFirstLow);
+		const __m256i firstHigh = tableAvx2(sets.mFirstHigh);
+		const __m256i secondLow = tableAvx2(sets.mSecondLow);
+		const __m256i secondHigh = tableAvx2(sets.mSecondHigh);
+
+		std::size_t pos = from;
+		for (; pos + 32 <= to; pos += 32) {
+			const __m256i first = memberAvx2(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos)), firstLow, firstHigh);
+			const __m256i second = memberAvx2(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos + 1)), secondLow, secondHigh);
+			std::uint32_t mask = static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_and_si256(first, second)));
+			while (mask) {
+				onHit(pos + countTrailingZeros(mask));
+				mask &= mask - 1;
+			}
+		}
+		findAnchorsSsse3(data, pos, to, sets, onHit);
+	}
+#endif
+
+	template<typename OnHit>
+	void findAnchors(Level level, const std::uint8_t* data, std::size_t from, std::size_t to, const AnchorSets& sets, OnHit&& onHit)
+	{
+#if ASMPATCH_SIGNATURE_SIMD
+		if (level == LEVEL_AVX2) {
+			return findAnchorsAvx2(data, from, to, sets, onHit);
+		}
+		if (level == LEVEL_SSSE3) {
+			return findAnchorsSsse3(data, from, to, sets, onHit);
+		}
+#endif
+		findAnchorsScalar(data, from, to, sets, onHit);
+	}
+
+	inline std::size_t firstMismatchScalar(const std::uint8_t* data, const std::uint8_t* expected, const std::uint8_t* mask, std::size_t from, std::size_t size)
+	{
+		for (std::size_t i = from; i < size; i++) {
+			if ((data[i] & mask[i]) != expected[i]) {
+				return i;
+			}
+		}
+		return size;
+	}
+
+#if ASMPATCH_SIGNATURE_SIMD
+	// Blocks may load bytes behind the expectation which lie on the same page but in another object
+	ASMPATCH_TARGET_SSE2 ASMPATCH_NO_SANITIZE_ADDRESS inline std::size_t firstMismatchSse2(const std::uint8_t* data, std::size_t readable, const std::uint8_t* expected, const std::uint8_t* mask, std::size_t size)
+	{
+		std::size_t pos = 0;
+		for (; pos < size && readable - pos >= 16; pos += 16) {
+			// Bytes past the end are compared as wildcards
+			const std::size_t count = size - pos < 16 ? size - pos : 16;
+			alignas(16) std::uint8_t expectedBlock[16] = {};
+			alignas(16) std::uint8_t maskBlock[16] = {};
+			std::memcpy(expectedBlock, expected + pos, count);
+			std::memcpy(maskBlock, mask + pos, count);
+			const __m128i bytes = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos)), _mm_load_si128(reinterpret_cast<const __m128i*>(maskBlock)));
+			const std::uint32_t equal = static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_load_si128(reinterpret_cast<const __m128i*>(expectedBlock)))));
+			if (equal != 0xFFFF) {
+				return pos + countTrailingZeros(~equal);
+			}
+		}
+		return firstMismatchScalar(data, expected, mask, pos, size);
+	}
+#endif
+
+	// Offset of the first byte with (data[i] & mask[i]) != expected[i], or size if all match.
+	// readable bytes at data may be loaded (at least size), whole 16 byte blocks are compared while they fit.
+	inline std::size_t firstMismatch(Level level, const std::uint8_t* data, std::size_t readable, const std::uint8_t* expected, const std::uint8_t* mask, std::size_t size)
+	{
+#if ASMPATCH_SIGNATURE_SIMD
+		if (level != LEVEL_SCALAR) {
+			return firstMismatchSse2(data, readable, expected, mask, size);
+		}
+#endif
+		return firstMismatchScalar(data, expected, mask, 0, size);
+	}
+
+	// Every position in [from, to) holding needle, for signatures without two adjacent fixed bytes
+	template<typename OnHit>
+	void findByte(const std::uint8_t* data, std::size_t from, std::size_t to, std::uint8_t needle, OnHit&& onHit)
+	{
+		const std::uint8_t* end = data + to;
+		for (const std::uint8_t* p = data + from; p < end; p++) {
+			p = static_cast<const std::uint8_t*>(std::memchr(p, needle, end - p));
+			if (!p) {
+				break;
+			}
+			onHit(static_cast<std::size_t>(p - data));
+		}
+	}
+}
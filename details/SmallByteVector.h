@@ -0,0 +1,194 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <vector>
+#include <utility>
+
+namespace AsmBuilder::Containers
+{
+	// Byte container which keeps up to InlineCapacity bytes inside the object itself
+	// and only spills to a heap allocated std::vector for bigger contents.
+	template <std::size_t InlineCapacity>
+	class SmallByteVector
+	{
+		std::size_t mSize = 0;
+		std::uint8_t mInline[InlineCapacity];
+		std::vector<std::uint8_t> mHeap;
+
+		bool isInline() const
+		{
+			return mHeap.empty();
+		}
+
+	public:
+		using value_type = std::uint8_t;
+		using size_type = std::size_t;
+		using iterator = std::uint8_t*;
+		using const_iterator = const std::uint8_t*;
+
+		SmallByteVector() = default;
+
+		SmallByteVector(const std::uint8_t* data, std::size_t size)
+		{
+			append(data, size);
+		}
+
+		template <typename InputIt>
+		SmallByteVector(InputIt first, InputIt last)
+		{
+			for (; first != last; ++first) {
+				push_back(static_cast<std::uint8_t>(*first));
+			}
+		}
+
+		SmallByteVector(std::initializer_list<std::uint8_t> data) :
+			SmallByteVector(data.begin(), data.size())
+		{}
+
+		// Adopts the allocation of data if the content does not fit inline
+		explicit SmallByteVector(std::vector<std::uint8_t>&& data)
+		{
+			if (data.size() <= InlineCapacity) {
+				append(data.data(), data.size());
+			}
+			else {
+				mSize = data.size();
+				mHeap = std::move(data);
+			}
+		}
+
+		SmallByteVector(const SmallByteVector& other)
+		{
+			append(other.data(), other.size());
+		}
+
+		SmallByteVector(SmallByteVector&& other) noexcept :
+			mSize(other.mSize),
+			mHeap(std::move(other.mHeap))
+		{
+			if (isInline()) {
+				std::memcpy(mInline, other.mInline, mSize);
+			}
+			other.mSize = 0;
+			other.mHeap.clear();
+		}
+
+		SmallByteVector& operator=(const SmallByteVector& other)
+		{
+			if (this != &other) {
+				clear();
+				append(other.data(), other.size());
+			}
+			return *this;
+		}
+
+		SmallByteVector& operator=(SmallByteVector&& other) noexcept
+		{
+			if (this != &other) {
+				mSize = other.mSize;
+				mHeap = std::move(other.mHeap);
+				if (isInline()) {
+					std::memcpy(mInline, other.mInline, mSize);
+				}
+				other.mSize = 0;
+				other.mHeap.clear();
+			}
+			return *this;
+		}
+
+		std::uint8_t* data() { return isInline() ? mInline : mHeap.data(); }
+		const std::uint8_t* data() const { return isInline() ? mInline : mHeap.data(); }
+		std::size_t size() const { return mSize; }
+		bool empty() const { return mSize == 0; }
+		std::size_t capacity() const { return isInline() ? InlineCapacity : mHeap.capacity(); }
+
+		iterator begin() { return data(); }
+		iterator end() { return data() + mSize; }
+		const_iterator begin() const { return data(); }
+		const_iterator end() const { return data() + mSize; }
+
+		std::uint8_t& operator[](std::size_t index) { return data()[index]; }
+		const std::uint8_t& operator[](std::size_t index) const { return data()[index]; }
+
+		void reserve(std::size_t newCapacity)
+		{
+			// An empty heap vector means inline storage, so an empty container cannot hold a reservation
+			if (newCapacity <= capacity() || mSize == 0) {
+				return;
+			}
+			spill();
+			mHeap.reserve(newCapacity);
+		}
+
+		void resize(std::size_t newSize, std::uint8_t value = 0)
+		{
+			if (newSize > mSize) {
+				if (isInline() && newSize <= InlineCapacity) {
+					std::memset(mInline + mSize, value, newSize - mSize);
+				}
+				else {
+					spill();
+					mHeap.resize(newSize, value);
+				}
+			}
+			else if (!isInline()) {
+				mHeap.resize(newSize);
+				if (newSize == 0) {
+					mHeap.clear();
+				}
+			}
+			mSize = newSize;
+		}
+
+		void append(const std::uint8_t* newData, std::size_t count)
+		{
+			if (isInline() && mSize + count <= InlineCapacity) {
+				if (count) {
+					std::memcpy(mInline + mSize, newData, count);
+				}
+			}
+			else {
+				spill();
+				mHeap.insert(mHeap.end(), newData, newData + count);
+			}
+			mSize += count;
+		}
+
+		void push_back(std::uint8_t value)
+		{
+			append(&value, 1);
+		}
+
+		void clear()
+		{
+			mSize = 0;
+			mHeap.clear();
+		}
+
+		std::vector<std::uint8_t> toVector() const
+		{
+			return std::vector<std::uint8_t>(begin(), end());
+		}
+
+		friend bool operator==(const SmallByteVector& lhs, const SmallByteVector& rhs)
+		{
+			return lhs.size() == rhs.size() && (lhs.empty() || std::memcmp(lhs.data(), rhs.data(), lhs.size()) == 0);
+		}
+
+		friend bool operator!=(const SmallByteVector& lhs, const SmallByteVector& rhs)
+		{
+			return !(lhs == rhs);
+		}
+
+	private:
+		void spill()
+		{
+			if (isInline()) {
+				mHeap.assign(mInline, mInline + mSize);
+			}
+		}
+	};
+}
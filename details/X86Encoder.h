@@ -0,0 +1,378 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+namespace AsmBuilder::X86Encoder
+{
+	// The first eight match the /digit of the 80/81/83 group and the row of the ALU opcode block
+	enum Op : std::uint8_t {
+		OP_ADD,
+		OP_OR,
+		OP_ADC,
+		OP_SBB,
+		OP_AND,
+		OP_SUB,
+		OP_XOR,
+		OP_CMP,
+		OP_MOV,
+		OP_TEST,
+		OP_LEA,
+		OP_COUNT
+	};
+
+	// Opcodes of the 16/32/64-bit forms, 0 if the form does not exist. Where an 8-bit form exists
+	// it is the opcode one below, except for the sign extended imm8 form which has none.
+	struct Forms
+	{
+		// op r/m, r
+		std::uint8_t mRmReg;
+		// op r, r/m
+		std::uint8_t mRegRm;
+		// op r/m, imm with the /digit in ModRM.reg
+		std::uint8_t mRmImm;
+		// op r/m, imm8 sign extended
+		std::uint8_t mRmImm8;
+		// op eax, imm
+		std::uint8_t mAccImm;
+		std::uint8_t mDigit;
+	};
+
+	constexpr std::array<Forms, OP_COUNT> makeFormsTable()
+	{
+		std::array<Forms, OP_COUNT> table{};
+		for (std::uint8_t op = OP_ADD; op <= OP_CMP; op++) {
+			table[op] = { static_cast<std::uint8_t>(op * 8 + 1), static_cast<std::uint8_t>(op * 8 + 3), 0x81, 0x83, static_cast<std::uint8_t>(op * 8 + 5), op };
+		}
+		// mov r, imm (B8+r) is handled separately
+		table[OP_MOV] = { 0x89, 0x8B, 0xC7, 0x00, 0x00, 0 };
+		// test is symmetric, test r, r/m is encoded as test r/m, r
+		table[OP_TEST] = { 0x85, 0x00, 0xF7, 0x00, 0xA9, 0 };
+		table[OP_LEA] = { 0x00, 0x8D, 0x00, 0x00, 0x00, 0 };
+		return table;
+	}
+
+	inline constexpr std::array<Forms, OP_COUNT> FormsTable = makeFormsTable();
+
+	struct Operand
+	{
+		enum Kind : std::uint8_t {
+			KIND_NONE,
+			KIND_REG,
+			KIND_MEM,
+			KIND_IMM
+		};
+
+		Kind mKind = KIND_NONE;
+		// Width of the register or of the memory access: 1, 2, 4 or 8
+		std::uint8_t mSize = 0;
+		std::uint8_t mReg = 0;
+		// Memory: -1 for no base/index, both -1 for an absolute address in mValue
+		std::int8_t mBase = -1;
+		std::int8_t mIndex = -1;
+		std::uint8_t mScale = 1;
+		// Memory: width of base and index, 4 or 8
+		std::uint8_t mAddressSize = 0;
+		// Memory displacement or absolute address, immediate value
+		std::int64_t mValue = 0;
+	};
+
+	enum Result {
+		ENCODE_OK,
+		ENCODE_INVALID_OPERANDS,
+		ENCODE_INVALID_FOR_MODE,
+		// Rip relative target beyond rel32
+		ENCODE_OUT_OF_RANGE
+	};
+
+	struct Instruction
+	{
+		std::array<std::uint8_t, 15> mBytes{};
+		std::uint8_t mLength = 0;
+		// Offset of the disp32 of a rip relative operand and its target, 0 if there is none
+		std::uint8_t mRipDispOffset = 0;
+		std::uint64_t mRipTarget = 0;
+
+		constexpr void push(std::uint8_t value)
+		{
+			mBytes[mLength++] = value;
+		}
+
+		constexpr void pushLittleEndian(std::uint64_t value, unsigned size)
+		{
+			for (unsigned i = 0; i < size; i++) {
+				push(static_cast<std::uint8_t>(value >> (8 * i)));
+			}
+		}
+	};
+
+	constexpr bool fitsSigned(std::int64_t value, unsigned bits)
+	{
+		return value >= -(std::int64_t(1) << (bits - 1)) && value < (std::int64_t(1) << (bits - 1));
+	}
+
+	// Immediates of 1-4 byte operations may be given signed or unsigned, 8 byte ones are sign extended imm32
+	constexpr bool fitsImmediate(std::int64_t value, unsigned size)
+	{
+		if (size == 8) {
+			return fitsSigned(value, 32);
+		}
+		return fitsSigned(value, size * 8) || (value >= 0 && value < (std::int64_t(1) << (size * 8)));
+	}
+
+	// Prefixes, REX, opcode, ModRM, SIB and displacement of an instruction with a ModRM operand
+	constexpr Result encodeModRM(Instruction& out, bool x64, std::uint8_t operandSize, std::uint8_t opcode, std::uint8_t reg, const Operand& rm)
+	{
+		const bool memory = rm.mKind == Operand::KIND_MEM;
+		const bool absolute = memory && rm.mBase < 0 && rm.mIndex < 0;
+		if (memory && !absolute && rm.mAddressSize == 8 && !x64) {
+			return ENCODE_INVALID_FOR_MODE;
+		}
+		if (memory && rm.mIndex == 4) {
+			return ENCODE_INVALID_OPERANDS;
+		}
+
+		std::uint8_t rex = 0;
+		rex |= operandSize == 8 ? 0x08 : 0;
+		rex |= reg >= 8 ? 0x04 : 0;
+		rex |= memory && rm.mIndex >= 8 ? 0x02 : 0;
+		rex |= (memory ? rm.mBase >= 8 : rm.mReg >= 8) ? 0x01 : 0;
+		if (rex && !x64) {
+			return ENCODE_INVALID_FOR_MODE;
+		}
+
+		if (memory && !absolute && rm.mAddressSize == 4 && x64) {
+			out.push(0x67);
+		}
+		if (operandSize == 2) {
+			out.push(0x66);
+		}
+		if (rex) {
+			out.push(0x40 | rex);
+		}
+		out.push(opcode);
+
+		const std::uint8_t regField = static_cast<std::uint8_t>((reg & 7) << 3);
+		if (!memory) {
+			out.push(0xC0 | regField | (rm.mReg & 7));
+			return ENCODE_OK;
+		}
+
+		if (absolute) {
+			if (!x64) {
+				out.push(0x05 | regField);
+				out.pushLittleEndian(static_cast<std::uint64_t>(rm.mValue), 4);
+			}
+			else if (fitsSigned(rm.mValue, 32)) {
+				// SIB without base and index, [disp32] means [rip+disp32] in 64-bit mode
+				out.push(0x04 | regField);
+				out.push(0x25);
+				out.pushLittleEndian(static_cast<std::uint64_t>(rm.mValue), 4);
+			}
+			else {
+				out.push(0x05 | regField);
+				out.mRipDispOffset = out.mLength;
+				out.mRipTarget = static_cast<std::uint64_t>(rm.mValue);
+				out.pushLittleEndian(0, 4);
+			}
+			return ENCODE_OK;
+		}
+
+		std::uint8_t scaleBits = 0;
+		switch (rm.mScale) {
+		case 1: scaleBits = 0; break;
+		case 2: scaleBits = 1; break;
+		case 4: scaleBits = 2; break;
+		case 8: scaleBits = 3; break;
+		default: return ENCODE_INVALID_OPERANDS;
+		}
+		if (!fitsSigned(rm.mValue, 32)) {
+			return ENCODE_INVALID_OPERANDS;
+		}
+
+		if (rm.mBase < 0) {
+			// [index*scale+disp32]
+			out.push(0x04 | regField);
+			out.push(static_cast<std::uint8_t>((scaleBits << 6) | ((rm.mIndex & 7) << 3) | 5));
+			out.pushLittleEndian(static_cast<std::uint64_t>(rm.mValue), 4);
+			return ENCODE_OK;
+		}
+
+		// ebp/r13 as base have no form without displacement
+		std::uint8_t mod = 0;
+		if (rm.mValue != 0 || (rm.mBase & 7) == 5) {
+			mod = fitsSigned(rm.mValue, 8) ? 1 : 2;
+		}
+		if (rm.mIndex >= 0 || (rm.mBase & 7) == 4) {
+			const std::uint8_t index = rm.mIndex >= 0 ? static_cast<std::uint8_t>(rm.mIndex & 7) : 4;
+			out.push(static_cast<std::uint8_t>((mod << 6) | regField | 4));
+			out.push(static_cast<std::uint8_t>((scaleBits << 6) | (index << 3) | (rm.mBase & 7)));
+		}
+		else {
+			out.push(static_cast<std::uint8_t>((mod << 6) | regField | (rm.mBase & 7)));
+		}
+		out.pushLittleEndian(static_cast<std::uint64_t>(rm.mValue), mod == 1 ? 1 : mod == 2 ? 4 : 0);
+		return ENCODE_OK;
+	}
+
+	// Rip relative operands are resolved against the instruction located at address
+	constexpr Result finish(Result result, Instruction& out, std::uint64_t address)
+	{
+		if (result != ENCODE_OK || !out.mRipDispOffset) {
+			return result;
+		}
+		const std::int64_t disp = static_cast<std::int64_t>(out.mRipTarget - (address + out.mLength));
+		if (!fitsSigned(disp, 32)) {
+			return ENCODE_OUT_OF_RANGE;
+		}
+		for (unsigned i = 0; i < 4; i++) {
+			out.mBytes[out.mRipDispOffset + i] = static_cast<std::uint8_t>(static_cast<std::uint64_t>(disp) >> (8 * i));
+		}
+		return ENCODE_OK;
+	}
+
+	// mov eax, [moffs] / mov [moffs], eax: one byte shorter than ModRM in 32-bit mode, and in
+	// 64-bit mode the only way to reach an address beyond disp32 and rip relative range
+	constexpr bool encodeMoffs(const Operand& dst, const Operand& src, bool x64, std::uint64_t address, Instruction& out)
+	{
+		const bool load = dst.mKind == Operand::KIND_REG;
+		const Operand& reg = load ? dst : src;
+		const Operand& mem = load ? src : dst;
+		if (reg.mKind != Operand::KIND_REG || reg.mReg != 0 || mem.mKind != Operand::KIND_MEM || mem.mBase >= 0 || mem.mIndex >= 0) {
+			return false;
+		}
+		if (x64) {
+			// Rip relative with a 7 byte upper bound for the instruction
+			const std::int64_t disp = static_cast<std::int64_t>(static_cast<std::uint64_t>(mem.mValue) - (address + 7));
+			if (fitsSigned(mem.mValue, 32) || fitsSigned(disp, 31)) {
+				return false;
+			}
+		}
+		if (reg.mSize == 2) {
+			out.push(0x66);
+		}
+		if (reg.mSize == 8) {
+			out.push(0x48);
+		}
+		out.push(load ? 0xA1 : 0xA3);
+		out.pushLittleEndian(static_cast<std::uint64_t>(mem.mValue), x64 ? 8 : 4);
+		return true;
+	}
+
+	// Encodes op dst, src in its shortest form. Register operands of size 1 are not supported.
+	constexpr Result encode(Op op, const Operand& dst, const Operand& src, bool x64, std::uint64_t address, Instruction& out)
+	{
+		out = Instruction();
+		const Forms& forms = FormsTable[op];
+		// The access width of a memory operand only matters next to an immediate
+		const std::uint8_t size = dst.mKind == Operand::KIND_MEM && src.mKind == Operand::KIND_REG ? src.mSize : dst.mSize;
+		if ((dst.mKind == Operand::KIND_REG && size == 1) || (src.mKind == Operand::KIND_REG && src.mSize == 1)) {
+			return ENCODE_INVALID_OPERANDS;
+		}
+		if (size != 1 && size != 2 && size != 4 && size != 8) {
+			return ENCODE_INVALID_OPERANDS;
+		}
+		if (size == 8 && !x64) {
+			return ENCODE_INVALID_FOR_MODE;
+		}
+		// Byte sized forms are one opcode below
+		const std::uint8_t byteForm = size == 1 ? 1 : 0;
+
+		if (op == OP_LEA) {
+			if (dst.mKind != Operand::KIND_REG || src.mKind != Operand::KIND_MEM) {
+				return ENCODE_INVALID_OPERANDS;
+			}
+			return finish(encodeModRM(out, x64, size, forms.mRegRm, dst.mReg, src), out, address);
+		}
+
+		if (src.mKind == Operand::KIND_IMM) {
+			if (dst.mKind == Operand::KIND_IMM || dst.mKind == Operand::KIND_NONE) {
+				return ENCODE_INVALID_OPERANDS;
+			}
+			const std::int64_t imm = src.mValue;
+			const bool reg = dst.mKind == Operand::KIND_REG;
+
+			if (op == OP_MOV && reg) {
+				std::uint8_t rex = dst.mReg >= 8 ? 0x01 : 0;
+				if (size == 8 && !(imm >= 0 && imm <= 0xFFFFFFFFll)) {
+					if (fitsSigned(imm, 32)) {
+						const Result result = encodeModRM(out, x64, 8, 0xC7, 0, dst);
+						out.pushLittleEndian(static_cast<std::uint64_t>(imm), 4);
+						return result;
+					}
+					out.push(0x48 | rex);
+					out.push(0xB8 | (dst.mReg & 7));
+					out.pushLittleEndian(static_cast<std::uint64_t>(imm), 8);
+					return ENCODE_OK;
+				}
+				// mov r32, imm32 zero extends, so it also covers unsigned 64-bit values below 2^32
+				if (size != 8 && !fitsImmediate(imm, size)) {
+					return ENCODE_INVALID_OPERANDS;
+				}
+				if (rex && !x64) {
+					return ENCODE_INVALID_FOR_MODE;
+				}
+				if (size == 2) {
+					out.push(0x66);
+				}
+				if (rex) {
+					out.push(0x40 | rex);
+				}
+				out.push(0xB8 | (dst.mReg & 7));
+				out.pushLittleEndian(static_cast<std::uint64_t>(imm), size == 2 ? 2 : 4);
+				return ENCODE_OK;
+			}
+
+			if (!forms.mRmImm) {
+				return ENCODE_INVALID_OPERANDS;
+			}
+			if (!fitsImmediate(imm, size)) {
+				return ENCODE_INVALID_OPERANDS;
+			}
+			const unsigned fullSize = size == 1 ? 1 : size == 2 ? 2 : 4;
+			Result result = ENCODE_OK;
+			unsigned immSize = fullSize;
+			if (forms.mRmImm8 && size != 1 && fitsSigned(imm, 8)) {
+				immSize = 1;
+				result = encodeModRM(out, x64, size, forms.mRmImm8, forms.mDigit, dst);
+			}
+			else if (forms.mAccImm && reg && dst.mReg == 0) {
+				if (size == 2) {
+					out.push(0x66);
+				}
+				if (size == 8) {
+					out.push(0x48);
+				}
+				out.push(static_cast<std::uint8_t>(forms.mAccImm - byteForm));
+				result = ENCODE_OK;
+			}
+			else {
+				result = encodeModRM(out, x64, size, static_cast<std::uint8_t>(forms.mRmImm - byteForm), forms.mDigit, dst);
+			}
+			if (result != ENCODE_OK) {
+				return result;
+			}
+			out.pushLittleEndian(static_cast<std::uint64_t>(imm), immSize);
+			return finish(ENCODE_OK, out, address);
+		}
+
+		if (op == OP_MOV && encodeMoffs(dst, src, x64, address, out)) {
+			return ENCODE_OK;
+		}
+
+		if (src.mKind == Operand::KIND_REG && dst.mKind != Operand::KIND_IMM && dst.mKind != Operand::KIND_NONE) {
+			if (dst.mKind == Operand::KIND_REG && src.mSize != size) {
+				return ENCODE_INVALID_OPERANDS;
+			}
+			return finish(encodeModRM(out, x64, size, static_cast<std::uint8_t>(forms.mRmReg - byteForm), src.mReg, dst), out, address);
+		}
+
+		if (src.mKind == Operand::KIND_MEM && dst.mKind == Operand::KIND_REG) {
+			if (op == OP_TEST) {
+				return finish(encodeModRM(out, x64, size, forms.mRmReg, dst.mReg, src), out, address);
+			}
+			return finish(encodeModRM(out, x64, size, forms.mRegRm, dst.mReg, src), out, address);
+		}
+		return ENCODE_INVALID_OPERANDS;
+	}
+}
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+namespace AsmBuilder::X86OpcodeTables
+{
+	enum OpcodeFlags : std::uint16_t {
+		OP_NONE = 0x0000,
+		OP_MODRM = 0x0001,
+		OP_IMM8 = 0x0002,
+		OP_IMM16 = 0x0004,
+		// imm16/imm32 depending on the operand size
+		OP_IMMZ = 0x0008,
+		// imm16/imm32/imm64 depending on the operand size (mov r, imm)
+		OP_IMMV = 0x0010,
+		// moffs, sized by the address size
+		OP_MOFFS = 0x0020,
+		OP_REL8 = 0x0040,
+		// rel16/rel32 depending on the operand size, always rel32 in 64-bit mode
+		OP_RELZ = 0x0080,
+		OP_PREFIX = 0x0100,
+		OP_INVALID_X64 = 0x0200,
+		OP_INVALID = 0x0400
+	};
+
+	constexpr void setRange(std::array<std::uint16_t, 256>& table, unsigned first, unsigned last, std::uint16_t flags)
+	{
+		for (unsigned i = first; i <= last; i++) {
+			table[i] = flags;
+		}
+	}
+
+	constexpr std::array<std::uint16_t, 256> makeOneByteTable()
+	{
+		std::array<std::uint16_t, 256> table{};
+
+		// ALU block: op r/m,r / op r,r/m / op al,imm8 / op eax,immz
+		for (unsigned row = 0x00; row < 0x40; row += 0x08) {
+			setRange(table, row + 0x0, row + 0x3, OP_MODRM);
+			table[row + 0x4] = OP_IMM8;
+			table[row + 0x5] = OP_IMMZ;
+			table[row + 0x6] = OP_INVALID_X64;
+			table[row + 0x7] = OP_INVALID_X64;
+		}
+		table[0x0F] = OP_INVALID; // escape, handled by the decoder
+		table[0x26] = OP_PREFIX;
+		table[0x2E] = OP_PREFIX;
+		table[0x36] = OP_PREFIX;
+		table[0x3E] = OP_PREFIX;
+		table[0x0E] = OP_INVALID_X64;
+		table[0x1E] = OP_INVALID_X64;
+		table[0x1F] = OP_INVALID_X64;
+
+		setRange(table, 0x40, 0x5F, OP_NONE);
+		table[0x60] = OP_INVALID_X64;
+		table[0x61] = OP_INVALID_X64;
+		table[0x62] = OP_MODRM | OP_INVALID_X64;
+		table[0x63] = OP_MODRM;
+		setRange(table, 0x64, 0x67, OP_PREFIX);
+		table[0x68] = OP_IMMZ;
+		table[0x69] = OP_MODRM | OP_IMMZ;
+		table[0x6A] = OP_IMM8;
+		table[0x6B] = OP_MODRM | OP_IMM8;
+		setRange(table, 0x6C, 0x6F, OP_NONE);
+		setRange(table, 0x70, 0x7F, OP_REL8);
+
+		table[0x80] = OP_MODRM | OP_IMM8;
+		table[0x81] = OP_MODRM | OP_IMMZ;
+		table[0x82] = OP_MODRM | OP_IMM8 | OP_INVALID_X64;
+		table[0x83] = OP_MODRM | OP_IMM8;
+		setRange(table, 0x84, 0x8F, OP_MODRM);
+		setRange(table, 0x90, 0x99, OP_NONE);
+		table[0x9A] = OP_IMMZ | OP_IMM16 | OP_INVALID_X64;
+		setRange(table, 0x9B, 0x9F, OP_NONE);
+
+		setRange(table, 0xA0, 0xA3, OP_MOFFS);
+		setRange(table, 0xA4, 0xA7, OP_NONE);
+		table[0xA8] = OP_IMM8;
+		table[0xA9] = OP_IMMZ;
+		setRange(table, 0xAA, 0xAF, OP_NONE);
+		setRange(table, 0xB0, 0xB7, OP_IMM8);
+		setRange(table, 0xB8, 0xBF, OP_IMMV);
+
+		table[0xC0] = OP_MODRM | OP_IMM8;
+		table[0xC1] = OP_MODRM | OP_IMM8;
+		table[0xC2] = OP_IMM16;
+		table[0xC3] = OP_NONE;
+		table[0xC4] = OP_MODRM | OP_INVALID_X64;
+		table[0xC5] = OP_MODRM | OP_INVALID_X64;
+		table[0xC6] = OP_MODRM | OP_IMM8;
+		table[0xC7] = OP_MODRM | OP_IMMZ;
+		table[0xC8] = OP_IMM16 | OP_IMM8;
+		table[0xC9] = OP_NONE;
+		table[0xCA] = OP_IMM16;
+		table[0xCB] = OP_NONE;
+		table[0xCC] = OP_NONE;
+		table[0xCD] = OP_IMM8;
+		table[0xCE] = OP_INVALID_X64;
+		table[0xCF] = OP_NONE;
+
+		setRange(table, 0xD0, 0xD3, OP_MODRM);
+		table[0xD4] = OP_IMM8 | OP_INVALID_X64;
+		table[0xD5] = OP_IMM8 | OP_INVALID_X64;
+		table[0xD6] = OP_INVALID_X64;
+		table[0xD7] = OP_NONE;
+		setRange(table, 0xD8, 0xDF, OP_MODRM);
+
+		setRange(table, 0xE0, 0xE3, OP_REL8);
+		setRange(table, 0xE4, 0xE7, OP_IMM8);
+		table[0xE8] = OP_RELZ;
+		table[0xE9] = OP_RELZ;
+		table[0xEA] = OP_IMMZ | OP_IMM16 | OP_INVALID_X64;
+		table[0xEB] = OP_REL8;
+		setRange(table, 0xEC, 0xEF, OP_NONE);
+
+		table[0xF0] = OP_PREFIX;
+		table[0xF1] = OP_NONE;
+		table[0xF2] = OP_PREFIX;
+		table[0xF3] = OP_PREFIX;
+		table[0xF4] = OP_NONE;
+		table[0xF5] = OP_NONE;
+		// test r/m, imm is added by the decoder for /0 and /1
+		table[0xF6] = OP_MODRM;
+		table[0xF7] = OP_MODRM;
+		setRange(table, 0xF8, 0xFD, OP_NONE);
+		table[0xFE] = OP_MODRM;
+		table[0xFF] = OP_MODRM;
+
+		return table;
+	}
+
+	// 0F xx
+	constexpr std::array<std::uint16_t, 256> makeTwoByteTable()
+	{
+		std::array<std::uint16_t, 256> table{};
+		setRange(table, 0x00, 0xFF, OP_MODRM);
+
+		for (unsigned op : { 0x05, 0x06, 0x07, 0x08, 0x09, 0x0B, 0x0E, 0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x37, 0x77, 0xA0, 0xA1, 0xA2, 0xA8, 0xA9, 0xAA }) {
+			table[op] = OP_NONE;
+		}
+		setRange(table, 0xC8, 0xCF, OP_NONE);
+		for (unsigned op : { 0x04, 0x0A, 0x0C, 0x36, 0x39, 0x3B, 0x3C, 0x3D, 0x3E, 0x3F, 0xFF }) {
+			table[op] = OP_INVALID;
+		}
+
+		for (unsigned op : { 0x0F, 0x70, 0x71, 0x72, 0x73, 0xA4, 0xAC, 0xBA, 0xC2, 0xC4, 0xC5, 0xC6 }) {
+			table[op] = OP_MODRM | OP_IMM8;
+		}
+		setRange(table, 0x80, 0x8F, OP_RELZ);
+
+		return table;
+	}
+
+	inline constexpr std::array<std::uint16_t, 256> OneByte = makeOneByteTable();
+	inline constexpr std::array<std::uint16_t, 256> TwoByte = makeTwoByteTable();
+}
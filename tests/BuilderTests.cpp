@@ -0,0 +1,73 @@
+#include <gtest/gtest.h>
+#include "AsmPatchBuilder.h"
+#include "TestUtils.h"
+
+using namespace AsmPatch;
+using AsmPatchTests::bytesOf;
+using AsmPatchTests::hex;
+
+TEST(AsmPatchBuilder, RelativeBranches)
+{
+	EXPECT_EQ(bytesOf(Patch(0x401000).jmp(0x402000)), hex("E9 FB 0F 00 00"));
+	EXPECT_EQ(bytesOf(Patch(0x402000).call(0x401000)), hex("E8 FB EF FF FF"));
+	EXPECT_EQ(bytesOf(Patch(0x401000).nop().jmp(0x401000)), hex("90 E9 FA FF FF FF"));
+	EXPECT_EQ(bytesOf(Patch(0x401000).jcc(AsmConsts::CC_NE, 0x401100)), hex("0F 85 FA 00 00 00"));
+}
+
+TEST(AsmPatchBuilder, PaddingAndData)
+{
+	EXPECT_EQ(bytesOf(Patch(0x401000).jmp(0x401010).nops<3>()), hex("E9 0B 00 00 00 90 90 90"));
+	EXPECT_EQ(bytesOf(Patch(0x401000).ret().nopPadToSize<4>()), hex("C3 90 90 90"));
+	EXPECT_EQ(bytesOf(Patch(0x401000).word(0x1234).dword(0xAABBCCDD).byte(0x01)), hex("34 12 DD CC BB AA 01"));
+	EXPECT_EQ(bytesOf(Patch(0x401000).qword(0x0102030405060708ull)), hex("08 07 06 05 04 03 02 01"));
+}
+
+TEST(AsmPatchBuilder, Registers)
+{
+	EXPECT_EQ(bytesOf(Patch(0x401000).pushEAX().pushEDI().popESI().pushf().popf()), hex("50 57 5E 9C 9D"));
+	EXPECT_EQ(bytesOf(Patch(0x401000).pushR64<AsmConsts::R64_RBX>().pushR64<AsmConsts::R64_R12>().popR64<AsmConsts::R64_R15>()), hex("53 41 54 41 5F"));
+	EXPECT_EQ(bytesOf(Patch(0x401000).retStdcallFull()), hex("5F 5E 5B 8B E5 5D C2 04 00"));
+}
+
+TEST(AsmPatchBuilder, Absolute64)
+{
+	EXPECT_EQ(bytesOf(Patch(0x401000).jmpAbs64(0x1122334455667788ull)), hex("FF 25 00 00 00 00 88 77 66 55 44 33 22 11"));
+	EXPECT_EQ(bytesOf(Patch(0x401000).callAbs64(0x1122334455667788ull)), hex("FF 15 02 00 00 00 EB 08 88 77 66 55 44 33 22 11"));
+}
+
+TEST(AsmPatchBuilder, SafeCall)
+{
+	using namespace AsmPatch::AsmConsts;
+	if constexpr (MODE_HOST == MODE_X86) {
+		EXPECT_EQ(bytesOf(Patch(0x401000).safeCall(0x402000)), hex("9C 50 51 52 E8 F7 0F 00 00 5A 59 58 9D"));
+	}
+	else {
+		// All caller saved registers of the x86-64 ABI
+		EXPECT_EQ(bytesOf(Patch(0x401000).safeCall(0x402000)), bytesOf(Patch(0x401000).safeCall<LIVE_GPRS | LIVE_FLAGS, MODE_X64>(0x402000)));
+	}
+}
+
+TEST(AsmPatchBuilder, CompileStatic)
+{
+	static constexpr auto patch = Patch(0x0057FFA4).jmp(0x00401000).nops<3>().compileStatic();
+	static_assert(patch.size() == 8, "jmp + 3 nops");
+	static_assert(patch.getData()[0] == 0xE9, "jmp rel32");
+	EXPECT_EQ(bytesOf(patch.toPatchData()), hex("E9 57 10 E8 FF 90 90 90"));
+	EXPECT_EQ(patch.getAddress(), 0x0057FFA4u);
+}
+
+TEST(AsmPatchBuilder, CompileInto)
+{
+	const auto builder = Patch(0x401000).nops<4>();
+	std::uint8_t buffer[4] = {};
+	EXPECT_EQ(builder.compileInto(buffer, sizeof(buffer)), 4u);
+	EXPECT_EQ(std::vector<std::uint8_t>(buffer, buffer + 4), hex("90 90 90 90"));
+	EXPECT_THROW(builder.compileInto(buffer, 3), AsmPatchBufferTooSmall);
+}
+
+TEST(AsmPatchBuilder, Rel32OutOfRange)
+{
+	if (sizeof(std::uintptr_t) == 8) {
+		EXPECT_THROW(Patch(0x401000).jmp(static_cast<std::uintptr_t>(0x7FF000000000ull)), AsmPatchRel32OutOfRange);
+	}
+}
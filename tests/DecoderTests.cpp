@@ -0,0 +1,62 @@
+#include <gtest/gtest.h>
+#include "AsmTrampoline.h"
+#include "TestUtils.h"
+
+using namespace AsmPatch;
+using AsmPatchTests::bytesOf;
+using AsmPatchTests::hex;
+
+namespace {
+	AsmInstruction decode(const char* text, AsmConsts::Mode mode)
+	{
+		const std::vector<std::uint8_t> code = hex(text);
+		return decodeInstruction(code.data(), code.size(), mode);
+	}
+}
+
+TEST(AsmInstructionDecoder, Lengths)
+{
+	EXPECT_EQ(decode("55", AsmConsts::MODE_X86).mLength, 1);
+	EXPECT_EQ(decode("8B 44 24 08", AsmConsts::MODE_X86).mLength, 4);
+	EXPECT_EQ(decode("66 05 34 12", AsmConsts::MODE_X86).mLength, 4);
+	EXPECT_EQ(decode("0F 1F 44 00 00", AsmConsts::MODE_X86).mLength, 5);
+	EXPECT_EQ(decode("48 B8 88 77 66 55 44 33 22 11", AsmConsts::MODE_X64).mLength, 10);
+	EXPECT_EQ(decode("C5 F8 77", AsmConsts::MODE_X64).mLength, 3);
+
+	const AsmInstruction call = decode("E8 FB 0F 00 00", AsmConsts::MODE_X86);
+	EXPECT_EQ(call.mLength, 5);
+	EXPECT_EQ(call.mKind, INSTR_CALL);
+	EXPECT_TRUE(call.mRelative);
+	EXPECT_EQ(call.branchTarget(hex("E8 FB 0F 00 00").data(), 0x401000), 0x402000u);
+
+	const AsmInstruction load = decode("48 8B 05 10 00 00 00", AsmConsts::MODE_X64);
+	EXPECT_EQ(load.mLength, 7);
+	EXPECT_TRUE(load.mRipRelative);
+	EXPECT_EQ(load.mDispOffset, 3);
+}
+
+TEST(AsmInstructionDecoder, Truncated)
+{
+	const std::vector<std::uint8_t> code = hex("E8 00");
+	AsmInstruction instruction;
+	EXPECT_FALSE(decodeInstruction(code.data(), code.size(), AsmConsts::MODE_X86, instruction));
+	EXPECT_THROW(decodeInstruction(code.data(), code.size(), AsmConsts::MODE_X86), AsmPatchDecodeFailed);
+}
+
+TEST(AsmInstructionDecoder, CoveringLength)
+{
+	const std::vector<std::uint8_t> code = hex("55 89 E5 83 EC 10 C3");
+	EXPECT_EQ(coveringLength(code.data(), code.size(), 5, AsmConsts::MODE_X86), 6u);
+	EXPECT_EQ(coveringLength(code.data(), code.size(), 3, AsmConsts::MODE_X86), 3u);
+}
+
+TEST(AsmTrampoline, RelocatesBranches)
+{
+	// push ebp; mov ebp, esp; je +2; xor eax, eax; ret
+	const std::vector<std::uint8_t> code = hex("55 89 E5 74 02 31 C0 C3");
+	const AsmTrampoline trampoline = buildTrampoline(0x401000, code.data(), code.size(), 5, 0x500000, AsmConsts::MODE_X86);
+	EXPECT_EQ(trampoline.mStolenSize, 5u);
+	EXPECT_EQ(trampoline.mCode.getAddress(), 0x500000u);
+	// The short je is widened to rel32, then the jmp back to the first instruction left in place
+	EXPECT_EQ(bytesOf(trampoline.mCode), hex("55 89 E5 0F 84 FE 0F F0 FF E9 F7 0F F0 FF"));
+}
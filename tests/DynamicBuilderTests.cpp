@@ -0,0 +1,230 @@
+#include <gtest/gtest.h>
+#include "DynamicAsmPatchBuilder.h"
+#include "TestUtils.h"
+
+using namespace AsmPatch;
+using namespace AsmPatch::AsmConsts;
+using AsmPatchTests::bytesOf;
+using AsmPatchTests::hex;
+
+TEST(DynamicAsmPatchBuilder, MatchesStaticBuilder)
+{
+	DynamicAsmPatchBuilder builder(0x401000, MODE_X86);
+	builder.pushEAX().call(0x402000).popEAX().jmp(0x401000).nops(2);
+	EXPECT_EQ(bytesOf(builder), bytesOf(Patch(0x401000).pushEAX().call(0x402000).popEAX().jmp(0x401000).nops<2>()));
+}
+
+TEST(DynamicAsmPatchBuilder, SharedArena)
+{
+	std::vector<std::uint8_t> arena;
+	// Patches sharing an arena are built one after another
+	DynamicAsmPatchBuilder first(0x401000, arena, MODE_X86);
+	first.nop().ret();
+	EXPECT_THROW(first.nopPadToSize(1), AsmPatchPadTooSmall);
+	EXPECT_EQ(bytesOf(first), hex("90 C3"));
+	DynamicAsmPatchBuilder second(0x402000, arena, MODE_X86);
+	second.jmp(0x402010);
+	EXPECT_EQ(bytesOf(second), hex("E9 0B 00 00 00"));
+	EXPECT_EQ(arena, hex("90 C3 E9 0B 00 00 00"));
+}
+
+#if UINTPTR_MAX > 0xFFFFFFFFu
+TEST(DynamicAsmPatchBuilder, FarTargetsX64)
+{
+	DynamicAsmPatchBuilder call(0x401000, MODE_X64);
+	call.call(static_cast<std::uintptr_t>(0x1122334455667788ull));
+	EXPECT_EQ(bytesOf(call), hex("FF 15 02 00 00 00 EB 08 88 77 66 55 44 33 22 11"));
+
+	DynamicAsmPatchBuilder jmp(0x401000, MODE_X64);
+	jmp.jmp(static_cast<std::uintptr_t>(0x1122334455667788ull));
+	EXPECT_EQ(bytesOf(jmp), hex("FF 25 00 00 00 00 88 77 66 55 44 33 22 11"));
+
+	DynamicAsmPatchBuilder x86(0x401000, MODE_X86);
+	EXPECT_THROW(x86.pushR64(R64_R8), AsmPatchInvalidForMode);
+}
+#endif
+
+#if !defined(_WIN32)
+TEST(DynamicAsmPatchBuilder, SafeCallX64)
+{
+	DynamicAsmPatchBuilder builder(0x401000, MODE_X64);
+	builder.safeCall(0x402000);
+	EXPECT_EQ(bytesOf(builder), hex(
+		"48 8D 64 24 80 9C 50 51 52 56 57 41 50 41 51 41 52 41 53 53 48 89 E3 48 83 E4 F0 "
+		"E8 E0 0F 00 00 "
+		"48 89 DC 5B 41 5B 41 5A 41 59 41 58 5F 5E 5A 59 58 9D 48 8D A4 24 80 00 00 00"));
+	EXPECT_EQ(bytesOf(builder), bytesOf(Patch(0x401000).safeCall<LIVE_GPRS | LIVE_FLAGS, MODE_X64>(0x402000)));
+}
+#endif
+
+TEST(DynamicAsmPatchBuilder, OperandsX86)
+{
+	auto encode = [](auto&& emit) {
+		DynamicAsmPatchBuilder builder(0x401000, MODE_X86);
+		emit(builder);
+		return bytesOf(builder);
+	};
+	EXPECT_EQ(encode([](auto& b) { b.mov(R32_EAX, AsmMem(R32_ECX, 0x10)); }), hex("8B 41 10"));
+	EXPECT_EQ(encode([](auto& b) { b.mov(AsmMem(R32_ESP, 4), R32_EDX); }), hex("89 54 24 04"));
+	EXPECT_EQ(encode([](auto& b) { b.mov(R32_EAX, AsmMem(R32_EBP)); }), hex("8B 45 00"));
+	EXPECT_EQ(encode([](auto& b) { b.mov(R32_EAX, AsmMem::absolute(0x401000)); }), hex("A1 00 10 40 00"));
+	EXPECT_EQ(encode([](auto& b) { b.mov(R32_ECX, 5); }), hex("B9 05 00 00 00"));
+	EXPECT_EQ(encode([](auto& b) { b.add(R32_EAX, 1); }), hex("83 C0 01"));
+	EXPECT_EQ(encode([](auto& b) { b.add(R32_EAX, 0x1000); }), hex("05 00 10 00 00"));
+	EXPECT_EQ(encode([](auto& b) { b.sub(R32_ESI, 0x1000); }), hex("81 EE 00 10 00 00"));
+	EXPECT_EQ(encode([](auto& b) { b.cmp(AsmMem(R32_ECX, 0x10).byte(), 0); }), hex("80 79 10 00"));
+	EXPECT_EQ(encode([](auto& b) { b.test(R32_ECX, R32_ECX); }), hex("85 C9"));
+	EXPECT_EQ(encode([](auto& b) { b.alu(ALU_XOR, R32_EAX, R32_EAX); }), hex("31 C0"));
+	EXPECT_EQ(encode([](auto& b) { b.lea(R32_EAX, AsmMem(R32_ECX, R32_EDX, 4, 0x20)); }), hex("8D 44 91 20"));
+	EXPECT_EQ(encode([](auto& b) { b.lea(R32_EAX, AsmMem::indexed(R32_EDX, 8, 0x100)); }), hex("8D 04 D5 00 01 00 00"));
+}
+
+TEST(DynamicAsmPatchBuilder, OperandsX64)
+{
+	auto encode = [](auto&& emit) {
+		DynamicAsmPatchBuilder builder(0x401000, MODE_X64);
+		emit(builder);
+		return bytesOf(builder);
+	};
+	EXPECT_EQ(encode([](auto& b) { b.mov(R64_RAX, R64_RBX); }), hex("48 89 D8"));
+	EXPECT_EQ(encode([](auto& b) { b.mov(R64_R8, AsmMem(R64_RSP, 8)); }), hex("4C 8B 44 24 08"));
+	EXPECT_EQ(encode([](auto& b) { b.mov(R32_EAX, AsmMem(R32_ECX)); }), hex("67 8B 01"));
+	EXPECT_EQ(encode([](auto& b) { b.mov(R64_RAX, 0x100); }), hex("B8 00 01 00 00"));
+	EXPECT_EQ(encode([](auto& b) { b.mov(R64_RAX, -1); }), hex("48 C7 C0 FF FF FF FF"));
+	EXPECT_EQ(encode([](auto& b) { b.mov(R64_RAX, 0x1122334455667788ll); }), hex("48 B8 88 77 66 55 44 33 22 11"));
+	EXPECT_EQ(encode([](auto& b) { b.sub(R64_R12, 8); }), hex("49 83 EC 08"));
+	EXPECT_EQ(encode([](auto& b) { b.cmp(AsmMem(R64_R13).qword(), 0); }), hex("49 83 7D 00 00"));
+	// Neither disp32 nor rip relative reach it, mov eax, [moffs64]
+	EXPECT_EQ(encode([](auto& b) { b.mov(R32_EAX, AsmMem::absolute(0x80500000)); }), hex("A1 00 00 50 80 00 00 00 00"));
+}
+
+TEST(DynamicAsmPatchBuilder, InvalidOperands)
+{
+	DynamicAsmPatchBuilder x86(0x401000, MODE_X86);
+	EXPECT_THROW(x86.mov(R64_RAX, 1), AsmPatchInvalidForMode);
+	EXPECT_THROW(x86.mov(AsmMem(R32_EAX), AsmMem(R32_ECX)), AsmPatchInvalidOperands);
+	EXPECT_THROW(x86.lea(R32_EAX, AsmMem(R32_ECX, R32_ESP)), AsmPatchInvalidOperands);
+	EXPECT_THROW(x86.add(AsmMem(R32_EAX).byte(), 0x100), AsmPatchInvalidOperands);
+	EXPECT_EQ(x86.size(), 0u);
+}
+
+TEST(DynamicAsmPatchBuilder, ShortBranches)
+{
+	DynamicAsmPatchBuilder builder(0x401000, MODE_X86);
+	AsmLabel skip = builder.newLabel();
+	builder.jcc(CC_E, skip).nop().bind(skip).ret();
+	EXPECT_EQ(bytesOf(builder), hex("74 01 90 C3"));
+
+	DynamicAsmPatchBuilder backwards(0x401000, MODE_X86);
+	backwards.nop().jmp(backwards.labelAt(0x401000));
+	EXPECT_EQ(bytesOf(backwards), hex("90 EB FD"));
+}
+
+TEST(DynamicAsmPatchBuilder, LongBranches)
+{
+	DynamicAsmPatchBuilder builder(0x401000, MODE_X86);
+	AsmLabel end = builder.newLabel();
+	builder.jmp(end).nops(200).bind(end).call(0x401000);
+	std::vector<std::uint8_t> expected = hex("E9 C8 00 00 00");
+	expected.insert(expected.end(), 200, 0x90);
+	// The call follows the branch and is re-encoded for its final position
+	const std::vector<std::uint8_t> call = hex("E8 2E FF FF FF");
+	expected.insert(expected.end(), call.begin(), call.end());
+	EXPECT_EQ(bytesOf(builder), expected);
+}
+
+TEST(DynamicAsmPatchBuilder, PaddingAfterRelaxedBranch)
+{
+	DynamicAsmPatchBuilder builder(0x401000, MODE_X86);
+	AsmLabel skip = builder.newLabel();
+	builder.jcc(CC_E, skip).nop().bind(skip).nopPadToSize(10).jmp(0x401020);
+	// The padding keeps the jmp at offset 10 although the jcc shrinks by 4 bytes
+	EXPECT_EQ(bytesOf(builder), hex("74 01 90 90 90 90 90 90 90 90 E9 11 00 00 00"));
+	EXPECT_EQ(builder.compileTemplate().size(), 15u);
+
+	DynamicAsmPatchBuilder nops(0x401000, MODE_X86);
+	AsmLabel end = nops.newLabel();
+	nops.jmp(end).nops(3).bind(end);
+	// nops() is not a padding, the jmp shrinks and the nops move along
+	EXPECT_EQ(bytesOf(nops), hex("EB 03 90 90 90"));
+	EXPECT_EQ(std::move(nops).compile().getData().size(), 5u);
+
+	DynamicAsmPatchBuilder farNops(0x401000, MODE_X86);
+	AsmLabel farEnd = farNops.newLabel();
+	farNops.jmp(farEnd).nops(126).bind(farEnd);
+	const std::vector<std::uint8_t> farBytes = bytesOf(farNops);
+	ASSERT_EQ(farBytes.size(), 128u);
+	EXPECT_EQ(farBytes[0], 0xEB);
+	EXPECT_EQ(farBytes[1], 126);
+}
+
+TEST(DynamicAsmPatchBuilder, LabelErrors)
+{
+	DynamicAsmPatchBuilder unbound(0x401000, MODE_X86);
+	unbound.jmp(unbound.newLabel());
+	EXPECT_THROW(unbound.compile(), AsmPatchUnboundLabel);
+
+	DynamicAsmPatchBuilder rebound(0x401000, MODE_X86);
+	AsmLabel label = rebound.newLabel();
+	rebound.bind(label);
+	EXPECT_THROW(rebound.bind(label), AsmPatchLabelRebound);
+}
+
+TEST(AsmPatchTemplate, MatchesRebuiltPatch)
+{
+	auto build = [](DynamicAsmPatchBuilder& builder) {
+		AsmLabel skip = builder.newLabel();
+		builder.call(0x402000)
+			.jcc(CC_E, skip)
+			.mov(R32_EAX, 1)
+			.bind(skip)
+			.jcc(CC_NE, builder.labelAt(0x401000))
+			.bytes(0x68).dwordPatchAddress(0)
+			.jmp(0x403000);
+	};
+	DynamicAsmPatchBuilder original(0x401000, MODE_X86);
+	build(original);
+	const AsmPatchTemplate patchTemplate = original.compileTemplate();
+	// Branches to external labels stay in rel32 form
+	EXPECT_EQ(bytesOf(patchTemplate.instantiate(0x401000)), hex(
+		"E8 FB 0F 00 00 74 05 B8 01 00 00 00 0F 85 EE FF FF FF 68 00 10 40 00 E9 E4 1F 00 00"));
+
+	for (std::uintptr_t addr : { std::uintptr_t(0x400000), std::uintptr_t(0x401234), std::uintptr_t(0x7FFF0000) }) {
+		DynamicAsmPatchBuilder rebuilt(addr, MODE_X86);
+		AsmLabel skip = rebuilt.newLabel();
+		rebuilt.call(0x402000)
+			.jcc(CC_E, skip)
+			.mov(R32_EAX, 1)
+			.bind(skip)
+			.bytes(0x0F, 0x85).dword(static_cast<std::uint32_t>(0x401000 - (addr + 18)))
+			.bytes(0x68).dwordPatchAddress(0)
+			.jmp(0x403000);
+		std::vector<std::uint8_t> buffer(patchTemplate.size());
+		EXPECT_EQ(patchTemplate.instantiateInto(addr, buffer.data(), buffer.size()), buffer.size());
+		EXPECT_EQ(buffer, bytesOf(rebuilt));
+	}
+}
+
+TEST(AsmPatchTemplate, Errors)
+{
+	DynamicAsmPatchBuilder relaxed(0x401000, MODE_X86);
+	relaxed.jmp(relaxed.labelAt(0x401000)).relax();
+	EXPECT_THROW(relaxed.compileTemplate(), AsmPatchNotRelocatable);
+
+	DynamicAsmPatchBuilder small(0x401000, MODE_X86);
+	std::vector<std::uint8_t> buffer(16);
+	EXPECT_THROW(small.call(0x402000).compileTemplate().instantiateInto(0x500000, buffer.data(), 4), AsmPatchBufferTooSmall);
+
+#if UINTPTR_MAX > 0xFFFFFFFFu
+	// The absolute operand is beyond disp32 and reached rip relative
+	DynamicAsmPatchBuilder x64(0x100000001000ull, MODE_X64);
+	const AsmPatchTemplate x64Template = x64.call(0x100000402000ull).mov(R32_EAX, AsmMem::absolute(0x100000403000ull)).compileTemplate();
+	EXPECT_EQ(x64Template.getRelocations().size(), 2u);
+	EXPECT_NO_THROW(x64Template.instantiate(0x100070000000ull));
+	EXPECT_THROW(x64Template.instantiate(0x401000), AsmPatchRel32OutOfRange);
+	// Nothing is written before all targets are known to be in reach
+	std::vector<std::uint8_t> target(x64Template.size(), 0xCC);
+	EXPECT_THROW(x64Template.instantiateInto(0x401000, target.data(), target.size()), AsmPatchRel32OutOfRange);
+	EXPECT_EQ(target, std::vector<std::uint8_t>(x64Template.size(), 0xCC));
+#endif
+}
@@ -0,0 +1,129 @@
+// Built into its own test binary with ASMPATCH_ENABLE_HOOK_STATS=1, the macro has to be consistent in all
+// translation units of a program
+#include <gtest/gtest.h>
+#include <atomic>
+#include <cstdint>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+#include "AsmHookStats.h"
+#include "DynamicAsmPatchBuilder.h"
+#include "TestUtils.h"
+
+#if !ASMPATCH_ENABLE_HOOK_STATS
+#error HookStatsTests.cpp has to be built with ASMPATCH_ENABLE_HOOK_STATS=1
+#endif
+
+using namespace AsmPatch;
+using namespace AsmPatch::AsmConsts;
+
+namespace {
+	constexpr int ThreadCount = 4;
+	constexpr int CallsPerThread = 1000;
+
+	// Every instrumented patch registers a new hook, the latest one of that name is the one under test
+	AsmHookStats statsOf(const char* name)
+	{
+		const std::vector<AsmHookStats> all = getHookStats();
+		for (auto stats = all.rbegin(); stats != all.rend(); ++stats) {
+			if (stats->mName == name) {
+				return *stats;
+			}
+		}
+		ADD_FAILURE() << "No stats for " << name;
+		return {};
+	}
+
+	std::uint64_t histogramTotal(const AsmHookStats& stats)
+	{
+		return std::accumulate(stats.mHistogram.begin(), stats.mHistogram.end(), std::uint64_t(0));
+	}
+
+	template<typename Func>
+	void callFromThreads(Func func)
+	{
+		std::vector<std::thread> threads;
+		for (int thread = 0; thread < ThreadCount; thread++) {
+			threads.emplace_back([&func] {
+				for (int call = 0; call < CallsPerThread; call++) {
+					func();
+				}
+			});
+		}
+		for (std::thread& thread : threads) {
+			thread.join();
+		}
+	}
+}
+
+TEST(HookStats, MergesThreadCounters)
+{
+	std::atomic<int> sum{ 0 };
+	const auto hook = AsmBuilder::HookStats::Instrument([&sum](int x) { sum += x; }, "merged");
+	callFromThreads([&hook] { hook(1); });
+	hook(2);
+
+	const AsmHookStats stats = statsOf("merged");
+	EXPECT_EQ(sum.load(), ThreadCount * CallsPerThread + 2);
+	EXPECT_EQ(stats.mCalls, std::uint64_t(ThreadCount * CallsPerThread + 1));
+	EXPECT_EQ(histogramTotal(stats), stats.mCalls);
+
+	// Exited threads hand their counters on, the totals stay the same
+	callFromThreads([&hook] { hook(0); });
+	const AsmHookStats again = statsOf("merged");
+	EXPECT_EQ(again.mCalls, stats.mCalls + ThreadCount * CallsPerThread);
+	EXPECT_EQ(histogramTotal(again), again.mCalls);
+	EXPECT_GE(again.mTicks, stats.mTicks);
+}
+
+TEST(HookStats, BucketOf)
+{
+	EXPECT_EQ(AsmBuilder::HookStats::bucketOf(0), 0u);
+	EXPECT_EQ(AsmBuilder::HookStats::bucketOf(1), 1u);
+	EXPECT_EQ(AsmBuilder::HookStats::bucketOf(3), 2u);
+	EXPECT_EQ(AsmBuilder::HookStats::bucketOf(4), 3u);
+	EXPECT_EQ(AsmBuilder::HookStats::bucketOf(UINT64_MAX), AsmBuilder::HookStats::BucketCount - 1);
+}
+
+// The stubs are called directly from C++, see HookTests.cpp
+#if defined(__x86_64__) && !defined(_WIN32)
+namespace {
+	std::atomic<int> gInstrumentedSum{ 0 };
+
+	void instrumentedTarget()
+	{
+		gInstrumentedSum++;
+	}
+}
+
+TEST(HookStats, InstrumentedPatches)
+{
+	gInstrumentedSum = 0;
+	AsmPatchTests::ExecutableStub lambdaStub;
+	DynamicAsmPatchBuilder lambdaCode(lambdaStub.address(), MODE_HOST);
+	// The plain call does not align the stack for the thunk
+	lambdaCode.bytes(0x48, 0x83, 0xEC, 0x08)          // sub rsp, 8
+		.callLambdaInstrumented<AsmBuilder::LambdaPayloadInjector::CallingConvention::CDeclCall>("lambda-hook", [](int x) { gInstrumentedSum += x; })
+		.bytes(0x48, 0x83, 0xC4, 0x08)                  // add rsp, 8
+		.ret();
+	lambdaStub.write(lambdaCode.compile());
+
+	AsmPatchTests::ExecutableStub safeCallStub;
+	DynamicAsmPatchBuilder safeCallCode(safeCallStub.address(), MODE_HOST);
+	safeCallCode.safeCallInstrumented("safecall-hook", reinterpret_cast<void*>(&instrumentedTarget)).ret();
+	safeCallStub.write(safeCallCode.compile());
+
+	callFromThreads([&] {
+		lambdaStub.as<void (*)(int)>()(2);
+		safeCallStub.as<void (*)()>()();
+	});
+	EXPECT_EQ(gInstrumentedSum.load(), 3 * ThreadCount * CallsPerThread);
+
+	for (const char* name : { "lambda-hook", "safecall-hook" }) {
+		const AsmHookStats stats = statsOf(name);
+		EXPECT_EQ(stats.mCalls, std::uint64_t(ThreadCount * CallsPerThread)) << name;
+		EXPECT_EQ(histogramTotal(stats), stats.mCalls) << name;
+	}
+}
+#endif
@@ -0,0 +1,373 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "AsmClosureOwner.h"
+#include "AsmHookMultiplexer.h"
+#include "AsmHookStats.h"
+#include "AsmHotSwapHook.h"
+#include "AsmPerfMap.h"
+#include "DynamicAsmPatchBuilder.h"
+#include "TestUtils.h"
+#include "details/MemoryUtils.h"
+
+using namespace AsmPatch;
+using namespace AsmPatch::AsmConsts;
+
+namespace {
+	int gHookStatsSink = 0;
+}
+
+TEST(AsmHotSwapHook, Replace)
+{
+	int seen = 0;
+	AsmHotSwapHook<int(int)> hook([&seen](int x) { seen = x; return x + 1; });
+	EXPECT_EQ(hook(1), 2);
+	hook.replace([&seen](int x) { seen = -x; return x * 2; });
+	EXPECT_EQ(hook.caller()(3), 6);
+	EXPECT_EQ(seen, -3);
+}
+
+namespace {
+	// Payload whose destructor poisons its state. The state outlives the payload, so a call still
+	// running when its payload is destroyed sees the poison even if the memory was reused.
+	class PoisonedPayload
+	{
+		std::atomic<bool>* mAlive;
+		int mDelta;
+
+	public:
+		PoisonedPayload(std::atomic<bool>& alive, int delta) :
+			mAlive(&alive),
+			mDelta(delta)
+		{
+			alive = true;
+		}
+
+		PoisonedPayload(PoisonedPayload&& other) :
+			mAlive(std::exchange(other.mAlive, nullptr)),
+			mDelta(other.mDelta)
+		{}
+
+		~PoisonedPayload()
+		{
+			if (mAlive) {
+				mAlive->store(false);
+			}
+		}
+
+		// Yields inside the call, so replace() runs while callers are still in the old payload
+		int operator()(int x) const
+		{
+			std::atomic<bool>* alive = mAlive;
+			const int result = x + mDelta;
+			std::this_thread::yield();
+			return alive->load() ? result : -1;
+		}
+	};
+}
+
+TEST(AsmHotSwapHook, ReplaceWhileCalled)
+{
+	constexpr int Replacements = 2000;
+	std::vector<std::atomic<bool>> alive(Replacements + 1);
+	AsmHotSwapHook<int(int)> hook(PoisonedPayload(alive[0], 0));
+	std::atomic<bool> stop{ false };
+	std::atomic<long> calls{ 0 };
+	std::atomic<long> poisoned{ 0 };
+
+	std::vector<std::thread> callers;
+	for (int i = 0; i < 3; i++) {
+		callers.emplace_back([&] {
+			const auto caller = hook.caller();
+			while (!stop.load()) {
+				if (caller(0) < 0) {
+					poisoned++;
+				}
+				calls++;
+			}
+		});
+	}
+	while (calls.load() == 0) {
+		std::this_thread::yield();
+	}
+	for (int i = 1; i <= Replacements; i++) {
+		hook.replace(PoisonedPayload(alive[i], i));
+	}
+	stop = true;
+	for (std::thread& caller : callers) {
+		caller.join();
+	}
+	EXPECT_EQ(poisoned.load(), 0);
+	EXPECT_EQ(hook(0), Replacements);
+}
+
+TEST(AsmHookMultiplexer, AddAndRemove)
+{
+	AsmHookMultiplexer<void(int)> mux;
+	std::vector<int> calls;
+	const auto first = mux.add([&calls](int x) { calls.push_back(x); });
+	mux.add([&calls](int x) { calls.push_back(x * 10); });
+	EXPECT_EQ(mux.size(), 2u);
+	mux(1);
+	EXPECT_TRUE(mux.remove(first));
+	EXPECT_FALSE(mux.remove(first));
+	mux.caller()(2);
+	EXPECT_EQ(calls, (std::vector<int>{ 1, 10, 20 }));
+}
+
+TEST(AsmHookMultiplexer, ConcurrentCalls)
+{
+	AsmHookMultiplexer<void(int)> mux;
+	std::atomic<long> sum{ 0 };
+	std::atomic<bool> stop{ false };
+	mux.add([&sum](int x) { sum += x; });
+
+	std::vector<std::thread> callers;
+	for (int i = 0; i < 2; i++) {
+		callers.emplace_back([&] {
+			while (!stop.load()) {
+				mux(1);
+			}
+		});
+	}
+	// Make sure the callers are running before the table changes
+	while (sum.load() == 0) {
+		std::this_thread::yield();
+	}
+	for (int i = 0; i < 200; i++) {
+		mux.remove(mux.add([&sum](int x) { sum += x; }));
+	}
+	stop = true;
+	for (std::thread& caller : callers) {
+		caller.join();
+	}
+	EXPECT_EQ(mux.size(), 1u);
+	EXPECT_GT(sum.load(), 0);
+}
+
+// Patch sites are reached from inside a function, the stubs below are called directly from C++ instead.
+// They save LIVE_NONE, which on x86-64 still aligns the stack for the lambda.
+#if defined(__x86_64__) && !defined(_WIN32)
+namespace {
+	int gStatelessValue = 0;
+}
+
+TEST(CallLambda, Stateless)
+{
+	AsmPatchTests::ExecutableStub stub;
+	DynamicAsmPatchBuilder code(stub.address(), MODE_HOST);
+	code.callLambdaCdecl<LIVE_NONE>([](int x) { gStatelessValue += x; }).ret();
+	stub.write(code.compile());
+
+	stub.as<void (*)(int)>()(5);
+	stub.as<void (*)(int)>()(6);
+	EXPECT_EQ(gStatelessValue, 11);
+}
+
+TEST(CallLambda, StackArgumentsX64)
+{
+	using AsmBuilder::LambdaPayloadInjector::CallingConvention;
+	using AsmBuilder::LambdaPayloadInjector::TakesStackArgs;
+	auto sixInts = [](int, int, int, int, int, int) {};
+	auto sevenInts = [](int, int, int, int, int, int, int) {};
+	auto nineDoubles = [](double, double, double, double, double, double, double, double, double) {};
+	auto longDouble = [](long double) {};
+	static_assert(!TakesStackArgs<CallingConvention::CDeclCall, decltype(sixInts)>);
+	static_assert(TakesStackArgs<CallingConvention::CDeclCall, decltype(sevenInts)>);
+	static_assert(TakesStackArgs<CallingConvention::StdCall, decltype(nineDoubles)>);
+	static_assert(TakesStackArgs<CallingConvention::CDeclCall, decltype(longDouble)>);
+}
+
+TEST(CallLambda, Capturing)
+{
+	int product = 0;
+	AsmPatchTests::ExecutableStub stub;
+	DynamicAsmPatchBuilder code(stub.address(), MODE_HOST);
+	code.callLambdaStdcall<LIVE_NONE>([&product](int a, int b) { product = a * b; }).ret();
+	stub.write(code.compile());
+
+	stub.as<void (*)(int, int)>()(6, 7);
+	EXPECT_EQ(product, 42);
+}
+
+TEST(ClosureThunk, OwnerReleasesClosures)
+{
+	int sum = 0;
+	// Only the closure keeps its token alive, the lambda is copied on the way into it
+	std::weak_ptr<int> closureToken;
+	auto create = [&] {
+		auto token = std::make_shared<int>();
+		closureToken = token;
+		return AsmBuilder::LambdaPayloadInjector::CreateFuncPtrFromLambda<AsmBuilder::LambdaPayloadInjector::CallingConvention::CDeclCall>(
+			[&sum, token](int x) { sum += x; });
+	};
+
+	AsmClosureOwner owner;
+	void (*first)(int) = nullptr;
+	{
+		AsmClosureScope scope(owner);
+		first = create();
+	}
+	first(5);
+	EXPECT_EQ(sum, 5);
+	EXPECT_FALSE(closureToken.expired());
+	owner.release();
+	EXPECT_TRUE(closureToken.expired());
+
+	// The released thunk is reused by the next one of the same size
+	{
+		AsmClosureScope scope(owner);
+		EXPECT_EQ(create(), first);
+	}
+	first(2);
+	EXPECT_EQ(sum, 7);
+	owner.release();
+	EXPECT_TRUE(closureToken.expired());
+
+	// Created without a scope, so never released
+	create();
+	owner.release();
+	EXPECT_FALSE(closureToken.expired());
+}
+
+TEST(ClosureThunk, ExecutableNearCodeAndNotWritable)
+{
+	int sum = 0;
+	auto thunk = reinterpret_cast<std::uintptr_t>(AsmBuilder::LambdaPayloadInjector::CreateFuncPtrFromLambda<AsmBuilder::LambdaPayloadInjector::CallingConvention::CDeclCall>(
+		[&sum](int x) { sum += x; }));
+
+	std::vector<AsmBuilder::MemoryUtils::MappedRegion> regions;
+	ASSERT_TRUE(AsmBuilder::MemoryUtils::ProtectionMap().split(thunk, thunk + 1, regions));
+	EXPECT_EQ(regions[0].mProt, PROT_READ | PROT_EXEC);
+
+	// Within rel32 reach of the code, so static builders can call it
+	const std::uintptr_t code = reinterpret_cast<std::uintptr_t>(&AsmBuilder::ExecutableMemory::flushInstructionCache);
+	EXPECT_LT(thunk > code ? thunk - code : code - thunk, std::uintptr_t(0x7FFFFFFF));
+	EXPECT_NO_THROW(Patch(code).callLambdaStdcall([&sum](int x) { sum += x; }));
+}
+
+TEST(CallLambda, HotSwapAndMultiplexer)
+{
+	int swapped = 0;
+	AsmHotSwapHook<void(int)> hook([&swapped](int x) { swapped = x; });
+	AsmHookMultiplexer<void(int)> mux;
+	int multiplexed = 0;
+	mux.add([&multiplexed](int x) { multiplexed += x; });
+	mux.add([&multiplexed](int x) { multiplexed += x; });
+
+	AsmPatchTests::ExecutableStub stub;
+	DynamicAsmPatchBuilder code(stub.address(), MODE_HOST);
+	code.callLambdaCdecl<LIVE_RDI>(hook.caller()).callLambdaCdecl<LIVE_NONE>(mux.caller()).ret();
+	stub.write(code.compile());
+
+	stub.as<void (*)(int)>()(3);
+	EXPECT_EQ(swapped, 3);
+	EXPECT_EQ(multiplexed, 6);
+	hook.replace([&swapped](int x) { swapped = -x; });
+	stub.as<void (*)(int)>()(4);
+	EXPECT_EQ(swapped, -4);
+	EXPECT_EQ(multiplexed, 14);
+}
+#endif
+
+namespace {
+	void plainTarget()
+	{
+	}
+}
+
+// This binary is built without ASMPATCH_ENABLE_HOOK_STATS, see HookStatsTests.cpp for the enabled build
+TEST(HookStats, DisabledEmitsPlainCalls)
+{
+	// Stateless, so both builders call the same dispatcher. Sites next to the code keep rel32 reachable.
+	const auto hook = [](int x) { gHookStatsSink += x; };
+	void* const target = reinterpret_cast<void*>(&plainTarget);
+	const std::uintptr_t site = reinterpret_cast<std::uintptr_t>(target);
+	EXPECT_EQ(AsmPatchTests::bytesOf(Patch(site).callLambdaInstrumented("plain", hook)),
+		AsmPatchTests::bytesOf(Patch(site).callLambdaStdcall(hook)));
+	EXPECT_EQ(AsmPatchTests::bytesOf(Patch(site).safeCallInstrumented("plain", target)),
+		AsmPatchTests::bytesOf(Patch(site).safeCall(target)));
+
+	DynamicAsmPatchBuilder instrumented(site, MODE_HOST);
+	instrumented.callLambdaInstrumented("plain", hook).safeCallInstrumented("plain", target);
+	DynamicAsmPatchBuilder plain(site, MODE_HOST);
+	plain.callLambdaStdcall(hook).safeCall(target);
+	EXPECT_EQ(AsmPatchTests::bytesOf(instrumented), AsmPatchTests::bytesOf(plain));
+	EXPECT_TRUE(getHookStats().empty());
+}
+
+TEST(AsmPerfMapScope, Nesting)
+{
+	EXPECT_EQ(AsmBuilder::PerfMap::currentName(), nullptr);
+	{
+		AsmPerfMapScope outer("outer");
+		{
+			AsmPerfMapScope inner("inner");
+			EXPECT_STREQ(AsmBuilder::PerfMap::currentName(), "inner");
+		}
+		EXPECT_STREQ(AsmBuilder::PerfMap::currentName(), "outer");
+	}
+	EXPECT_EQ(AsmBuilder::PerfMap::currentName(), nullptr);
+}
+
+#if defined(__linux__)
+TEST(PerfMapWriter, WritesMapAndJitdump)
+{
+	char directory[] = "/tmp/asmpatch-perfXXXXXX";
+	ASSERT_NE(mkdtemp(directory), nullptr);
+	auto readFile = [](const std::string& path) {
+		std::ifstream file(path, std::ios::binary);
+		return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	};
+
+	static const std::uint8_t code[] = { 0x90, 0xC3 };
+	static const std::uint8_t thunk[16] = {};
+	std::string mapPath;
+	std::string dumpPath;
+	{
+		AsmBuilder::PerfMap::Writer writer(directory, true);
+		mapPath = writer.mapPath();
+		dumpPath = writer.dumpPath();
+		writer.record(reinterpret_cast<std::uintptr_t>(code), sizeof(code), "stub", "onDamage");
+		writer.record(0x1000, 0, "stub", "empty");
+		// Buffered until flushed
+		EXPECT_EQ(readFile(mapPath), "");
+		writer.flush();
+		char expected[64];
+		std::snprintf(expected, sizeof(expected), "%llx 2 onDamage [stub]\n", static_cast<unsigned long long>(reinterpret_cast<std::uintptr_t>(code)));
+		EXPECT_EQ(readFile(mapPath), expected);
+		// Written on destruction
+		writer.record(reinterpret_cast<std::uintptr_t>(thunk), sizeof(thunk), "thunk", nullptr);
+	}
+	const std::string map = readFile(mapPath);
+	EXPECT_NE(map.find(" 10 asmpatch [thunk]\n"), std::string::npos);
+
+	// Header (40 bytes), then the code load records: 56 bytes, the name and the code
+	const std::string dump = readFile(dumpPath);
+	ASSERT_EQ(dump.size(), 40u + 56 + 16 + 2 + 56 + 17 + 16);
+	std::uint32_t magic;
+	std::uint32_t recordSize;
+	std::uint64_t codeAddr;
+	std::memcpy(&magic, dump.data(), sizeof(magic));
+	std::memcpy(&recordSize, dump.data() + 44, sizeof(recordSize));
+	std::memcpy(&codeAddr, dump.data() + 40 + 32, sizeof(codeAddr));
+	EXPECT_EQ(magic, 0x4A695444u);
+	EXPECT_EQ(recordSize, 56u + 16 + 2);
+	EXPECT_EQ(codeAddr, reinterpret_cast<std::uintptr_t>(code));
+	EXPECT_STREQ(dump.data() + 40 + 56, "onDamage [stub]");
+	EXPECT_EQ(std::memcmp(dump.data() + 40 + 56 + 16, code, sizeof(code)), 0);
+
+	std::remove(mapPath.c_str());
+	std::remove(dumpPath.c_str());
+	rmdir(directory);
+}
+#endif
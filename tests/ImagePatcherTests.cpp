@@ -0,0 +1,114 @@
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include "AsmImagePatcher.h"
+#include "TestUtils.h"
+
+#include <sys/wait.h>
+
+using namespace AsmPatch;
+using AsmPatchTests::hex;
+
+namespace {
+
+// Copy of the fixture executable which the test may patch and run
+class FixtureCopy
+{
+	std::string mPath;
+
+public:
+	FixtureCopy()
+	{
+		char path[] = "/tmp/AsmPatchElfFixtureXXXXXX";
+		const int fd = mkstemp(path);
+		if (fd < 0) {
+			std::abort();
+		}
+		::close(fd);
+		mPath = path;
+		std::ifstream source(ASMPATCH_ELF_FIXTURE, std::ios::binary);
+		std::ofstream target(mPath, std::ios::binary | std::ios::trunc);
+		target << source.rdbuf();
+		target.close();
+		chmod(mPath.c_str(), 0700);
+	}
+
+	~FixtureCopy()
+	{
+		std::remove(mPath.c_str());
+	}
+
+	const char* path() const
+	{
+		return mPath.c_str();
+	}
+
+	int run(const char* argument = "") const
+	{
+		const int status = std::system((mPath + " " + argument).c_str());
+		return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+	}
+
+	// Address of fixtureValue() as printed by the fixture itself
+	std::uint64_t functionAddress() const
+	{
+		FILE* output = popen((mPath + " address").c_str(), "r");
+		if (!output) {
+			return 0;
+		}
+		unsigned long long address = 0;
+		if (std::fscanf(output, "%llx", &address) != 1) {
+			address = 0;
+		}
+		pclose(output);
+		return address;
+	}
+};
+
+}
+
+TEST(AsmImagePatcher, PatchesElfOnDisk)
+{
+	FixtureCopy fixture;
+	ASSERT_EQ(fixture.run(), 42);
+	const std::uint64_t address = fixture.functionAddress();
+	ASSERT_NE(address, 0u);
+
+	{
+		AsmImagePatcher patcher(fixture.path());
+		EXPECT_EQ(patcher.getFormat(), sizeof(void*) == 8 ? IMAGE_ELF64 : IMAGE_ELF32);
+		EXPECT_EQ(patcher.getMode(), AsmConsts::MODE_HOST);
+
+		// mov eax, 7; ret
+		const std::uint8_t* original = patcher.data() + patcher.fileOffset(address, 6);
+		AsmPatchData patch(static_cast<std::uintptr_t>(address), hex("B8 07 00 00 00 C3"));
+		patch.expect(original, nullptr, 6);
+		const AsmImageApplyStats stats = patcher.apply(patch);
+		EXPECT_EQ(stats.mBytesWritten, 6u);
+		EXPECT_GE(stats.mPagesWritten, 1u);
+		EXPECT_LE(stats.mPagesWritten, 2u);
+
+		// The bytes on disk are no longer the expected ones
+		EXPECT_THROW(patcher.apply(patch), AsmPatchExpectationFailed);
+	}
+
+	EXPECT_EQ(fixture.run(), 7);
+}
+
+TEST(AsmImagePatcher, Errors)
+{
+	FixtureCopy fixture;
+	AsmImagePatcher patcher(fixture.path());
+	EXPECT_THROW(patcher.fileOffset(0x10, 1), AsmPatchImageUnmapped);
+	EXPECT_THROW(patcher.apply(AsmPatchData(0x10, hex("90"))), AsmPatchImageUnmapped);
+
+	EXPECT_THROW(AsmImagePatcher("/nonexistent/AsmPatchElfFixture"), AsmPatchImageIOFailed);
+	char path[] = "/tmp/AsmPatchInvalidXXXXXX";
+	const int fd = mkstemp(path);
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(write(fd, "not an image", 12), 12);
+	::close(fd);
+	EXPECT_THROW(AsmImagePatcher invalid(path), AsmPatchImageInvalid);
+	std::remove(path);
+}
@@ -0,0 +1,247 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include "AsmPatchApplier.h"
+#include "TestUtils.h"
+
+#if defined(__x86_64__)
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <sys/prctl.h>
+#endif
+
+using namespace AsmPatch;
+using AsmPatchTests::bytesOf;
+using AsmPatchTests::hex;
+
+TEST(AsmPatchData, ExpectPattern)
+{
+	AsmPatchData patch(0x401000, hex("90"));
+	patch.expect("E8 ?? ?? ?? ?? 8? ?0");
+	EXPECT_EQ(patch.getExpected(), hex("E8 00 00 00 00 80 00"));
+	EXPECT_EQ(patch.getExpectedMask(), hex("FF 00 00 00 00 F0 0F"));
+	EXPECT_TRUE(patch.hasExpectation());
+
+	EXPECT_THROW(patch.expect("E8 G0"), AsmPatchInvalidExpectation);
+	EXPECT_THROW(patch.expect("E80"), AsmPatchInvalidExpectation);
+}
+
+TEST(AsmPatchVerifier, Image)
+{
+	const std::vector<std::uint8_t> image = hex("55 89 E5 E8 10 20 30 40 C3");
+	AsmPatchSet set;
+	set.add(AsmPatchData(0x401003, hex("90 90 90 90 90")).expect("E8 ?? ?? ?? ??"));
+	set.add(AsmPatchData(0x401000, hex("C3")).expect("56"));
+	set.add(AsmPatchData(0x401008, hex("90")).expect("C3 CC"));
+
+	AsmPatchVerifier verifier;
+	const std::vector<AsmPatchMismatch> mismatches = verifier.verify(set, image.data(), image.size(), 0x401000);
+	ASSERT_EQ(mismatches.size(), 2u);
+	EXPECT_EQ(mismatches[0].mAddress, 0x401000u);
+	EXPECT_EQ(mismatches[0].mOffset, 0u);
+	EXPECT_EQ(mismatches[0].mExpected, 0x56);
+	EXPECT_EQ(mismatches[0].mActual, 0x55);
+	EXPECT_FALSE(mismatches[0].mOutsideImage);
+	EXPECT_EQ(mismatches[1].mAddress, 0x401008u);
+	EXPECT_TRUE(mismatches[1].mOutsideImage);
+}
+
+TEST(AsmPatchSet, Overlap)
+{
+	AsmPatchSet set;
+	set.add(AsmPatchData(0x401000, hex("90 90 90 90")));
+	EXPECT_THROW(set.add(AsmPatchData(0x401003, hex("90"))), AsmPatchOverlap);
+	EXPECT_THROW(set.add(AsmPatchData(0x400FFF, hex("90 90"))), AsmPatchOverlap);
+	set.add(AsmPatchData(0x401004, hex("90")));
+	EXPECT_EQ(set.size(), 2u);
+	EXPECT_TRUE(set.remove(0x401004));
+	EXPECT_FALSE(set.remove(0x401004));
+}
+
+TEST(AsmPatchSet, Layout)
+{
+	AsmPatchSet set(0x1000);
+	set.add(AsmPatchData(0x401FFE, hex("01 02")));
+	set.add(AsmPatchData(0x402000, hex("03")));
+	set.add(AsmPatchData(0x405000, hex("04")));
+
+	const AsmPatchLayout layout = set.getLayout();
+	ASSERT_EQ(layout.mRuns.size(), 2u);
+	EXPECT_EQ(layout.mRuns[0].getAddress(), 0x401FFEu);
+	EXPECT_EQ(bytesOf(layout.mRuns[0]), hex("01 02 03"));
+	ASSERT_EQ(layout.mPageRanges.size(), 2u);
+	EXPECT_EQ(layout.mPageRanges[0].mBegin, 0x401000u);
+	EXPECT_EQ(layout.mPageRanges[0].mEnd, 0x403000u);
+	EXPECT_EQ(layout.pageCount(0x1000), 3u);
+	EXPECT_EQ(set.getPages(), (std::vector<std::uintptr_t>{ 0x401000, 0x402000, 0x405000 }));
+}
+
+TEST(AsmPatchApplier, ApplyAndRevert)
+{
+	AsmPatchTests::ExecutableStub page;
+	page.write(AsmPatchData(page.address(), hex("55 89 E5 5D C3")));
+	const std::uint8_t* code = page.as<const std::uint8_t*>();
+
+	AsmPatchSet set;
+	set.add(AsmPatchData(page.address(), hex("C3")).expect("55"));
+	set.add(AsmPatchData(page.address() + 3, hex("90")).expect("5D C3"));
+
+	AsmPatchApplier applier;
+	const AsmPatchUndoLog log = applier.apply(set);
+	EXPECT_EQ(std::vector<std::uint8_t>(code, code + 5), hex("C3 89 E5 90 C3"));
+
+	// The expectations fail on the patched bytes, nothing is written
+	EXPECT_THROW(applier.apply(set), AsmPatchExpectationFailed);
+
+	applier.revert(log);
+	EXPECT_EQ(std::vector<std::uint8_t>(code, code + 5), hex("55 89 E5 5D C3"));
+}
+
+TEST(AsmPatchApplier, Reapply)
+{
+	AsmPatchTests::ExecutableStub first;
+	AsmPatchTests::ExecutableStub second;
+	first.write(AsmPatchData(first.address(), hex("55 89 E5 5D C3")));
+	second.write(AsmPatchData(second.address(), hex("90 90 90 90 C3")));
+	const std::uint8_t* a = first.as<const std::uint8_t*>();
+	const std::uint8_t* b = second.as<const std::uint8_t*>();
+
+	AsmPatchSet previous;
+	previous.add(AsmPatchData(first.address(), hex("C3")).expect("55"));
+	previous.add(AsmPatchData(first.address() + 3, hex("90")));
+	previous.add(AsmPatchData(second.address(), hex("CC CC")));
+	AsmPatchApplier applier;
+	const AsmPatchUndoLog previousLog = applier.apply(previous);
+
+	// Expectations are checked against the original bytes
+	AsmPatchSet wrong;
+	wrong.add(AsmPatchData(first.address(), hex("C3")).expect("C3"));
+	EXPECT_THROW(applier.reapply(previousLog, wrong), AsmPatchExpectationFailed);
+
+	AsmPatchSet next;
+	next.add(AsmPatchData(first.address(), hex("C3")).expect("55"));
+	next.add(AsmPatchData(first.address() + 1, hex("31 C0")));
+	next.add(AsmPatchData(second.address(), hex("CC CC")));
+	const AsmPatchUndoLog log = applier.reapply(previousLog, next);
+	EXPECT_EQ(std::vector<std::uint8_t>(a, a + 5), hex("C3 31 C0 5D C3"));
+	EXPECT_EQ(std::vector<std::uint8_t>(b, b + 5), hex("CC CC 90 90 C3"));
+
+	// 31 C0 and the restored 5D are written, the second page is left alone
+	const AsmPatchReapplyStats& stats = applier.getLastReapplyStats();
+	EXPECT_EQ(stats.mBytesWritten, 3u);
+	EXPECT_EQ(stats.mBytesSkipped, 3u);
+	EXPECT_EQ(stats.mPagesWritten, 1u);
+	EXPECT_EQ(stats.mPagesSkipped, 1u);
+
+	const AsmPatchUndoLog unchanged = applier.reapply(log, next);
+	EXPECT_EQ(applier.getLastReapplyStats().mBytesWritten, 0u);
+	EXPECT_EQ(applier.getLastReapplyStats().mPagesWritten, 0u);
+
+	applier.revert(unchanged);
+	EXPECT_EQ(std::vector<std::uint8_t>(a, a + 5), hex("55 89 E5 5D C3"));
+	EXPECT_EQ(std::vector<std::uint8_t>(b, b + 5), hex("90 90 90 90 C3"));
+}
+
+#if defined(__x86_64__)
+// Threads keep calling two functions while their first instruction is replaced back and forth:
+// mov rax, imm64 (10 bytes, crossing a word, staged) and mov eax, imm32 (5 bytes, one atomic store)
+TEST(AsmPatchApplier, LiveStress)
+{
+	AsmPatchTests::ExecutableStub page;
+	const std::uintptr_t wide = page.address();
+	const std::uintptr_t narrow = page.address() + 16;
+	AsmPatchSet original;
+	original.add(AsmPatchData(wide, hex("48 B8 01 00 00 00 00 00 00 00 C3")));
+	original.add(AsmPatchData(narrow, hex("B8 01 00 00 00 C3")));
+	for (const auto& entry : original.getPatches()) {
+		std::memcpy(reinterpret_cast<void*>(entry.first), entry.second.getData().data(), entry.second.getData().size());
+	}
+
+	AsmPatchSet patched;
+	patched.add(AsmPatchData(wide, hex("48 B8 02 00 00 00 00 00 00 00")));
+	patched.add(AsmPatchData(narrow, hex("B8 02 00 00 00")));
+
+	std::atomic<bool> stop{ false };
+	std::atomic<int> bad{ 0 };
+	std::atomic<long> calls{ 0 };
+	std::vector<std::thread> threads;
+	for (int i = 0; i < 4; i++) {
+		threads.emplace_back([&] {
+			auto wideFunc = reinterpret_cast<std::uint64_t (*)()>(wide);
+			auto narrowFunc = reinterpret_cast<std::uint32_t (*)()>(narrow);
+			while (!stop.load(std::memory_order_relaxed)) {
+				const std::uint64_t a = wideFunc();
+				const std::uint32_t b = narrowFunc();
+				if ((a != 1 && a != 2) || (b != 1 && b != 2)) {
+					bad++;
+				}
+				calls.fetch_add(1, std::memory_order_relaxed);
+			}
+		});
+	}
+	while (calls.load() == 0) {
+		std::this_thread::yield();
+	}
+
+	AsmPatchApplier applier(AsmPatchWriteMode::Live);
+	for (int i = 0; i < 500; i++) {
+		applier.revert(applier.apply(patched));
+	}
+	stop = true;
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+	EXPECT_EQ(bad.load(), 0);
+	EXPECT_EQ(reinterpret_cast<std::uint64_t (*)()>(wide)(), 1u);
+}
+
+namespace {
+	// Exit code of the child process, 0 on success
+	int applyWithoutMembarrier()
+	{
+		AsmPatchTests::ExecutableStub page;
+		page.write(AsmPatchData(page.address(), hex("48 B8 01 00 00 00 00 00 00 00 C3")));
+
+		sock_filter filter[] = {
+			BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(seccomp_data, nr)),
+			BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_membarrier, 0, 1),
+			BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | ENOSYS),
+			BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+		};
+		sock_fprog program = { sizeof(filter) / sizeof(filter[0]), filter };
+		if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0 || prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &program) != 0) {
+			return 2;
+		}
+
+		AsmPatchApplier applier(AsmPatchWriteMode::Live);
+		// Single stores need no serialization
+		applier.apply(AsmPatchData(page.address() + 2, hex("02")));
+		try {
+			applier.apply(AsmPatchData(page.address(), hex("48 B8 03 00 00 00 00 00 00 00")));
+		}
+		catch (const AsmPatchLiveUnsupported&) {
+			return reinterpret_cast<std::uint64_t (*)()>(page.address())() == 2 ? 0 : 3;
+		}
+		return 1;
+	}
+}
+
+// A kernel without membarrier, emulated with a seccomp filter in a child process
+TEST(AsmPatchApplier, LiveWithoutMembarrier)
+{
+	EXPECT_EXIT(std::_Exit(applyWithoutMembarrier()), ::testing::ExitedWithCode(0), "");
+}
+
+TEST(AsmPatchApplier, LiveRejectsCacheLineEnd)
+{
+	AsmPatchTests::ExecutableStub page;
+	AsmPatchApplier applier(AsmPatchWriteMode::Live);
+	EXPECT_THROW(applier.apply(AsmPatchData(page.address() + 63, hex("90 90"))), AsmPatchNotLivePatchable);
+	EXPECT_NO_THROW(applier.apply(AsmPatchData(page.address() + 62, hex("90 90"))));
+}
+#endif
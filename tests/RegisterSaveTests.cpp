@@ -0,0 +1,137 @@
+#include <gtest/gtest.h>
+#include "DynamicAsmPatchBuilder.h"
+#include "TestUtils.h"
+
+using namespace AsmPatch;
+using namespace AsmPatch::AsmConsts;
+using AsmPatchTests::bytesOf;
+using AsmPatchTests::hex;
+
+TEST(RegisterSaves, LiveX86)
+{
+	EXPECT_EQ(bytesOf(Patch(0x401000).safeCall<LIVE_NONE, MODE_X86>(0x402000)), hex("E8 FB 0F 00 00"));
+	// ebx is callee saved and survives the call on its own
+	EXPECT_EQ(bytesOf(Patch(0x401000).safeCall<LIVE_EBX, MODE_X86>(0x402000)), hex("E8 FB 0F 00 00"));
+	EXPECT_EQ(bytesOf(Patch(0x401000).safeCall<LIVE_EAX | LIVE_FLAGS, MODE_X86>(0x402000)), hex("9C 50 E8 F9 0F 00 00 58 9D"));
+	EXPECT_EQ(bytesOf(Patch(0x401000).safeCall<LIVE_GPRS | LIVE_FLAGS, MODE_X86>(0x402000)), hex("9C 60 E8 F9 0F 00 00 61 9D"));
+	EXPECT_EQ(bytesOf(Patch(0x401000).safeCall<LIVE_SSE, MODE_X86>(0x402000)), hex(
+		"55 89 E5 83 E4 F0 81 EC 00 02 00 00 0F AE 04 24 "
+		"E8 EB 0F 00 00 "
+		"0F AE 0C 24 89 EC 5D"));
+}
+
+#if !defined(_WIN32)
+// The red zone below rsp is skipped first and restored last
+TEST(RegisterSaves, LiveX64)
+{
+	EXPECT_EQ(bytesOf(Patch(0x401000).safeCall<LIVE_NONE, MODE_X64>(0x402000)), hex(
+		"48 8D 64 24 80 53 48 89 E3 48 83 E4 F0 "
+		"E8 EE 0F 00 00 "
+		"48 89 DC 5B 48 8D A4 24 80 00 00 00"));
+	EXPECT_EQ(bytesOf(Patch(0x401000).safeCall<LIVE_SSE, MODE_X64>(0x402000)), hex(
+		"48 8D 64 24 80 53 48 89 E3 48 83 E4 F0 48 81 EC 00 02 00 00 48 0F AE 04 24 "
+		"E8 E2 0F 00 00 "
+		"48 0F AE 0C 24 48 89 DC 5B 48 8D A4 24 80 00 00 00"));
+}
+
+TEST(RegisterSaves, ContextX64)
+{
+	namespace RegisterSaves = AsmBuilder::RegisterSaves;
+	auto toVector = [](const auto& bytes) { return std::vector<std::uint8_t>(bytes.begin(), bytes.end()); };
+
+	// The context itself is pushed below the red zone as well
+	EXPECT_EQ(toVector(RegisterSaves::contextPrologue<LIVE_RSI, LIVE_NONE, true>()), hex("48 8D 64 24 80 56 53 48 89 E3 48 83 E4 F0 48 8D 7B 08"));
+	EXPECT_EQ(toVector(RegisterSaves::contextEpilogue<LIVE_RSI, LIVE_NONE, LIVE_NONE, true>()), hex("48 89 DC 5B 5E 48 8D A4 24 80 00 00 00"));
+}
+#endif
+
+TEST(RegisterSaves, DynamicMatchesStatic)
+{
+	DynamicAsmPatchBuilder x86(0x401000, MODE_X86);
+	x86.safeCall<LIVE_ALL>(0x402000);
+	EXPECT_EQ(bytesOf(x86), bytesOf(Patch(0x401000).safeCall<LIVE_ALL, MODE_X86>(0x402000)));
+
+	DynamicAsmPatchBuilder x64(0x401000, MODE_X64);
+	x64.safeCall<LIVE_ALL>(0x402000);
+	EXPECT_EQ(bytesOf(x64), bytesOf(Patch(0x401000).safeCall<LIVE_ALL, MODE_X64>(0x402000)));
+}
+
+TEST(RegisterSaves, ContextX86)
+{
+	namespace RegisterSaves = AsmBuilder::RegisterSaves;
+	auto toVector = [](const auto& bytes) { return std::vector<std::uint8_t>(bytes.begin(), bytes.end()); };
+
+	EXPECT_EQ(toVector(RegisterSaves::contextPrologue<LIVE_EAX | LIVE_FLAGS, LIVE_NONE, false>()), hex("9C 50 89 E1"));
+	EXPECT_EQ(toVector(RegisterSaves::contextEpilogue<LIVE_EAX | LIVE_FLAGS, LIVE_NONE, LIVE_NONE, false>()), hex("58 9D"));
+	EXPECT_EQ(toVector(RegisterSaves::contextPrologue<LIVE_EBX | LIVE_ESI, LIVE_NONE, false>()), hex("53 56 89 E1"));
+	// Unwritten callee saved registers are skipped
+	EXPECT_EQ(toVector(RegisterSaves::contextEpilogue<LIVE_EBX | LIVE_ESI, LIVE_NONE, LIVE_NONE, false>()), hex("8D 64 24 08"));
+	EXPECT_EQ(toVector(RegisterSaves::contextEpilogue<LIVE_EBX | LIVE_ESI, LIVE_ESI, LIVE_NONE, false>()), hex("5E 8D 64 24 04"));
+	// eax is saved inside of the context, ecx then points above the saved eax
+	EXPECT_EQ(toVector(RegisterSaves::contextPrologue<LIVE_EBX, LIVE_EAX, false>()), hex("53 50 8D 4C 24 04"));
+}
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(_WIN32)
+TEST(RegisterSaves, PreservesLiveStateX64)
+{
+	AsmPatchTests::ExecutableStub clobber;
+	DynamicAsmPatchBuilder clobberCode(clobber.address(), MODE_X64);
+	// xor also clears the carry flag
+	clobberCode.alu(ALU_XOR, R32_ESI, R32_ESI).alu(ALU_XOR, R64_R8, R64_R8).ret();
+	clobber.write(clobberCode.compile());
+
+	AsmPatchTests::ExecutableStub hook;
+	DynamicAsmPatchBuilder hookCode(hook.address(), MODE_X64);
+	hookCode.safeCall<LIVE_RSI | LIVE_R8 | LIVE_FLAGS>(clobber.address()).ret();
+	hook.write(hookCode.compile());
+
+	std::uintptr_t rsi = 0x1234;
+	register std::uintptr_t r8 asm("r8") = 0x5678;
+	std::uint8_t carry = 0;
+	// The call must not overwrite the red zone of this function
+	asm volatile(
+		"lea -128(%%rsp), %%rsp\n\t"
+		"stc\n\t"
+		"call *%[stub]\n\t"
+		"setc %[carry]\n\t"
+		"lea 128(%%rsp), %%rsp"
+		: "+S"(rsi), "+r"(r8), [carry] "=q"(carry)
+		: [stub] "r"(hook.address())
+		: "rax", "rcx", "rdx", "rdi", "r9", "r10", "r11", "memory", "cc");
+	// gtest takes its arguments by reference, which explicit register variables do not allow
+	const std::uintptr_t r8After = r8;
+	EXPECT_EQ(rsi, 0x1234u);
+	EXPECT_EQ(r8After, 0x5678u);
+	EXPECT_EQ(carry, 1);
+}
+
+TEST(RegisterSaves, ContextWriteBackX64)
+{
+	AsmPatchTests::ExecutableStub hook;
+	DynamicAsmPatchBuilder code(hook.address(), MODE_X64);
+	code.callLambdaWithContext([](AsmContext<LIVE_RSI | LIVE_RDX, LIVE_RAX | LIVE_RBX>& context) {
+		context.set<R64_RAX>(context.get<R64_RSI>() + context.get<R64_RDX>());
+		context.set<R64_RBX>(0xB0B);
+	}).ret();
+	hook.write(code.compile());
+
+	// SysV arguments: rdi, rsi, rdx; the result is read from rax
+	std::uintptr_t stub = hook.address();
+	std::uintptr_t first = 40;
+	std::uintptr_t second = 2;
+	std::uintptr_t rax;
+	std::uintptr_t rbx;
+	asm volatile(
+		"push %%rbx\n\t"
+		"lea -128(%%rsp), %%rsp\n\t"
+		"call *%[stub]\n\t"
+		"lea 128(%%rsp), %%rsp\n\t"
+		"mov %%rbx, %%rcx\n\t"
+		"pop %%rbx"
+		: "=a"(rax), "=c"(rbx), [stub] "+D"(stub), "+S"(first), "+d"(second)
+		:
+		: "r8", "r9", "r10", "r11", "memory", "cc");
+	EXPECT_EQ(rax, 42u);
+	EXPECT_EQ(rbx, 0xB0Bu);
+}
+#endif
@@ -0,0 +1,144 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include "AsmSignatureScanner.h"
+#include "TestUtils.h"
+
+using namespace AsmPatch;
+using AsmPatchTests::hex;
+using AsmBuilder::SignatureKernels::Level;
+
+namespace {
+	// Deterministic noise, so every level and thread count sees the same input
+	std::vector<std::uint8_t> noise(std::size_t size)
+	{
+		std::vector<std::uint8_t> data(size);
+		std::uint32_t state = 0x12345678;
+		for (std::uint8_t& byte : data) {
+			state = state * 1664525u + 1013904223u;
+			byte = static_cast<std::uint8_t>(state >> 24);
+		}
+		return data;
+	}
+
+	void plant(std::vector<std::uint8_t>& data, std::size_t offset, const char* bytes)
+	{
+		const std::vector<std::uint8_t> code = hex(bytes);
+		std::copy(code.begin(), code.end(), data.begin() + offset);
+	}
+}
+
+TEST(AsmSignatureScanner, FindsAllSignatures)
+{
+	std::vector<std::uint8_t> data(64 * 1024, 0xCC);
+	const std::vector<std::uint8_t> call = hex("E8 01 02 03 04 85 C0 74 10");
+	std::copy(call.begin(), call.end(), data.begin() + 100);
+	std::copy(call.begin(), call.end(), data.begin() + 40000);
+	const std::vector<std::uint8_t> unique = hex("8B 0D 44 33 22 11 90");
+	std::copy(unique.begin(), unique.end(), data.begin() + 5000);
+
+	AsmSignatureScanner scanner;
+	const std::size_t calls = scanner.add(AsmSignature("E8 ?? ?? ?? ?? 85 C0 74 ?", 5));
+	const std::size_t load = scanner.add(AsmSignature("8B 0D ?? ?? ?? ?? 90"));
+	const std::size_t missing = scanner.add(AsmSignature("0F 0B"));
+	const AsmSignatureResults results = scanner.scan(data.data(), data.size(), 0x401000, 1);
+
+	EXPECT_EQ(results.getMatches(calls), (std::vector<std::uintptr_t>{ 0x401000 + 105, 0x401000 + 40005 }));
+	EXPECT_EQ(results.getUnique(load), 0x401000u + 5000);
+	EXPECT_TRUE(results.getMatches(missing).empty());
+	EXPECT_THROW(results.getUnique(calls), AsmSignatureNotFound);
+	EXPECT_THROW(AsmSignature("E8 0"), AsmSignatureInvalid);
+}
+
+TEST(AsmSignatureScanner, TinyInputs)
+{
+	AsmSignatureScanner scanner;
+	const std::size_t quad = scanner.add(AsmSignature("8B 0D 44 33"));
+	const std::size_t pair = scanner.add(AsmSignature("0D 44"));
+	const std::vector<std::uint8_t> full = hex("8B 0D 44 33");
+	for (auto level : { AsmBuilder::SignatureKernels::LEVEL_SCALAR, AsmBuilder::SignatureKernels::detectLevel() }) {
+		scanner.setLevel(level);
+		for (std::size_t size = 0; size <= full.size(); size++) {
+			// Exactly sized heap copies, so reads past the end are caught by sanitizers
+			const std::vector<std::uint8_t> data(full.begin(), full.begin() + size);
+			const AsmSignatureResults results = scanner.scan(data.data(), data.size(), 0x401000, 1);
+			EXPECT_EQ(results.getMatches(quad).size(), size == 4 ? 1u : 0u);
+			EXPECT_EQ(results.getMatches(pair).size(), size >= 3 ? 1u : 0u);
+		}
+	}
+}
+
+TEST(AsmSignature, SharesExpectationSyntax)
+{
+	const char* pattern = "E8 ?? ?? ?? ? 0F 8? ?0";
+	const AsmSignature signature(pattern);
+	AsmPatchData patch(0x401000, hex("90"));
+	patch.expect(pattern);
+	EXPECT_EQ(signature.getBytes(), patch.getExpected());
+	EXPECT_EQ(signature.getMask(), patch.getExpectedMask());
+	EXPECT_EQ(signature.getMask(), hex("FF 00 00 00 00 FF F0 0F"));
+
+	// Nibbles are compared but never anchor a signature
+	EXPECT_THROW(AsmSignature("8? ?0 ??"), AsmSignatureInvalid);
+	EXPECT_THROW(AsmSignature("E8 0"), AsmSignatureInvalid);
+
+	std::vector<std::uint8_t> data(4096, 0xCC);
+	const std::vector<std::uint8_t> je = hex("0F 84 10 00 00 00");
+	const std::vector<std::uint8_t> jne = hex("0F 85 20 00 00 00");
+	std::copy(je.begin(), je.end(), data.begin() + 100);
+	std::copy(jne.begin(), jne.end(), data.begin() + 200);
+	AsmSignatureScanner scanner;
+	const std::size_t jcc = scanner.add(AsmSignature("0F 8? ?0 00"));
+	const std::size_t jneOnly = scanner.add(AsmSignature("0F 85 2?"));
+	const AsmSignatureResults results = scanner.scan(data.data(), data.size(), 0x401000, 1);
+	EXPECT_EQ(results.getMatches(jcc), (std::vector<std::uintptr_t>{ 0x401000 + 100, 0x401000 + 200 }));
+	EXPECT_EQ(results.getUnique(jneOnly), 0x401000u + 200);
+}
+
+TEST(AsmSignatureScanner, LevelsAndThreadsAgree)
+{
+	// Large enough to be split across four threads
+	constexpr std::size_t Size = 4 * 1024 * 1024;
+	std::vector<std::uint8_t> data = noise(Size);
+	// Zeros match at every position around the slice boundaries of 2, 3 and 4 threads, so bytes a slice
+	// skips or scans twice change the results
+	for (std::size_t boundary : { Size / 4, Size / 3, Size / 2, Size / 3 * 2, Size / 4 * 3 }) {
+		std::fill(data.begin() + boundary - 64, data.begin() + boundary + 64, 0x00);
+	}
+	for (std::size_t offset : { std::size_t(0), std::size_t(70000), Size / 4 + 1000, Size / 2 + 1000, Size - 16 }) {
+		plant(data, offset, "E8 01 02 03 04 85 C0 74 10");
+		plant(data, offset + 9, "0F 85 21 00");
+	}
+
+	AsmSignatureScanner scanner;
+	// Quad, pair and single byte anchors, a nibble wildcard and signatures with thousands of matches
+	scanner.add(AsmSignature("E8 ?? ?? ?? ?? 85 C0 74 ??", 5));
+	scanner.add(AsmSignature("0F 8? 2? 00"));
+	scanner.add(AsmSignature("85 C0"));
+	scanner.add(AsmSignature("74 ?? ?? 85"));
+	scanner.add(AsmSignature("00 00 00 00"));
+	scanner.add(AsmSignature("00 00"));
+	scanner.add(AsmSignature("00 ?? 00"));
+	scanner.add(AsmSignature("C3"));
+
+	scanner.setLevel(AsmBuilder::SignatureKernels::LEVEL_SCALAR);
+	const AsmSignatureResults reference = scanner.scan(data.data(), data.size(), 0x10000000, 1);
+	ASSERT_GE(reference.getMatches(0).size(), 5u);
+	ASSERT_GE(reference.getMatches(1).size(), 5u);
+	ASSERT_GE(reference.getMatches(4).size(), 5u * 125);
+
+	const Level detected = AsmBuilder::SignatureKernels::detectLevel();
+	for (Level level : { AsmBuilder::SignatureKernels::LEVEL_SCALAR, AsmBuilder::SignatureKernels::LEVEL_SSSE3, AsmBuilder::SignatureKernels::LEVEL_AVX2 }) {
+		if (level > detected) {
+			continue;
+		}
+		scanner.setLevel(level);
+		for (unsigned threads : { 1u, 2u, 3u, 4u }) {
+			const AsmSignatureResults results = scanner.scan(data.data(), data.size(), 0x10000000, threads);
+			for (std::size_t signature = 0; signature < scanner.getSignatures().size(); signature++) {
+				EXPECT_EQ(results.getMatches(signature), reference.getMatches(signature)) << "level " << level << ", " << threads << " threads, signature " << signature;
+			}
+		}
+	}
+}
@@ -0,0 +1,91 @@
+#include <gtest/gtest.h>
+#include "AsmStubAllocator.h"
+#include "DynamicAsmPatchBuilder.h"
+#include "TestUtils.h"
+
+using namespace AsmPatch;
+using namespace AsmPatch::AsmConsts;
+
+namespace {
+	int protectionOf(std::uintptr_t addr)
+	{
+		std::vector<AsmBuilder::MemoryUtils::MappedRegion> regions;
+		AsmBuilder::MemoryUtils::ProtectionMap().split(addr, addr + 1, regions);
+		return regions.empty() ? -1 : regions[0].mProt;
+	}
+
+	std::uintptr_t distance(std::uintptr_t a, std::uintptr_t b)
+	{
+		return a > b ? a - b : b - a;
+	}
+}
+
+TEST(AsmStubAllocator, PacksStubsNearSite)
+{
+	const std::uintptr_t site = reinterpret_cast<std::uintptr_t>(&protectionOf);
+	AsmStubAllocator stubs;
+	const std::uintptr_t first = stubs.allocate(5, site);
+	const std::uintptr_t second = stubs.allocate(5, site);
+	EXPECT_LT(distance(first, site), 0x7FFFFFFFu);
+	EXPECT_EQ(second, first + 16);
+	EXPECT_EQ(protectionOf(first), PROT_READ | PROT_WRITE);
+
+	stubs.write(Patch(first).jmp(site).compile());
+	EXPECT_THROW(stubs.write(Patch(second + 16).nop().compile()), AsmPatchStubNotWritable);
+	stubs.commit();
+	EXPECT_EQ(protectionOf(first), PROT_READ | PROT_EXEC);
+	EXPECT_THROW(stubs.write(Patch(first).nop().compile()), AsmPatchStubNotWritable);
+
+	// Committed pages are not reopened
+	const std::uintptr_t third = stubs.allocate(5, site);
+	EXPECT_EQ(third % AsmBuilder::MemoryUtils::pageSize(), 0u);
+	EXPECT_EQ(stubs.getStats().mRegions, 1u);
+	EXPECT_EQ(stubs.getStats().mProtectCalls, 1u);
+}
+
+TEST(AsmStubAllocator, SharesIdenticalStubs)
+{
+	const std::uintptr_t site = reinterpret_cast<std::uintptr_t>(&protectionOf);
+	AsmStubAllocator stubs;
+	DynamicAsmPatchBuilder first(site);
+	first.pushEAX().jmp(site);
+	DynamicAsmPatchBuilder sameTarget(site + 0x5000);
+	sameTarget.pushEAX().jmp(site);
+	DynamicAsmPatchBuilder otherTarget(site);
+	otherTarget.pushEAX().jmp(site + 1);
+
+	const std::uintptr_t stub = stubs.place(first.compileTemplate(), site);
+	EXPECT_EQ(stubs.place(sameTarget.compileTemplate(), site), stub);
+	EXPECT_NE(stubs.place(otherTarget.compileTemplate(), site), stub);
+	EXPECT_EQ(stubs.getStats().mSharedStubs, 1u);
+	EXPECT_EQ(stubs.getStats().mStubs, 2u);
+	// push eax / jmp site
+	EXPECT_EQ(stub + 6 + *reinterpret_cast<const std::int32_t*>(stub + 2), site);
+}
+
+#if defined(__x86_64__)
+TEST(AsmStubAllocator, PlaceOutOfReachKeepsMemory)
+{
+	const std::uintptr_t site = reinterpret_cast<std::uintptr_t>(&protectionOf);
+	AsmStubAllocator stubs;
+	const std::uintptr_t before = stubs.allocate(16, site);
+
+	// The call target is far out of reach of any stub near site
+	DynamicAsmPatchBuilder far(site ^ 0x400000000000ull, MODE_X64);
+	far.call((site ^ 0x400000000000ull) + 0x1000);
+	EXPECT_THROW(stubs.place(far.compileTemplate(), site), AsmPatchRel32OutOfRange);
+
+	EXPECT_EQ(stubs.getStats().mStubs, 1u);
+	EXPECT_EQ(stubs.allocate(16, site), before + 16);
+}
+
+TEST(AsmStubAllocator, ExecutesCommittedStubs)
+{
+	AsmStubAllocator stubs;
+	DynamicAsmPatchBuilder code(std::uintptr_t(0), MODE_X64);
+	code.mov(R32_EAX, 42).ret();
+	const std::uintptr_t stub = stubs.place(code.compileTemplate());
+	stubs.commit();
+	EXPECT_EQ(reinterpret_cast<int (*)()>(stub)(), 42);
+}
+#endif
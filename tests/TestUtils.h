@@ -0,0 +1,80 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "AsmPatchBuilder.h"
+#include "details/ExecutableMemory.h"
+#include "details/HexPattern.h"
+
+namespace AsmPatchTests {
+
+// "E8 FB 0F 00 00" to bytes, in the pattern syntax of the library without wildcards
+inline std::vector<std::uint8_t> hex(const char* text)
+{
+	std::vector<std::uint8_t> bytes;
+	std::vector<std::uint8_t> mask;
+	if (!AsmBuilder::HexPattern::parse(text, bytes, mask) || std::count(mask.begin(), mask.end(), 0xFF) != static_cast<std::ptrdiff_t>(mask.size())) {
+		std::abort();
+	}
+	return bytes;
+}
+
+inline std::vector<std::uint8_t> bytesOf(const AsmPatch::AsmPatchData& patch)
+{
+	return std::vector<std::uint8_t>(patch.getData().begin(), patch.getData().end());
+}
+
+template<typename Builder>
+std::vector<std::uint8_t> bytesOf(const Builder& builder)
+{
+	return bytesOf(builder.compile());
+}
+
+// Executable page the tests build code into and call like a function. The address is known before
+// the code is built, so relative branches out of it are encoded for their final position.
+class ExecutableStub
+{
+	void* mMemory;
+	std::size_t mSize;
+
+public:
+	ExecutableStub() :
+		mSize(AsmBuilder::ExecutableMemory::pageSize())
+	{
+		mMemory = AsmBuilder::ExecutableMemory::allocate(mSize);
+		if (!mMemory) {
+			std::abort();
+		}
+	}
+
+	ExecutableStub(const ExecutableStub&) = delete;
+	ExecutableStub& operator=(const ExecutableStub&) = delete;
+
+	~ExecutableStub()
+	{
+		munmap(mMemory, mSize);
+	}
+
+	std::uintptr_t address() const
+	{
+		return reinterpret_cast<std::uintptr_t>(mMemory);
+	}
+
+	void write(const AsmPatch::AsmPatchData& patch)
+	{
+		std::memcpy(mMemory, patch.getData().data(), patch.getData().size());
+		AsmBuilder::ExecutableMemory::flushInstructionCache(mMemory, patch.getData().size());
+	}
+
+	template<typename Func>
+	Func as() const
+	{
+		return reinterpret_cast<Func>(mMemory);
+	}
+};
+
+}
@@ -0,0 +1,19 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+// Patched on disk by ImagePatcherTests, its return value becomes the exit code
+extern "C" __attribute__((noinline)) int fixtureValue()
+{
+	return 42;
+}
+
+int main(int argc, char** argv)
+{
+	int (*volatile value)() = &fixtureValue;
+	if (argc > 1 && std::strcmp(argv[1], "address") == 0) {
+		std::printf("%llx\n", static_cast<unsigned long long>(reinterpret_cast<std::uintptr_t>(value)));
+		return 0;
+	}
+	return value();
+}